@@ -1,5 +1,12 @@
 #include <asio_pbrpc/pbrpc/rpc_server.h>
 #include <asio_pbrpc/pbrpc/sync_rpc_client.h>
 #include <asio_pbrpc/pbrpc/async_rpc_client.h>
+#include <asio_pbrpc/pbrpc/rpc_future.h>
+#include <asio_pbrpc/pbrpc/rpc_stream.h>
 #include <asio_pbrpc/pbrpc/future_rpc_client.h>
+#include <asio_pbrpc/pbrpc/rpc_coroutine.h>
 #include <asio_pbrpc/pbrpc/client_rpc_controller.h>
+#include <asio_pbrpc/pbrpc/pooled_rpc_channel.h>
+#include <asio_pbrpc/pbrpc/sharded_rpc_channel.h>
+#include <asio_pbrpc/pbrpc/fan_out.h>
+#include <asio_pbrpc/pbrpc/cached_rpc_channel.h>
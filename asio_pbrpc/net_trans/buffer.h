@@ -6,7 +6,11 @@
 
 #pragma once
 
+#include <sys/types.h>
+#include <unistd.h>
+
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <algorithm>
 #include <memory>
@@ -19,9 +23,19 @@ class Buffer;
 typedef std::shared_ptr<Buffer> BufferPtr;
 typedef std::weak_ptr<Buffer> BufferWeakPtr;
 
+// bytes used in place, the owner, if any, keeps them valid,
+// or with a file descriptor, size bytes of the file from offset, data unused
+struct BufferSlice {
+  const char* data;
+  size_t size;
+  std::shared_ptr<const void> owner;
+  int fd { -1 };
+  off_t offset { 0 };
+};
+
 class Buffer {
  public:
-  Buffer(size_t size = kInitSize) : buffer_(kInitSize) {}
+  Buffer(size_t size = kInitSize) : buffer_(size) {}
 
   const char* read_buffer() const {
     return begin() + read_index_;
@@ -58,6 +72,18 @@ class Buffer {
     return len <= readable_bytes();
   }
 
+  template <typename Type>
+  Type peek() const {
+    return *reinterpret_cast<const Type*>(read_buffer());
+  }
+
+  // overwrites readable bytes at offset
+  template <typename Type>
+  void poke(size_t offset, Type value) {
+    assert(offset + sizeof(Type) <= readable_bytes());
+    *reinterpret_cast<Type*>(begin() + read_index_ + offset) = value;
+  }
+
   template <typename Type>
   Type read() {
     Type ret(*reinterpret_cast<const Type*>(read_buffer()));
@@ -81,6 +107,40 @@ class Buffer {
     std::copy(data, data + len, write_buffer());
     consume(len);
   }
+  // a file slice is read in, false if the file ends before the slice
+  bool write(const BufferSlice& slice) {
+    if (slice.fd < 0) {
+      write(slice.data, slice.size);
+      return true;
+    }
+    ensure_writable_bytes(slice.size);
+    for (size_t done = 0; done < slice.size; ) {
+      ssize_t bytes = pread(slice.fd, write_buffer() + done, slice.size - done,
+          slice.offset + done);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        return false;
+      }
+      done += bytes;
+    }
+    consume(slice.size);
+    return true;
+  }
+
+  // data goes in front of the readable bytes, into the bytes already read,
+  // the readable bytes only move if there are not enough of those
+  void prepend(const char* data, size_t len) {
+    if (read_index_ < len) {
+      size_t gap = len - read_index_;
+      buffer_.insert(buffer_.begin() + read_index_, gap, 0);
+      read_index_ += gap;
+      write_index_ += gap;
+    }
+    read_index_ -= len;
+    std::copy(data, data + len, begin() + read_index_);
+  }
 
   size_t readable_bytes() const {
     return write_index_ - read_index_;
@@ -100,6 +160,10 @@ class Buffer {
     swap(other);
   }
 
+  void reserve(size_t len) {
+    ensure_writable_bytes(len);
+  }
+
   void expand(size_t len) {
     buffer_.resize(buffer_.size() + len);
   }
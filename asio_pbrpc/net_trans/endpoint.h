@@ -0,0 +1,63 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <sys/socket.h>
+
+#include <cstring>
+#include <string>
+
+#include <boost/asio.hpp>
+
+namespace asio_pbrpc {
+
+// TCP and Unix domain stream sockets behind one type,
+// a connection or an acceptor of it is opened with the family of its endpoint
+typedef boost::asio::generic::stream_protocol StreamProtocol;
+typedef boost::asio::local::stream_protocol::endpoint LocalEndpoint;
+
+inline std::string EndpointText(const boost::asio::ip::tcp::endpoint& endpoint) {
+  return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+}
+
+inline std::string EndpointText(const LocalEndpoint& endpoint) {
+  return endpoint.path();
+}
+
+inline std::string EndpointText(const StreamProtocol::endpoint& endpoint) {
+  switch (endpoint.protocol().family()) {
+  case AF_INET:
+  case AF_INET6: {
+    boost::asio::ip::tcp::endpoint tcp;
+    std::memcpy(tcp.data(), endpoint.data(), endpoint.size());
+    tcp.resize(endpoint.size());
+    return EndpointText(tcp);
+  }
+  case AF_UNIX: {
+    LocalEndpoint local;
+    std::memcpy(local.data(), endpoint.data(), endpoint.size());
+    local.resize(endpoint.size());
+    return EndpointText(local);
+  }
+  default:
+    return std::string();
+  }
+}
+
+// Nagle and delayed ACKs only exist on TCP
+inline bool IsTCPEndpoint(const boost::asio::ip::tcp::endpoint&) {
+  return true;
+}
+inline bool IsTCPEndpoint(const LocalEndpoint&) {
+  return false;
+}
+inline bool IsTCPEndpoint(const StreamProtocol::endpoint& endpoint) {
+  int family = endpoint.protocol().family();
+  return family == AF_INET || family == AF_INET6;
+}
+
+}
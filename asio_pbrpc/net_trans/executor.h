@@ -27,7 +27,7 @@ class Executor {
     if (running_.load(std::memory_order_acquire)) {
       return;
     }
-    running_.store(std::memory_order_release);
+    running_.store(true, std::memory_order_release);
     auto run = [this] {
       while (running_.load(std::memory_order_acquire)) {
         try {
@@ -46,6 +46,9 @@ class Executors {
 
   boost::asio::io_service& io_service() { return NextExcutor().io_service(); }
 
+  size_t size() const { return executors_.size(); }
+  Executor& at(size_t index) { return *executors_[index]; }
+
   template <class T>
   boost::asio::io_service& io_service(const T& key) {
     return executors_[std::hash<T>()(key) % executors_.size()]->io_service();
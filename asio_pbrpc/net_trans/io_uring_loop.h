@@ -0,0 +1,443 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+// built with -DASIO_PBRPC_IO_URING, needs Linux 6.0 or later at run time
+#if defined(ASIO_PBRPC_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace asio_pbrpc {
+
+// One io_uring per event loop, shared by the connections of the loop.
+// Receives are multishot into a ring of registered provided buffers, sends are gathered
+// with sendmsg, files are spliced. Everything prepared during
+// one turn of the loop goes to the kernel with a single io_uring_enter, completions are
+// reaped on the loop when the ring's eventfd turns readable.
+class IoUringLoop : public std::enable_shared_from_this<IoUringLoop> {
+ public:
+  // the result and flags of a completion, a receive gets one per chunk read
+  typedef std::function<void(int, uint32_t)> Handler;
+
+  enum : unsigned {
+    kEntries = 1024,
+    // provided receive buffers, a power of two
+    kBufferCount = 256,
+    kBufferSize = 16 * 1024,
+  };
+
+  // nullptr if the kernel has no io_uring or misses one of the features used
+  static std::shared_ptr<IoUringLoop> Create(boost::asio::io_service& io_service) {
+    std::shared_ptr<IoUringLoop> loop(new IoUringLoop(io_service));
+    if (!loop->Setup()) {
+      return nullptr;
+    }
+    loop->Wait();
+    return loop;
+  }
+
+  ~IoUringLoop() {
+    if (ring_fd_ >= 0) {
+      close(ring_fd_);
+    }
+    Unmap(ring_, ring_size_);
+    Unmap(sqes_, sqes_size_);
+    Unmap(buffer_ring_, kBufferCount * sizeof(io_uring_buf));
+    Unmap(buffers_, kBufferCount * kBufferSize);
+  }
+
+  // reads fd into the provided buffers until cancelled or failed, a handler given
+  // a positive result takes the bytes from Buffer and gives the buffer back with Recycle.
+  // Every operation fails with -EBUSY while the kernel takes no more submissions
+  uint64_t Receive(int fd, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = Add(std::move(handler));
+    io_uring_sqe* sqe = Prepare(IORING_OP_RECV, fd, id);
+    if (!sqe) {
+      return id;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    Commit();
+    return id;
+  }
+
+  // the bytes stay with the caller until the handler runs,
+  // a closed socket fails the send with -EPIPE rather than raising SIGPIPE
+  void Send(int fd, const iovec* iov, size_t count, Handler handler) {
+    SendMessage(IORING_OP_SENDMSG, fd, iov, count, std::move(handler));
+  }
+
+  // the kernel reads the bytes in place, the handler runs once with the result and,
+  // unless the send failed, once more with IORING_CQE_F_NOTIF when they may be released
+  void SendZeroCopy(int fd, const iovec* iov, size_t count, Handler handler) {
+    SendMessage(IORING_OP_SENDMSG_ZC, fd, iov, count, std::move(handler));
+  }
+
+  // up to len bytes from fd_in at offset, -1 for a pipe, to fd_out, one of them a pipe,
+  // the kernel moves the pages without a copy through user space
+  void Splice(int fd_in, int64_t offset, int fd_out, unsigned len, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = Add(std::move(handler));
+    io_uring_sqe* sqe = Prepare(IORING_OP_SPLICE, fd_out, id);
+    if (!sqe) {
+      return;
+    }
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = static_cast<uint64_t>(offset);
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->len = len;
+    Commit();
+  }
+
+  // the operation completes with -ECANCELED unless it finished already
+  void Cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!operations_.count(id)) {
+      return;
+    }
+    io_uring_sqe* sqe = Prepare(IORING_OP_ASYNC_CANCEL, -1, 0);
+    if (!sqe) {
+      // tried again once some completions are reaped
+      auto self(shared_from_this());
+      io_service_.post([this, self, id] { Cancel(id); });
+      return;
+    }
+    sqe->addr = id;
+    Commit();
+  }
+
+  // submits at once what is prepared, before a socket it refers to is closed
+  void Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Submit();
+  }
+
+  const char* Buffer(uint32_t flags) const {
+    return buffers_ + (flags >> IORING_CQE_BUFFER_SHIFT) * kBufferSize;
+  }
+
+  // only from a handler, they run one at a time
+  void Recycle(uint32_t flags) {
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+      return;
+    }
+    Provide(flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+  }
+
+  boost::asio::io_service& io_service() {
+    return io_service_;
+  }
+
+ private:
+  IoUringLoop(const IoUringLoop&) = delete;
+  IoUringLoop& operator=(const IoUringLoop&) = delete;
+
+  enum : uint16_t { kBufferGroup = 0 };
+
+  struct Operation {
+    Handler handler;
+    msghdr message {};
+    std::vector<iovec> iov;
+  };
+
+  explicit IoUringLoop(boost::asio::io_service& io_service) :
+    io_service_(io_service), event_(io_service) {}
+
+  bool Setup() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kEntries * 4;
+    ring_fd_ = syscall(__NR_io_uring_setup, kEntries, &params);
+    if (ring_fd_ < 0) {
+      std::cerr << "io_uring setup failed: " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+      std::cerr << "io_uring setup failed: kernel too old" << std::endl;
+      return false;
+    }
+    ring_size_ = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring_ = Map(ring_size_, ring_fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(Map(sqes_size_, ring_fd_, IORING_OFF_SQES));
+    buffer_ring_ = reinterpret_cast<io_uring_buf_ring*>(
+        Map(kBufferCount * sizeof(io_uring_buf), -1, 0));
+    buffers_ = Map(kBufferCount * kBufferSize, -1, 0);
+    if (!ring_ || !sqes_ || !buffer_ring_ || !buffers_) {
+      std::cerr << "io_uring setup failed: " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    sq_entries_ = params.sq_entries;
+    sq_head_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(ring_ + params.cq_off.cqes);
+
+    io_uring_buf_reg buffer_reg;
+    std::memset(&buffer_reg, 0, sizeof(buffer_reg));
+    buffer_reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+    buffer_reg.ring_entries = kBufferCount;
+    buffer_reg.bgid = kBufferGroup;
+    if (!Register(IORING_REGISTER_PBUF_RING, &buffer_reg, 1)) {
+      return false;
+    }
+    for (unsigned i = 0; i < kBufferCount; ++i) {
+      Provide(i);
+    }
+    __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+      std::cerr << "io_uring setup failed: " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    event_.assign(event_fd);
+    return Register(IORING_REGISTER_EVENTFD, &event_fd, 1);
+  }
+
+  bool Register(unsigned opcode, void* arg, unsigned count) {
+    if (syscall(__NR_io_uring_register, ring_fd_, opcode, arg, count) < 0) {
+      std::cerr << "io_uring register failed: " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  static char* Map(size_t size, int fd, off_t offset) {
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+        fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED | MAP_POPULATE, fd, offset);
+    return address == MAP_FAILED ? nullptr : static_cast<char*>(address);
+  }
+
+  template <class Type>
+  static void Unmap(Type* address, size_t size) {
+    if (address) {
+      munmap(address, size);
+    }
+  }
+
+  void Provide(unsigned id) {
+    // bufs is behind an empty struct, a byte in C++, the entries start at the ring itself
+    io_uring_buf& buffer = reinterpret_cast<io_uring_buf*>(buffer_ring_)[
+        buffer_tail_ & (kBufferCount - 1)];
+    buffer.addr = reinterpret_cast<uint64_t>(buffers_ + id * kBufferSize);
+    buffer.len = kBufferSize;
+    buffer.bid = id;
+    ++buffer_tail_;
+  }
+
+  // with mutex_ held
+  uint64_t Add(Handler handler) {
+    uint64_t id = ++last_id_;
+    std::unique_ptr<Operation> operation(new Operation);
+    operation->handler = std::move(handler);
+    operations_.emplace(id, std::move(operation));
+    return id;
+  }
+
+  // with mutex_ held, the gathered bytes of a send go with MSG_NOSIGNAL
+  void SendMessage(uint8_t opcode, int fd, const iovec* iov, size_t count, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = Add(std::move(handler));
+    Operation& operation = *operations_[id];
+    operation.iov.assign(iov, iov + count);
+    operation.message.msg_iov = operation.iov.data();
+    operation.message.msg_iovlen = count;
+    io_uring_sqe* sqe = Prepare(opcode, fd, id);
+    if (!sqe) {
+      return;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(&operation.message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    Commit();
+  }
+
+  // With mutex_ held, the entry goes to the kernel after Commit. nullptr if the
+  // submission queue stays full, an operation given is then failed with -EBUSY,
+  // overwriting an entry the kernel has not taken yet would lose it
+  io_uring_sqe* Prepare(uint8_t opcode, int fd, uint64_t id) {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+      Submit();
+      if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+        if (id) {
+          Fail(id, -EBUSY);
+        }
+        return nullptr;
+      }
+    }
+    unsigned index = sq_local_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = id;
+    sq_array_[index] = index;
+    return sqe;
+  }
+
+  // with mutex_ held, the handler runs on the loop later, never under the lock
+  void Fail(uint64_t id, int result) {
+    auto it = operations_.find(id);
+    std::shared_ptr<Operation> operation(std::move(it->second));
+    operations_.erase(it);
+    io_service_.post([operation, result] {
+      operation->handler(result, 0);
+    });
+  }
+
+  // the first entry of a turn of the loop schedules the submission of them all
+  void Commit() {
+    __atomic_store_n(sq_tail_, ++sq_local_tail_, __ATOMIC_RELEASE);
+    ++pending_;
+    PostSubmit();
+  }
+
+  // with mutex_ held
+  void PostSubmit() {
+    if (flush_posted_) {
+      return;
+    }
+    flush_posted_ = true;
+    auto self(shared_from_this());
+    io_service_.post([this, self] {
+      std::lock_guard<std::mutex> lock(mutex_);
+      flush_posted_ = false;
+      Submit();
+    });
+  }
+
+  // with mutex_ held
+  void Submit() {
+    while (pending_) {
+      int submitted = syscall(__NR_io_uring_enter, ring_fd_, pending_, 0, 0, nullptr, 0);
+      if (submitted >= 0) {
+        pending_ -= submitted;
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EBUSY) {
+        std::cerr << "io_uring submit failed: " << std::strerror(errno) << std::endl;
+      }
+      // completions to reap first, try again on the next turn
+      PostSubmit();
+      return;
+    }
+  }
+
+  // one wait for the eventfd at a time, so handlers never run concurrently
+  void Wait() {
+    auto self(shared_from_this());
+    event_.async_read_some(boost::asio::buffer(&event_count_, sizeof(event_count_)),
+        [this, self](const boost::system::error_code& ec, size_t) {
+      if (ec) {
+        if (ec != boost::asio::error::operation_aborted) {
+          std::cerr << "io_uring wait failed: " << ec.message() << std::endl;
+        }
+        return;
+      }
+      Reap();
+      Wait();
+    });
+  }
+
+  void Reap() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        uint64_t id = cqe.user_data;
+        int result = cqe.res;
+        uint32_t flags = cqe.flags;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        Complete(id, result, flags);
+      }
+      tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  void Complete(uint64_t id, int result, uint32_t flags) {
+    // cancellations carry no handler
+    if (!id) {
+      return;
+    }
+    std::unique_ptr<Operation> finished;
+    Operation* operation;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = operations_.find(id);
+      if (it == operations_.end()) {
+        return;
+      }
+      operation = it->second.get();
+      if (!(flags & IORING_CQE_F_MORE)) {
+        finished = std::move(it->second);
+        operations_.erase(it);
+      }
+    }
+    // a multishot operation stays until its last completion, reaped here too
+    operation->handler(result, flags);
+  }
+
+  boost::asio::io_service& io_service_;
+  int ring_fd_ { -1 };
+  char* ring_ { nullptr };
+  size_t ring_size_ { 0 };
+  io_uring_sqe* sqes_ { nullptr };
+  size_t sqes_size_ { 0 };
+  unsigned sq_entries_ { 0 }, sq_mask_ { 0 }, cq_mask_ { 0 };
+  unsigned *sq_head_ { nullptr }, *sq_tail_ { nullptr }, *sq_array_ { nullptr };
+  unsigned *cq_head_ { nullptr }, *cq_tail_ { nullptr };
+  io_uring_cqe* cqes_ { nullptr };
+  io_uring_buf_ring* buffer_ring_ { nullptr };
+  char* buffers_ { nullptr };
+  uint16_t buffer_tail_ { 0 };
+  boost::asio::posix::stream_descriptor event_;
+  uint64_t event_count_ { 0 };
+  // guards submission and the operations, handlers are called without it
+  std::mutex mutex_;
+  unsigned sq_local_tail_ { 0 };
+  unsigned pending_ { 0 };
+  bool flush_posted_ { false };
+  uint64_t last_id_ { 0 };
+  std::unordered_map<uint64_t, std::unique_ptr<Operation>> operations_;
+};
+
+}
+
+#endif
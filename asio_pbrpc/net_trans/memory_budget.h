@@ -0,0 +1,175 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace asio_pbrpc {
+
+// Byte budget shared by all connections of a server.
+// Connections charge what they hold to their own account, which also charges the budget,
+// a connection over its own limit or on an exhausted budget stops reading
+// and parks until some memory is released.
+class MemoryBudget {
+ public:
+  enum Category {
+    kInputBuffer = 0,
+    kOutputBuffer,
+    kInFlight,
+    kCategoryCount
+  };
+
+  class Account {
+   public:
+    Account() = default;
+    ~Account() { Reset(); }
+
+    void budget(MemoryBudget* budget) {
+      Reset();
+      budget_ = budget;
+    }
+    MemoryBudget* budget() const {
+      return budget_;
+    }
+
+    // negative bytes release
+    void Charge(Category category, std::ptrdiff_t bytes) {
+      if (!budget_ || !bytes) {
+        return;
+      }
+      usage_[category].fetch_add(static_cast<size_t>(bytes), std::memory_order_relaxed);
+      budget_->Charge(category, bytes);
+    }
+
+    // for gauges like the input buffer capacity
+    void Set(Category category, size_t bytes) {
+      if (!budget_) {
+        return;
+      }
+      size_t old_bytes = usage_[category].exchange(bytes, std::memory_order_relaxed);
+      budget_->Charge(category, static_cast<std::ptrdiff_t>(bytes - old_bytes));
+    }
+
+    bool Exhausted() const {
+      return budget_ && (usage() >= budget_->connection_limit() || budget_->Exhausted());
+    }
+
+    // resume is called once some memory is released, it should retry the read
+    void Park(std::function<void()> resume) {
+      assert(budget_);
+      budget_->Park(std::move(resume));
+      if (!Exhausted()) {
+        budget_->Wake();
+      }
+    }
+
+    size_t usage(Category category) const {
+      return usage_[category].load(std::memory_order_relaxed);
+    }
+    size_t usage() const {
+      size_t total = 0;
+      for (size_t i = 0; i < kCategoryCount; ++i) {
+        total += usage_[i].load(std::memory_order_relaxed);
+      }
+      return total;
+    }
+
+   private:
+    Account(const Account&) = delete;
+    Account& operator=(const Account&) = delete;
+
+    void Reset() {
+      for (size_t i = 0; i < kCategoryCount; ++i) {
+        Charge(static_cast<Category>(i), -static_cast<std::ptrdiff_t>(
+            usage_[i].load(std::memory_order_relaxed)));
+      }
+    }
+
+    MemoryBudget* budget_ { nullptr };
+    std::atomic_size_t usage_[kCategoryCount] {};
+  };
+
+  MemoryBudget(size_t limit = size_t(1) << 30, size_t connection_limit = size_t(64) << 20) :
+    limit_(limit), connection_limit_(connection_limit) {}
+
+  void limit(size_t limit) {
+    limit_.store(limit, std::memory_order_relaxed);
+    Wake();
+  }
+  size_t limit() const {
+    return limit_.load(std::memory_order_relaxed);
+  }
+
+  // should exceed twice the max message length, or a large frame may never complete
+  void connection_limit(size_t connection_limit) {
+    connection_limit_.store(connection_limit, std::memory_order_relaxed);
+    Wake();
+  }
+  size_t connection_limit() const {
+    return connection_limit_.load(std::memory_order_relaxed);
+  }
+
+  bool Exhausted() const {
+    return usage() >= limit();
+  }
+
+  size_t usage(Category category) const {
+    return usage_[category].load(std::memory_order_relaxed);
+  }
+  size_t usage() const {
+    return total_.load(std::memory_order_relaxed);
+  }
+
+  // connections currently not reading
+  size_t parked() const {
+    return parked_count_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  void Charge(Category category, std::ptrdiff_t bytes) {
+    usage_[category].fetch_add(static_cast<size_t>(bytes), std::memory_order_relaxed);
+    total_.fetch_add(static_cast<size_t>(bytes), std::memory_order_relaxed);
+    if (bytes < 0 && parked_count_.load(std::memory_order_acquire) && !Exhausted()) {
+      Wake();
+    }
+  }
+
+  void Park(std::function<void()> resume) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    parked_.emplace_back(std::move(resume));
+    parked_count_.store(parked_.size(), std::memory_order_release);
+  }
+
+  void Wake() {
+    decltype(parked_) parked;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      parked.swap(parked_);
+      parked_count_.store(0, std::memory_order_release);
+    }
+    for (auto& resume : parked) {
+      resume();
+    }
+  }
+
+  std::atomic_size_t limit_, connection_limit_;
+  std::atomic_size_t usage_[kCategoryCount] {};
+  std::atomic_size_t total_ { 0 };
+  std::mutex mutex_;
+  std::vector<std::function<void()>> parked_;
+  std::atomic_size_t parked_count_ { 0 };
+};
+
+}
@@ -0,0 +1,212 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "executors.h"
+
+namespace asio_pbrpc {
+
+// Queues in front of the executors, three levels deep:
+// lanes are picked strictly by order or by smooth weighted round robin,
+// flows (a connection, a tenant) inside a lane share it by deficit round robin on task cost,
+// tasks of a flow run earliest deadline first.
+// Every scheduled task posts one anonymous pull to the executors, which runs whatever is picked
+// at that moment, tasks already expired when pulled are dropped through their expire callback.
+class RequestScheduler {
+ public:
+  typedef std::function<void()> Task;
+
+  RequestScheduler(Executors& executors, size_t lanes = 1) :
+    executors_(executors), lanes_(std::max<size_t>(lanes, 1)) {}
+
+  // deadline in microseconds since the system clock epoch, 0 for none
+  void Schedule(size_t lane, uint64_t flow, size_t cost, int64_t deadline,
+      Task task, Task expire) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Lane& target = lanes_[std::min(lane, lanes_.size() - 1)];
+      Flow& target_flow = target.flows[flow];
+      if (target_flow.queue.empty()) {
+        target_flow.id = flow;
+        target.active.push_back(&target_flow);
+      }
+      target_flow.queue.push(Item { deadline ? deadline : std::numeric_limits<int64_t>::max(),
+          sequence_++, cost, std::move(task), std::move(expire) });
+      target.queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    executors_.Execute([this] { RunOne(); });
+  }
+  void Schedule(size_t lane, int64_t deadline, Task task, Task expire) {
+    Schedule(lane, 0, 0, deadline, std::move(task), std::move(expire));
+  }
+  void Schedule(int64_t deadline, Task task, Task expire) {
+    Schedule(0, 0, 0, deadline, std::move(task), std::move(expire));
+  }
+
+  // lower lanes always go first, later lanes may starve
+  void strict() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& lane : lanes_) {
+      lane.weight = 0;
+    }
+  }
+  // share of the workers per lane when all of them are busy
+  void weights(const std::vector<size_t>& weights) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < lanes_.size(); ++i) {
+      lanes_[i].weight = i < weights.size() ? std::max<size_t>(weights[i], 1) : 1;
+      lanes_[i].current = 0;
+    }
+  }
+
+  // cost a flow of weight 1 may spend per round
+  void quantum(size_t quantum) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quantum_ = std::max<size_t>(quantum, 1);
+  }
+  void flow_weight(uint64_t flow, size_t weight) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flow_weights_[flow] = std::max<size_t>(weight, 1);
+  }
+
+  size_t queued(size_t lane) const {
+    return lanes_[lane].queued.load(std::memory_order_relaxed);
+  }
+  size_t queued() const {
+    size_t total = 0;
+    for (auto& lane : lanes_) {
+      total += lane.queued.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+  size_t expired() const {
+    return expired_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  RequestScheduler(const RequestScheduler&) = delete;
+  RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+  struct Item {
+    int64_t deadline;
+    uint64_t sequence;
+    size_t cost;
+    Task task, expire;
+
+    bool operator<(const Item& rhs) const {
+      // std::priority_queue pops the greatest
+      return deadline != rhs.deadline ? deadline > rhs.deadline : sequence > rhs.sequence;
+    }
+  };
+
+  struct Flow {
+    uint64_t id { 0 };
+    std::priority_queue<Item> queue;
+    size_t deficit { 0 };
+  };
+
+  struct Lane {
+    std::unordered_map<uint64_t, Flow> flows;
+    std::deque<Flow*> active;
+    size_t weight { 0 };
+    int64_t current { 0 };
+    std::atomic_size_t queued { 0 };
+  };
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  void RunOne() {
+    Item item;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Lane* lane = PickLane();
+      if (!lane) {
+        return;
+      }
+      item = PickItem(*lane);
+      lane->queued.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (item.deadline <= Now()) {
+      expired_.fetch_add(1, std::memory_order_relaxed);
+      if (item.expire) {
+        item.expire();
+      }
+      return;
+    }
+    item.task();
+  }
+
+  Lane* PickLane() {
+    Lane* picked = nullptr;
+    int64_t total = 0;
+    for (auto& lane : lanes_) {
+      if (lane.active.empty()) {
+        continue;
+      }
+      if (!lane.weight) {
+        return &lane;
+      }
+      lane.current += lane.weight;
+      total += lane.weight;
+      if (!picked || lane.current > picked->current) {
+        picked = &lane;
+      }
+    }
+    if (picked) {
+      picked->current -= total;
+    }
+    return picked;
+  }
+
+  // deficit round robin, the head flow runs as long as its deficit covers the next task
+  Item PickItem(Lane& lane) {
+    while (true) {
+      Flow* flow = lane.active.front();
+      const Item& top = flow->queue.top();
+      if (flow->deficit < top.cost) {
+        auto weight = flow_weights_.find(flow->id);
+        flow->deficit += quantum_ * (weight == flow_weights_.end() ? 1 : weight->second);
+        lane.active.pop_front();
+        lane.active.push_back(flow);
+        continue;
+      }
+      flow->deficit -= top.cost;
+      Item item(std::move(const_cast<Item&>(top)));
+      flow->queue.pop();
+      if (flow->queue.empty()) {
+        lane.active.pop_front();
+        lane.flows.erase(flow->id);
+      }
+      return item;
+    }
+  }
+
+  Executors& executors_;
+  std::mutex mutex_;
+  std::vector<Lane> lanes_;
+  std::unordered_map<uint64_t, size_t> flow_weights_;
+  size_t quantum_ { 16 * 1024 };
+  uint64_t sequence_ { 0 };
+  std::atomic_size_t expired_ { 0 };
+};
+
+}
@@ -0,0 +1,432 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace asio_pbrpc {
+
+// One direction of a shared memory connection, a byte stream like a socket
+// with a single producer and a single consumer, positions only grow.
+struct ShmRing {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  // the consumer sleeps on its eventfd, the producer must write to it
+  alignas(64) std::atomic<uint32_t> parked;
+  // the producer waits for room, the consumer must write to the producer's eventfd
+  std::atomic<uint32_t> full;
+  std::atomic<uint32_t> closed;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "rings are shared between processes");
+
+// A pair of rings in a memfd shared by a client and a server process, set up by passing
+// the memfd and an eventfd per direction over a connected Unix domain socket.
+// Each side runs a poller thread which spins on its inbound ring for a while before parking
+// on its eventfd, a producer only makes the write system call for a parked consumer.
+// The positions are written by the peer, the server checks them on every load and
+// closes the transport once they make no sense.
+class ShmTransport : public std::enable_shared_from_this<ShmTransport> {
+ public:
+  static const size_t kDefaultRingSize = 1 << 20;
+
+  ~ShmTransport() {
+    if (segment_ != MAP_FAILED) {
+      munmap(segment_, segment_size_);
+    }
+    for (int fd : { memfd_, eventfds_[0], eventfds_[1], socket_ }) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  // the client side, creates the segment and hands it over the connected socket
+  static std::shared_ptr<ShmTransport> Connect(int socket, size_t ring_size = kDefaultRingSize) {
+    std::shared_ptr<ShmTransport> transport(new ShmTransport(false));
+    size_t capacity = 4096;
+    while (capacity < ring_size) {
+      capacity <<= 1;
+    }
+    transport->memfd_ = memfd_create("asio_pbrpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    transport->eventfds_[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    transport->eventfds_[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (transport->memfd_ < 0 || transport->eventfds_[0] < 0 || transport->eventfds_[1] < 0 ||
+        ftruncate(transport->memfd_, SegmentSize(capacity)) != 0 ||
+        // the server refuses a segment the client could still resize under it
+        fcntl(transport->memfd_, F_ADD_SEALS, kSeals) != 0 ||
+        !transport->Map(SegmentSize(capacity))) {
+      std::cerr << "shared memory setup failed: " << strerror(errno) << std::endl;
+      return nullptr;
+    }
+    Header* header = new (transport->segment_) Header;
+    header->magic = kMagic;
+    header->capacity = capacity;
+    for (int i = 0; i < 2; ++i) {
+      new (transport->Ring(i)) ShmRing;
+    }
+    transport->Attach(capacity);
+    int fds[3] = { transport->memfd_, transport->eventfds_[0], transport->eventfds_[1] };
+    char ack;
+    if (!SendFds(socket, fds) || ::read(socket, &ack, 1) != 1) {
+      std::cerr << "shared memory handshake failed" << std::endl;
+      return nullptr;
+    }
+    transport->socket_ = dup(socket);
+    return transport;
+  }
+
+  // the server side, on a socket accepted for shared memory connections once it turned
+  // readable, never blocks, nullptr with again set while the client has sent nothing yet
+  static std::shared_ptr<ShmTransport> Accept(int socket, bool& again) {
+    std::shared_ptr<ShmTransport> transport(new ShmTransport(true));
+    int fds[3] = { -1, -1, -1 };
+    bool received = ReceiveFds(socket, fds, again);
+    if (again) {
+      return nullptr;
+    }
+    transport->memfd_ = fds[0];
+    transport->eventfds_[0] = fds[1];
+    transport->eventfds_[1] = fds[2];
+    if (!received) {
+      std::cerr << "shared memory handshake failed" << std::endl;
+      return nullptr;
+    }
+    // unsealed, the client could shrink the segment and fault the server
+    int seals = fcntl(transport->memfd_, F_GET_SEALS);
+    struct stat st;
+    if (seals < 0 || (seals & kSeals) != kSeals || fstat(transport->memfd_, &st) != 0 ||
+        st.st_size < static_cast<off_t>(SegmentSize(0)) ||
+        !transport->Map(st.st_size)) {
+      std::cerr << "bad shared memory segment" << std::endl;
+      return nullptr;
+    }
+    // read once, the client may change it any time
+    const volatile Header* header = static_cast<const volatile Header*>(transport->segment_);
+    uint64_t magic = header->magic, capacity = header->capacity;
+    if (magic != kMagic || !capacity || (capacity & (capacity - 1)) ||
+        SegmentSize(capacity) != static_cast<size_t>(st.st_size)) {
+      std::cerr << "bad shared memory segment" << std::endl;
+      return nullptr;
+    }
+    transport->Attach(capacity);
+    char ack = 1;
+    if (send(socket, &ack, 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1) {
+      return nullptr;
+    }
+    transport->socket_ = dup(socket);
+    return transport;
+  }
+
+  // the poller calls on_readable while armed and bytes are waiting, disarming first,
+  // on_writable once there is room again after WaitWritable gave false,
+  // on_close once the peer or this side closed
+  void Start(std::function<void()> on_readable, std::function<void()> on_writable,
+      std::function<void()> on_close) {
+    std::shared_ptr<ShmTransport> self(shared_from_this());
+    std::thread([self, on_readable, on_writable, on_close] {
+      self->Poll(on_readable, on_writable, on_close);
+    }).detach();
+  }
+
+  // the next inbound bytes are wanted, from any thread
+  void Arm() {
+    armed_.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (inbound_->parked.load(std::memory_order_relaxed)) {
+      Notify(inbound_eventfd_);
+    }
+  }
+
+  // by the poller thread only
+  size_t Read(char* data, size_t length) {
+    uint64_t tail = inbound_->tail.load(std::memory_order_relaxed);
+    uint64_t head = inbound_->head.load(std::memory_order_acquire);
+    if (!Valid(head, tail)) {
+      Close();
+      return 0;
+    }
+    length = std::min<size_t>(length, head - tail);
+    CopyOut(data, inbound_data_, tail, length);
+    inbound_->tail.store(tail + length, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (inbound_->full.load(std::memory_order_relaxed) &&
+        inbound_->full.exchange(0, std::memory_order_relaxed)) {
+      Notify(outbound_eventfd_);
+    }
+    return length;
+  }
+
+  // by one thread at a time, copies what fits into the ring, -1 once closed
+  ssize_t Write(const char* data, size_t length) {
+    if (closed()) {
+      return -1;
+    }
+    uint64_t head = outbound_->head.load(std::memory_order_relaxed);
+    uint64_t tail = outbound_->tail.load(std::memory_order_acquire);
+    if (!Valid(head, tail)) {
+      Close();
+      return -1;
+    }
+    size_t written = std::min<size_t>(length, capacity_ - (head - tail));
+    if (!written) {
+      return 0;
+    }
+    CopyIn(outbound_data_, head, data, written);
+    outbound_->head.store(head + written, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (outbound_->parked.load(std::memory_order_relaxed)) {
+      Notify(outbound_eventfd_);
+    }
+    return written;
+  }
+
+  // by the writer after a short Write, true if there is room again already,
+  // otherwise the poller calls on_writable once the peer made some
+  bool WaitWritable() {
+    writable_wanted_.store(true, std::memory_order_release);
+    outbound_->full.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!Room()) {
+      return false;
+    }
+    // unless the poller saw the room first and calls on_writable
+    return writable_wanted_.exchange(false);
+  }
+
+  void Close() {
+    for (ShmRing* ring : { inbound_, outbound_ }) {
+      if (ring) {
+        ring->closed.store(1, std::memory_order_release);
+      }
+    }
+    Notify(inbound_eventfd_);
+    Notify(outbound_eventfd_);
+  }
+
+  bool closed() const {
+    return inbound_->closed.load(std::memory_order_acquire) ||
+        outbound_->closed.load(std::memory_order_acquire);
+  }
+
+ private:
+  ShmTransport(const ShmTransport&) = delete;
+  ShmTransport& operator=(const ShmTransport&) = delete;
+
+  static const uint64_t kMagic = 0x6370727062707261ULL;
+  static const int kSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+  // rounds of polling an empty ring before parking, some microseconds
+  static const size_t kSpinRounds = 4096;
+
+  struct Header {
+    uint64_t magic;
+    uint64_t capacity;
+  };
+
+  static constexpr size_t kRingOffset = 64;
+
+  explicit ShmTransport(bool server) : server_(server) {}
+
+  static size_t SegmentSize(size_t capacity) {
+    return kRingOffset + 2 * (sizeof(ShmRing) + capacity);
+  }
+
+  ShmRing* Ring(int index) {
+    return reinterpret_cast<ShmRing*>(static_cast<char*>(segment_) + kRingOffset +
+        index * (sizeof(ShmRing) + capacity_));
+  }
+
+  bool Map(size_t size) {
+    segment_size_ = size;
+    segment_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+    return segment_ != MAP_FAILED;
+  }
+
+  // ring 0 carries requests to the server, ring 1 responses back, each with its own eventfd
+  void Attach(size_t capacity) {
+    capacity_ = capacity;
+    int in = server_ ? 0 : 1;
+    inbound_ = Ring(in);
+    outbound_ = Ring(1 - in);
+    inbound_data_ = reinterpret_cast<char*>(inbound_ + 1);
+    outbound_data_ = reinterpret_cast<char*>(outbound_ + 1);
+    inbound_eventfd_ = eventfds_[in];
+    outbound_eventfd_ = eventfds_[1 - in];
+  }
+
+  void CopyIn(char* ring, uint64_t position, const char* data, size_t length) {
+    size_t offset = position & (capacity_ - 1);
+    size_t first = std::min(length, capacity_ - offset);
+    std::memcpy(ring + offset, data, first);
+    std::memcpy(ring, data + first, length - first);
+  }
+  void CopyOut(char* data, const char* ring, uint64_t position, size_t length) {
+    size_t offset = position & (capacity_ - 1);
+    size_t first = std::min(length, capacity_ - offset);
+    std::memcpy(data, ring + offset, first);
+    std::memcpy(data + first, ring, length - first);
+  }
+
+  // the peer owns one of the positions, never more than the capacity apart in a sane ring
+  bool Valid(uint64_t head, uint64_t tail) const {
+    return head - tail <= capacity_;
+  }
+
+  // a bad outbound ring counts as room, the next Write finds it closed
+  bool Room() const {
+    uint64_t head = outbound_->head.load(std::memory_order_relaxed);
+    uint64_t tail = outbound_->tail.load(std::memory_order_acquire);
+    return head - tail != capacity_;
+  }
+
+  bool Writable() const {
+    return writable_wanted_.load(std::memory_order_acquire) && Room();
+  }
+
+  bool Ready() const {
+    return armed_.load(std::memory_order_acquire) &&
+        inbound_->head.load(std::memory_order_acquire) !=
+        inbound_->tail.load(std::memory_order_relaxed);
+  }
+
+  void Poll(const std::function<void()>& on_readable, const std::function<void()>& on_writable,
+      const std::function<void()>& on_close) {
+    size_t rounds = 0;
+    while (!closed()) {
+      if (Ready()) {
+        armed_.store(false, std::memory_order_relaxed);
+        on_readable();
+        rounds = 0;
+        continue;
+      }
+      if (Writable() && writable_wanted_.exchange(false)) {
+        on_writable();
+        rounds = 0;
+        continue;
+      }
+      if (++rounds < SpinRounds()) {
+        Pause();
+        continue;
+      }
+      // park, a producer seeing the flag after its write wakes us
+      inbound_->parked.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!Ready() && !Writable() && !closed()) {
+        // the socket only becomes readable when the peer goes away
+        pollfd fds[2] = { { inbound_eventfd_, POLLIN, 0 }, { socket_, POLLIN, 0 } };
+        ::poll(fds, 2, -1);
+        uint64_t count;
+        while (::read(inbound_eventfd_, &count, sizeof(count)) > 0) {}
+        if (fds[1].revents) {
+          inbound_->closed.store(1, std::memory_order_release);
+        }
+      }
+      inbound_->parked.store(0, std::memory_order_relaxed);
+      rounds = 0;
+    }
+    on_close();
+  }
+
+  static void Notify(int eventfd) {
+    if (eventfd >= 0) {
+      uint64_t one = 1;
+      ssize_t written = ::write(eventfd, &one, sizeof(one));
+      (void)written;
+    }
+  }
+
+  // spinning on the only CPU just keeps the peer from running
+  static size_t SpinRounds() {
+    static const size_t rounds = std::thread::hardware_concurrency() > 1 ? kSpinRounds : 0;
+    return rounds;
+  }
+
+  static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  static bool SendFds(int socket, const int (&fds)[3]) {
+    char byte = 1;
+    iovec iov { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == 1;
+  }
+
+  // again once nothing is there to receive yet
+  static bool ReceiveFds(int socket, int (&fds)[3], bool& again) {
+    char byte;
+    iovec iov { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    again = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (received != 1) {
+      return false;
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+      return false;
+    }
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return true;
+  }
+
+  const bool server_;
+  int memfd_ { -1 };
+  int eventfds_[2] { -1, -1 };
+  // a duplicate of the connection's socket, readable once the peer closes it
+  int socket_ { -1 };
+  void* segment_ { MAP_FAILED };
+  size_t segment_size_ { 0 };
+  size_t capacity_ { 0 };
+  ShmRing* inbound_ { nullptr };
+  ShmRing* outbound_ { nullptr };
+  char* inbound_data_ { nullptr };
+  char* outbound_data_ { nullptr };
+  int inbound_eventfd_ { -1 };
+  int outbound_eventfd_ { -1 };
+  std::atomic_bool armed_ { false };
+  // a writer waits for room in the outbound ring
+  std::atomic_bool writable_wanted_ { false };
+};
+
+}
@@ -6,12 +6,25 @@
 
 #pragma once
 
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include <boost/asio.hpp>
@@ -19,28 +32,58 @@
 
 #include "buffer.h"
 #include "chrono_timer.h"
+#include "endpoint.h"
+#include "io_uring_loop.h"
+#include "memory_budget.h"
+#include "shm_transport.h"
 
 namespace asio_pbrpc {
 
-template <class InputBuffer>
-class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuffer>> {
+// A stream connection over the asio protocol, TCP by default,
+// StreamProtocol connects to TCP and Unix domain endpoints alike.
+template <class InputBuffer, class ProtocolType = boost::asio::ip::tcp>
+class TCPConnection : public std::enable_shared_from_this<
+    TCPConnection<InputBuffer, ProtocolType>> {
  public:
   static_assert(std::is_base_of<Buffer, InputBuffer>::value, "");
 
+  typedef ProtocolType Protocol;
+  typedef typename Protocol::endpoint Endpoint;
+  typedef typename Protocol::socket Socket;
   typedef std::shared_ptr<TCPConnection> Ptr;
   typedef std::shared_ptr<InputBuffer> BufferPtr;
   typedef std::weak_ptr<InputBuffer> BufferWeakPtr;
+  // immutable bytes sent on several connections without a copy
+  typedef std::shared_ptr<const std::string> SharedPayload;
+
+  // output frames are queued per lane, lower lanes are written first
+  static const size_t kSendLanes = 3;
+  static const size_t kDefaultSendLane = 1;
+  // buffers per write, the rest of a frame with more slices goes in the next write
+  static const size_t kMaxGather = 16;
+  // file bytes spliced through the pipe at a time, its default capacity
+  static const size_t kPipeSize = 64 * 1024;
 
   TCPConnection(boost::asio::io_service& io_service, void* server = nullptr) :
-    io_service_(io_service), socket_(io_service_), server_(server), timer_(io_service_) {}
-  virtual ~TCPConnection() { Close(); }
+    io_service_(io_service), socket_(io_service_), server_(server), timer_(io_service_),
+    zero_copy_timer_(io_service_) {}
+  virtual ~TCPConnection() {
+    Close();
+#if defined(ASIO_PBRPC_IO_URING)
+    for (int fd : uring_pipe_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
 
-  bool Bind(const boost::asio::ip::tcp::endpoint& socket) {
+  bool Bind(const Endpoint& socket) {
     try {
       if (socket_.is_open()) {
         socket_.close();
       }
-      socket_.open(boost::asio::ip::tcp::v4());
+      socket_.open(socket.protocol());
       socket_.bind(socket);
     } catch (const boost::system::system_error& se) {
       std::cerr << "bind failed: " << se.what() << std::endl;
@@ -50,7 +93,7 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     return true;
   }
 
-  void AsyncConnect(const boost::asio::ip::tcp::endpoint& remote) {
+  void AsyncConnect(const Endpoint& remote) {
     remote_ = remote;
     Expire(connect_timeout_);
     auto self(this->shared_from_this());
@@ -58,11 +101,8 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
         [this, self](const boost::system::error_code& ec) {
       Cancel(connect_timeout_);
       if (ec) {
-        std::cerr << "connect failed, local(" <<
-            socket_.local_endpoint().address().to_string() << ":" <<
-            socket_.local_endpoint().port() << "), remote(" <<
-            remote_.address().to_string() << ":" <<
-            remote_.port() << "): " << ec.message() << std::endl;
+        std::cerr << "connect failed, remote(" << EndpointText(remote_) << "): " <<
+            ec.message() << std::endl;
         OnError("connect failed");
         return;
       }
@@ -74,18 +114,23 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     AsyncConnect(boost::asio::ip::tcp::endpoint(
         boost::asio::ip::address::from_string(host), port));
   }
+  // a Unix domain socket, with a protocol able to reach one
+  void AsyncConnect(const std::string& path) {
+    AsyncConnect(LocalEndpoint(path));
+  }
+  // a generic endpoint converts from anything, a literal would be ambiguous
+  void AsyncConnect(const char* path) {
+    AsyncConnect(LocalEndpoint(path));
+  }
 
-  bool SyncConnect(const boost::asio::ip::tcp::endpoint& remote) {
+  bool SyncConnect(const Endpoint& remote) {
     remote_ = remote;
     Expire(connect_timeout_);
     try {
       socket_.connect(remote);
     } catch (const boost::system::system_error& se) {
-      std::cerr << "connect failed, local(" <<
-          socket_.local_endpoint().address().to_string() << ":" <<
-          socket_.local_endpoint().port() << "), remote(" <<
-          remote.address().to_string() << ":" <<
-          remote.port() << "): " << se.what() << std::endl;
+      std::cerr << "connect failed, remote(" << EndpointText(remote) << "): " <<
+          se.what() << std::endl;
       return false;
     }
     Cancel(connect_timeout_);
@@ -96,8 +141,14 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     return SyncConnect(boost::asio::ip::tcp::endpoint(
         boost::asio::ip::address::from_string(host), port));
   }
+  bool SyncConnect(const std::string& path) {
+    return SyncConnect(LocalEndpoint(path));
+  }
+  bool SyncConnect(const char* path) {
+    return SyncConnect(LocalEndpoint(path));
+  }
 
-  void Connect(const boost::asio::ip::tcp::endpoint& remote) {
+  void Connect(const Endpoint& remote) {
     remote_ = remote;
     connect_future_ = socket_.async_connect(remote, boost::asio::use_future);
     if (connect_timeout_ > std::chrono::milliseconds::zero()) {
@@ -109,15 +160,64 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
         boost::asio::ip::address::from_string(host), port));
   }
 
+  // Frames go through a pair of shared memory rings set up over the Unix domain socket
+  // at path of a server listening with ListenShm, the socket then only tells when either
+  // side goes away. Only the asynchronous send and receive are supported on it.
+  bool ShmConnect(const std::string& path,
+      size_t ring_size = ShmTransport::kDefaultRingSize) {
+    if (!SyncConnect(LocalEndpoint(path))) {
+      return false;
+    }
+    std::shared_ptr<ShmTransport> shm(ShmTransport::Connect(socket_.native_handle(), ring_size));
+    if (!shm) {
+      Close();
+      return false;
+    }
+    StartShm(std::move(shm));
+    return true;
+  }
+
+  // the server side of ShmConnect, on an accepted socket, waits on the connection's loop
+  // for the client to hand over the rings and then calls on_accept
+  void AsyncShmAccept(std::function<void()> on_accept) {
+    auto self(this->shared_from_this());
+    socket_.async_read_some(boost::asio::null_buffers(),
+        [this, self, on_accept](const boost::system::error_code& ec, size_t) {
+      if (ec) {
+        Close();
+        return;
+      }
+      bool again;
+      std::shared_ptr<ShmTransport> shm(ShmTransport::Accept(socket_.native_handle(), again));
+      if (again) {
+        AsyncShmAccept(on_accept);
+        return;
+      }
+      if (!shm) {
+        Close();
+        return;
+      }
+      StartShm(std::move(shm));
+      on_accept();
+    });
+  }
+
   bool WaitForConnect() {
     return ConnectFutureWait();
   }
 
   bool Start() {
+#if defined(ASIO_PBRPC_IO_URING)
+    // io_uring waits on the socket itself, a non-blocking one would give EAGAIN back
+    socket_.non_blocking(!uring_);
+#else
     socket_.non_blocking(true);
-    socket_.set_option(boost::asio::ip::tcp::no_delay(true));
-    socket_.set_option(boost::asio::socket_base::reuse_address(true));
+#endif
     local_ = socket_.local_endpoint();
+    if (IsTCPEndpoint(local_)) {
+      socket_.set_option(boost::asio::ip::tcp::no_delay(true));
+    }
+    socket_.set_option(boost::asio::socket_base::reuse_address(true));
     remote_ = socket_.remote_endpoint();
     if (!OnConnect()) {
       Close();
@@ -126,28 +226,43 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     return true;
   }
 
-  void AsyncSend(BufferPtr output_buffer) {
-    assert(output_buffer->readable_bytes());
-    Expire(send_timeout_);
-    auto self(this->shared_from_this());
-    socket_.async_write_some(boost::asio::buffer(output_buffer->read_buffer(),
-        output_buffer->readable_bytes()),
-        [this, self, output_buffer](const boost::system::error_code& ec,
-            size_t bytes_transferred) {
-      Cancel(send_timeout_);
-      if (ec) {
-          std::cerr << "send failed: " << ec.message() << std::endl;
-          Close();
-          OnError("send failed");
-          return;
-      }
-      std::cout << bytes_transferred << " byte(s) sent." << std::endl;
-      output_buffer->retrieve(bytes_transferred);
-      if (!OnSend()) {
-        Close();
+  // queued behind the frame being written
+  void AsyncSend(BufferPtr output_buffer, size_t lane = kDefaultSendLane) {
+    AsyncSend(std::move(output_buffer), nullptr, lane);
+  }
+
+  // the frame is the head followed by the payload, written with a gather write,
+  // the payload is never modified and may be queued on other connections too
+  void AsyncSend(BufferPtr head, SharedPayload payload, size_t lane = kDefaultSendLane) {
+    std::vector<BufferSlice> slices;
+    if (payload) {
+      slices.emplace_back(BufferSlice { payload->data(), payload->size(), payload });
+    }
+    AsyncSend(std::move(head), std::move(slices), lane);
+  }
+
+  // the head followed by the slices, written from where they are,
+  // a slice without an owner must stay valid until it is written or the connection closes.
+  // file slices are sent with sendfile, or spliced on io_uring, and are not charged
+  // to the memory budget
+  void AsyncSend(BufferPtr head, std::vector<BufferSlice> slices,
+      size_t lane = kDefaultSendLane) {
+    assert(head->readable_bytes());
+    OutputFrame frame(std::move(head), std::move(slices));
+    // a shared payload is charged to every connection holding it
+    memory_account_.Charge(MemoryBudget::kOutputBuffer, frame.memory());
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      send_queues_[std::min(lane, kSendLanes - 1)].emplace_back(std::move(frame));
+      if (sending_) {
         return;
       }
-      AsyncReceive();
+      sending_ = true;
+    }
+    // the socket is only used on its loop, a sender on another thread hands over
+    auto self(this->shared_from_this());
+    io_service().dispatch([this, self] {
+      AsyncWrite();
     });
   }
 
@@ -169,6 +284,43 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     return true;
   }
 
+  // the slices are written in place after the buffer
+  bool SyncSend(BufferPtr output_buffer, const std::vector<BufferSlice>& slices) {
+    if (slices.empty()) {
+      return SyncSend(std::move(output_buffer));
+    }
+    OutputFrame frame(std::move(output_buffer), slices);
+    Expire(send_timeout_);
+    boost::system::error_code ec;
+    while (frame.bytes()) {
+      if (FrontFile(frame)) {
+        ssize_t sent = SendFile(frame);
+        if (sent <= 0) {
+          std::cerr << "send failed: " << (sent ? std::strerror(errno) : "file too short") <<
+              std::endl;
+          Close();
+          return false;
+        }
+        frame.Advance(sent, true);
+        continue;
+      }
+      std::array<boost::asio::const_buffer, kMaxGather> buffers;
+      iovec iov[kMaxGather];
+      for (size_t i = 0, count = FrameIovec(frame, iov); i < count; ++i) {
+        buffers[i] = boost::asio::buffer(iov[i].iov_base, iov[i].iov_len);
+      }
+      size_t bytes_transferred = socket_.write_some(buffers, ec);
+      if (ec) {
+        std::cerr << "send failed: " << ec.message() << std::endl;
+        Close();
+        return false;
+      }
+      frame.Advance(bytes_transferred);
+    }
+    Cancel(send_timeout_);
+    return true;
+  }
+
   void Send(BufferPtr output_buffer) {
     assert(output_buffer->readable_bytes());
     future_ = socket_.async_write_some(boost::asio::buffer(output_buffer->read_buffer(),
@@ -191,8 +343,32 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
   }
 
   void AsyncReceive() {
-    Expire(receive_timeout_);
     auto self(this->shared_from_this());
+    // backpressure, leave the bytes in the kernel until memory is released
+    if (memory_account_.Exhausted()) {
+      memory_account_.Park([this, self] {
+        io_service().post([this, self] { AsyncReceive(); });
+      });
+      return;
+    }
+    if (!input_buffer_->readable_bytes() && input_buffer_->capacity() > kMaxIdleBufferSize) {
+      input_buffer_->shrink(0);
+    }
+    if (!input_buffer_->writable_bytes()) {
+      input_buffer_->reserve(kMinReadSize);
+    }
+    memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
+    if (shm_) {
+      shm_->Arm();
+      return;
+    }
+#if defined(ASIO_PBRPC_IO_URING)
+    if (uring_) {
+      UringReceive();
+      return;
+    }
+#endif
+    Expire(receive_timeout_);
     socket_.async_read_some(boost::asio::buffer(input_buffer_->write_buffer(),
         input_buffer_->writable_bytes()),
         [this, self](const boost::system::error_code& ec, size_t bytes_transferred) {
@@ -211,6 +387,7 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
         Close();
         return;
       }
+      memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
     });
   }
 
@@ -249,12 +426,28 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
   }
 
   void Close() {
+    if (shm_) {
+      shm_->Close();
+    }
     if (socket_.is_open()) {
-      std::cout << "close socket, local(" <<
-          local_.address() << ":" <<
-          local_.port() << "), remote(" <<
-          remote_.address() << ":" <<
-          remote_.port() << ")." << std::endl;
+      LingerZeroCopy();
+    }
+#if defined(ASIO_PBRPC_IO_URING)
+    if (uring_) {
+      {
+        std::lock_guard<std::mutex> lock(uring_mutex_);
+        uring_closed_ = true;
+        if (uring_receive_) {
+          uring_->Cancel(uring_receive_);
+        }
+      }
+      // the prepared operations name the descriptor, not yet the socket behind it
+      uring_->Flush();
+    }
+#endif
+    if (socket_.is_open()) {
+      std::cout << "close socket, local(" << EndpointText(local_) << "), remote(" <<
+          EndpointText(remote_) << ")." << std::endl;
       try {
         socket_.close();
       } catch (const boost::system::system_error& se) {
@@ -280,21 +473,89 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     return socket_.get_io_service();
   }
 
-  boost::asio::ip::tcp::socket& socket() {
+  Socket& socket() {
     return socket_;
   }
 
+#if defined(ASIO_PBRPC_IO_URING)
+  // Sends and receives go through the loop's io_uring instead of the reactor,
+  // set on a connected socket before Start or the first asynchronous call.
+  // The synchronous and future calls keep using the socket.
+  void io_uring(std::shared_ptr<IoUringLoop> loop) {
+    uring_ = std::move(loop);
+    if (uring_ && socket_.is_open()) {
+      socket_.non_blocking(false);
+      socket_.native_non_blocking(false);
+    }
+  }
+  const std::shared_ptr<IoUringLoop>& io_uring() const {
+    return uring_;
+  }
+#endif
+
+  // Frames of at least min_bytes are sent with MSG_ZEROCOPY, the kernel reads them in place
+  // and the frame is held until it reports them released, zero copies every frame.
+  // TCP only, on a connected socket. Where the kernel copies anyway, on loopback or
+  // a device without scatter-gather, the connection goes back to copying.
+  void zero_copy(size_t min_bytes) {
+    boost::system::error_code ec;
+    Endpoint local(socket_.local_endpoint(ec));
+    if (!min_bytes || ec || !IsTCPEndpoint(local)) {
+      zero_copy_bytes_.store(0, std::memory_order_relaxed);
+      return;
+    }
+    int enable = 1;
+    if (setsockopt(socket_.native_handle(), SOL_SOCKET, SO_ZEROCOPY,
+        &enable, sizeof(enable)) < 0) {
+      std::cerr << "zero copy unavailable: " << std::strerror(errno) << std::endl;
+      zero_copy_bytes_.store(0, std::memory_order_relaxed);
+      return;
+    }
+    zero_copy_bytes_.store(min_bytes, std::memory_order_relaxed);
+  }
+
   BufferPtr& input_buffer() {
     return input_buffer_;
   }
 
+  // Hands over the storage of the input buffer for the caller to keep pointers into
+  // its next len readable bytes, the bytes after them are copied back into the input
+  // buffer, which keeps its settings. Only while handling OnReceive.
+  BufferPtr TakeInput(size_t len) {
+    assert(len <= input_buffer_->readable_bytes());
+    BufferPtr taken(std::make_shared<InputBuffer>());
+    taken->swap(*input_buffer_);
+    input_buffer_->write(taken->read_buffer() + len, taken->readable_bytes() - len);
+    memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
+    return taken;
+  }
+
+  // Frames larger than bytes are sent in fragments of that size, fragments of
+  // different frames of a lane take turns and lower lanes go first, so a large frame
+  // no longer holds back the small ones queued behind it. The peer puts them back
+  // together, zero, the default, sends every frame whole
+  void fragment_bytes(size_t bytes) {
+    fragment_bytes_.store(bytes, std::memory_order_relaxed);
+  }
+
+  // request-response connections read once a frame has been sent,
+  // pipelined ones keep their own receive loop
+  void receive_after_send(bool receive_after_send) {
+    receive_after_send_ = receive_after_send;
+  }
+
+  MemoryBudget::Account& memory_account() {
+    return memory_account_;
+  }
+
   const std::string& error() const {
     return error_;
   }
 
-  void timeout(const boost::posix_time::millisec& connect_timeout,
-      const boost::posix_time::millisec& send_timeout,
-      const boost::posix_time::millisec& receive_timeout) {
+  // zero disables the timeout
+  void timeout(const std::chrono::milliseconds& connect_timeout,
+      const std::chrono::milliseconds& send_timeout,
+      const std::chrono::milliseconds& receive_timeout) {
     connect_timeout_ = connect_timeout;
     send_timeout_ = send_timeout;
     receive_timeout_ = receive_timeout;
@@ -311,19 +572,838 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
   virtual bool OnReceive() { return true; }
   virtual bool OnClose() { return true; }
   virtual void OnError(const std::string&) { return; }
-
-  void* server_;
+  // the head of a fragment of bytes of the frame sent in fragments under fragment_id,
+  // none if the protocol has no fragments and frames are sent whole
+  virtual BufferPtr FragmentHead(uint64_t, size_t, bool) {
+    return nullptr;
+  }
 
  private:
   TCPConnection(const TCPConnection&) = delete;
   TCPConnection& operator=(const TCPConnection&) = delete;
 
+  static const size_t kMinReadSize = 4096;
+  static const size_t kMaxIdleBufferSize = 64 * 1024;
+
+  struct OutputFrame {
+    OutputFrame() {}
+    OutputFrame(BufferPtr head, std::vector<BufferSlice> slices) :
+      head(std::move(head)), slices(std::move(slices)) {
+      for (auto& slice : this->slices) {
+        slices_bytes += slice.size;
+        if (slice.fd >= 0) {
+          file_bytes += slice.size;
+        }
+      }
+    }
+
+    BufferPtr head;
+    // written after the head, from where they are
+    std::vector<BufferSlice> slices;
+    size_t slices_bytes { 0 };
+    size_t file_bytes { 0 };
+    // slice bytes already written, and of them from files
+    size_t slices_offset { 0 };
+    size_t file_offset { 0 };
+
+    // set once the frame goes out in fragments
+    uint64_t fragment_id { 0 };
+    size_t fragment_bytes { 0 };
+
+    size_t bytes() const {
+      return head->readable_bytes() + slices_bytes - slices_offset;
+    }
+    // charged to the memory budget
+    size_t memory() const {
+      return bytes() - (file_bytes - file_offset);
+    }
+
+    // file bytes are only written on their own, from the file at the front
+    void Advance(size_t bytes_transferred, bool file = false) {
+      if (file) {
+        slices_offset += bytes_transferred;
+        file_offset += bytes_transferred;
+        return;
+      }
+      size_t head_bytes = std::min(bytes_transferred, head->readable_bytes());
+      head->retrieve(head_bytes);
+      slices_offset += bytes_transferred - head_bytes;
+    }
+
+    // the next bytes of the frame behind another head, as slices of the frame,
+    // the head is only read from after being cut, its storage stays
+    OutputFrame Cut(size_t bytes, BufferPtr fragment_head) {
+      std::vector<BufferSlice> cut;
+      size_t head_bytes = std::min(bytes, head->readable_bytes());
+      if (head_bytes) {
+        cut.emplace_back(BufferSlice { head->read_buffer(), head_bytes, head });
+        head->retrieve(head_bytes);
+        bytes -= head_bytes;
+      }
+      size_t skip = slices_offset;
+      for (auto& slice : slices) {
+        if (!bytes) {
+          break;
+        }
+        if (skip >= slice.size) {
+          skip -= slice.size;
+          continue;
+        }
+        BufferSlice part(slice);
+        part.size = std::min(bytes, slice.size - skip);
+        if (slice.fd >= 0) {
+          part.offset += skip;
+          file_offset += part.size;
+        } else {
+          part.data += skip;
+        }
+        cut.emplace_back(std::move(part));
+        slices_offset += cut.back().size;
+        bytes -= cut.back().size;
+        skip = 0;
+      }
+      return OutputFrame(std::move(fragment_head), std::move(cut));
+    }
+  };
+
+  // a frame sent without a copy, held under the sequence number of its send
+  struct ZeroCopyPending {
+    uint32_t sequence;
+    OutputFrame frame;
+    size_t bytes;
+  };
+
+  // the frames held on a closed connection, with a duplicate of its socket
+  struct ZeroCopyLinger {
+    ZeroCopyLinger(boost::asio::io_service& io_service, int fd) :
+      fd(fd), timer(io_service) {}
+    ~ZeroCopyLinger() { close(fd); }
+
+    int fd;
+    std::deque<ZeroCopyPending> pending;
+    SteadyTimer timer;
+    std::chrono::time_point<std::chrono::steady_clock> deadline;
+  };
+
+  void AsyncWrite() {
+    if (shm_) {
+      ShmWrite();
+      return;
+    }
+    OutputFrame frame;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      if (!sending_frame_.head) {
+        PopFrame(sending_frame_);
+      }
+      if (!sending_frame_.head) {
+        sending_ = false;
+        return;
+      }
+      frame = sending_frame_;
+    }
+    auto self(this->shared_from_this());
+    if (FrontFile(frame)) {
+#if defined(ASIO_PBRPC_IO_URING)
+      if (uring_) {
+        UringFileWrite(frame);
+        return;
+      }
+#endif
+      FileWrite(frame);
+      return;
+    }
+    size_t zero_copy_bytes = zero_copy_bytes_.load(std::memory_order_relaxed);
+    bool zero_copy = zero_copy_bytes && frame.bytes() >= zero_copy_bytes;
+#if defined(ASIO_PBRPC_IO_URING)
+    if (uring_) {
+      iovec iov[kMaxGather];
+      size_t count = FrameIovec(frame, iov);
+      // the operation holds the frame until the kernel releases it, the bytes of a
+      // zero copy send stay charged until then too
+      size_t held = 0;
+      IoUringLoop::Handler handler([this, self, frame, held](int result,
+          uint32_t flags) mutable {
+        if (flags & IORING_CQE_F_NOTIF) {
+          memory_account_.Charge(MemoryBudget::kOutputBuffer,
+              -static_cast<std::ptrdiff_t>(held));
+          return;
+        }
+        held = result > 0 && (flags & IORING_CQE_F_MORE) ? result : 0;
+        OnWrite(frame, result < 0 ? boost::system::error_code(-result,
+            boost::system::system_category()) : boost::system::error_code(),
+            result < 0 ? 0 : result, false, held != 0);
+      });
+      if (zero_copy) {
+        uring_->SendZeroCopy(socket_.native_handle(), iov, count, std::move(handler));
+      } else {
+        uring_->Send(socket_.native_handle(), iov, count, std::move(handler));
+      }
+      return;
+    }
+#endif
+    if (zero_copy) {
+      ZeroCopyWrite(frame);
+      return;
+    }
+    std::array<boost::asio::const_buffer, kMaxGather> buffers;
+    iovec iov[kMaxGather];
+    for (size_t i = 0, count = FrameIovec(frame, iov); i < count; ++i) {
+      buffers[i] = boost::asio::buffer(iov[i].iov_base, iov[i].iov_len);
+    }
+    Expire(send_timeout_);
+    socket_.async_write_some(buffers,
+        [this, self, frame](const boost::system::error_code& ec,
+            size_t bytes_transferred) {
+      Cancel(send_timeout_);
+      OnWrite(frame, ec, bytes_transferred);
+    });
+  }
+
+  // the unwritten rest of the frame up to a file slice, up to kMaxGather buffers of it
+  static size_t FrameIovec(const OutputFrame& frame, iovec (&iov)[kMaxGather]) {
+    size_t count = 0;
+    if (frame.head->readable_bytes()) {
+      iov[count].iov_base = const_cast<char*>(frame.head->read_buffer());
+      iov[count++].iov_len = frame.head->readable_bytes();
+    }
+    size_t skip = frame.slices_offset;
+    for (auto& slice : frame.slices) {
+      if (count == kMaxGather) {
+        break;
+      }
+      if (skip >= slice.size) {
+        skip -= slice.size;
+        continue;
+      }
+      if (slice.fd >= 0) {
+        break;
+      }
+      iov[count].iov_base = const_cast<char*>(slice.data) + skip;
+      iov[count++].iov_len = slice.size - skip;
+      skip = 0;
+    }
+    return count;
+  }
+
+  // the file slice the unwritten rest of the frame starts with, and the offset into it
+  static const BufferSlice* FrontFile(const OutputFrame& frame, size_t* skip = nullptr) {
+    if (frame.head->readable_bytes() || frame.file_offset == frame.file_bytes) {
+      return nullptr;
+    }
+    size_t offset = frame.slices_offset;
+    for (auto& slice : frame.slices) {
+      if (offset < slice.size) {
+        if (skip) {
+          *skip = offset;
+        }
+        return slice.fd >= 0 ? &slice : nullptr;
+      }
+      offset -= slice.size;
+    }
+    return nullptr;
+  }
+
+  // from the file at the front of the frame, as sendfile returns.
+  // sendfile has no MSG_NOSIGNAL, SIGPIPE is blocked on this thread around it and the one
+  // a closed socket raises is taken before unblocking, the failure is EPIPE alone
+  ssize_t SendFile(const OutputFrame& frame) {
+    size_t skip;
+    const BufferSlice* slice = FrontFile(frame, &skip);
+    off_t offset = slice->offset + skip;
+    sigset_t pipe_set, pending_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    // one already pending is someone else's, left alone
+    sigpending(&pending_set);
+    bool pending = sigismember(&pending_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    ssize_t sent = sendfile(socket_.native_handle(), slice->fd, &offset, slice->size - skip);
+    int error_number = errno;
+    if (sent < 0 && error_number == EPIPE && !pending) {
+      timespec no_wait { 0, 0 };
+      while (sigtimedwait(&pipe_set, nullptr, &no_wait) < 0 && errno == EINTR) {
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    errno = error_number;
+    return sent;
+  }
+
+  // waits for room in the socket buffer and sends from the file at the front of the frame,
+  // the file bytes never pass through user space
+  void FileWrite(const OutputFrame& frame) {
+    Expire(send_timeout_);
+    auto self(this->shared_from_this());
+    socket_.async_write_some(boost::asio::null_buffers(),
+        [this, self, frame](const boost::system::error_code& ec, size_t) {
+      Cancel(send_timeout_);
+      if (ec) {
+        OnWrite(frame, ec, 0, true);
+        return;
+      }
+      ssize_t sent = SendFile(frame);
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        FileWrite(frame);
+        return;
+      }
+      boost::system::error_code error;
+      if (sent < 0) {
+        error.assign(errno, boost::system::system_category());
+      } else if (!sent) {
+        // the file ends before the slice does
+        error = boost::asio::error::eof;
+      }
+      OnWrite(frame, error, sent < 0 ? 0 : sent, true);
+    });
+  }
+
+  // waits for room in the socket buffer and sends without copying, the frame stays
+  // in zero_copy_pending_ under the sequence number of the send until the kernel is done
+  void ZeroCopyWrite(const OutputFrame& frame) {
+    Expire(send_timeout_);
+    auto self(this->shared_from_this());
+    socket_.async_write_some(boost::asio::null_buffers(),
+        [this, self, frame](const boost::system::error_code& ec, size_t) {
+      Cancel(send_timeout_);
+      if (ec) {
+        OnWrite(frame, ec, 0);
+        return;
+      }
+      iovec iov[kMaxGather];
+      msghdr message;
+      std::memset(&message, 0, sizeof(message));
+      message.msg_iov = iov;
+      message.msg_iovlen = FrameIovec(frame, iov);
+      ssize_t sent;
+      int error_number = 0;
+      bool held = false;
+      {
+        std::lock_guard<std::mutex> lock(zero_copy_mutex_);
+        sent = sendmsg(socket_.native_handle(), &message,
+            MSG_ZEROCOPY | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+          zero_copy_pending_.push_back({ zero_copy_sequence_++, frame, size_t(sent) });
+          held = true;
+        } else if (sent < 0) {
+          error_number = errno;
+        }
+      }
+      // out of socket option memory for the notifications, this one is copied
+      if (error_number == ENOBUFS) {
+        sent = sendmsg(socket_.native_handle(), &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        error_number = sent < 0 ? errno : 0;
+      }
+      if (error_number == EAGAIN || error_number == EWOULDBLOCK) {
+        ZeroCopyWrite(frame);
+        return;
+      }
+      boost::system::error_code error;
+      if (error_number) {
+        error.assign(error_number, boost::system::system_category());
+      }
+      if (!ReapZeroCopy()) {
+        WaitZeroCopy();
+      }
+      OnWrite(frame, error, sent < 0 ? 0 : sent, false, held);
+    });
+  }
+
+  // releases the frames the kernel reported done with and their charge, true once
+  // none is held
+  bool ReapZeroCopy() {
+    size_t released;
+    bool copied = false, empty;
+    {
+      std::lock_guard<std::mutex> lock(zero_copy_mutex_);
+      released = ReapErrorQueue(socket_.native_handle(), zero_copy_pending_, copied);
+      empty = zero_copy_pending_.empty();
+    }
+    if (copied) {
+      zero_copy_bytes_.store(0, std::memory_order_relaxed);
+    }
+    memory_account_.Charge(MemoryBudget::kOutputBuffer, -static_cast<std::ptrdiff_t>(released));
+    return empty;
+  }
+
+  // drops the pending sends the notifications on the error queue of fd name, the bytes
+  // of them returned, copied is set when the kernel copied them after all
+  static size_t ReapErrorQueue(int fd, std::deque<ZeroCopyPending>& pending, bool& copied) {
+    size_t released = 0;
+    char control[128];
+    while (!pending.empty()) {
+      msghdr message;
+      std::memset(&message, 0, sizeof(message));
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      if (recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        break;
+      }
+      for (cmsghdr* header = CMSG_FIRSTHDR(&message); header;
+          header = CMSG_NXTHDR(&message, header)) {
+        if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) &&
+            !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR)) {
+          continue;
+        }
+        const sock_extended_err* error =
+            reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+        if (error->ee_errno || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+          continue;
+        }
+        if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+          copied = true;
+        }
+        // sends numbered first to last are done, the numbers may wrap
+        uint32_t first = error->ee_info, last = error->ee_data;
+        for (auto it = pending.begin(); it != pending.end(); ) {
+          if (it->sequence - first <= last - first) {
+            released += it->bytes;
+            it = pending.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+    }
+    return released;
+  }
+
+  // on close, the kernel may still send from the pages of held frames, they go with a
+  // duplicate of the socket that is shut down and kept until their notifications come,
+  // or aborted after a while so that the unsent bytes are dropped
+  void LingerZeroCopy() {
+    if (ReapZeroCopy()) {
+      return;
+    }
+    int fd = dup(socket_.native_handle());
+    if (fd < 0) {
+      std::cerr << "dup failed: " << std::strerror(errno) << std::endl;
+      Abort(socket_.native_handle());
+      std::lock_guard<std::mutex> lock(zero_copy_mutex_);
+      zero_copy_pending_.clear();
+      return;
+    }
+    shutdown(fd, SHUT_RDWR);
+    auto linger = std::make_shared<ZeroCopyLinger>(io_service_, fd);
+    {
+      std::lock_guard<std::mutex> lock(zero_copy_mutex_);
+      linger->pending.swap(zero_copy_pending_);
+    }
+    // the connection is going, so is its account
+    size_t held = 0;
+    for (const auto& pending : linger->pending) {
+      held += pending.bytes;
+    }
+    memory_account_.Charge(MemoryBudget::kOutputBuffer, -static_cast<std::ptrdiff_t>(held));
+    linger->deadline = now() + std::chrono::seconds(10);
+    Linger(std::move(linger));
+  }
+
+  static void Linger(std::shared_ptr<ZeroCopyLinger> linger) {
+    bool copied = false;
+    ReapErrorQueue(linger->fd, linger->pending, copied);
+    if (linger->pending.empty()) {
+      return;
+    }
+    if (now() >= linger->deadline) {
+      Abort(linger->fd);
+      return;
+    }
+    linger->timer.expires_from_now(std::chrono::milliseconds(1));
+    linger->timer.async_wait([linger](const boost::system::error_code&) {
+      Linger(linger);
+    });
+  }
+
+  // closing resets the connection and drops what is unsent
+  static void Abort(int fd) {
+    struct linger option { 1, 0 };
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &option, sizeof(option)) < 0) {
+      std::cerr << "set linger failed: " << std::strerror(errno) << std::endl;
+    }
+  }
+
+  // notifications come on the error queue, looked at again shortly while frames are held
+  void WaitZeroCopy() {
+    if (zero_copy_waiting_.exchange(true)) {
+      return;
+    }
+    auto self(this->shared_from_this());
+    zero_copy_timer_.expires_from_now(std::chrono::milliseconds(1));
+    zero_copy_timer_.async_wait([this, self](const boost::system::error_code&) {
+      zero_copy_waiting_.store(false);
+      if (!ReapZeroCopy() && socket_.is_open()) {
+        WaitZeroCopy();
+      }
+    });
+  }
+
+  // file bytes are not charged, they come from FrontFile alone, held bytes were sent
+  // without a copy and are released once the kernel is done with them
+  void OnWrite(const OutputFrame&, const boost::system::error_code& ec,
+      size_t bytes_transferred, bool file = false, bool held = false) {
+    if (ec) {
+      std::cerr << "send failed: " << ec.message() << std::endl;
+      ClearSendQueues();
+      Close();
+      OnError("send failed");
+      return;
+    }
+    std::cout << bytes_transferred << " byte(s) sent." << std::endl;
+    if (!file && !held) {
+      memory_account_.Charge(MemoryBudget::kOutputBuffer,
+          -static_cast<std::ptrdiff_t>(bytes_transferred));
+    }
+    bool written;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      sending_frame_.Advance(bytes_transferred, file);
+      written = !sending_frame_.bytes();
+      if (written) {
+        sending_frame_ = OutputFrame();
+      }
+    }
+    // partial write, the rest of the frame goes first
+    if (!written) {
+      AsyncWrite();
+      return;
+    }
+    if (!OnSend()) {
+      ClearSendQueues();
+      Close();
+      return;
+    }
+    if (receive_after_send_) {
+      AsyncReceive();
+    }
+    AsyncWrite();
+  }
+
+  void StartShm(std::shared_ptr<ShmTransport> shm) {
+    shm_ = std::move(shm);
+    // the poller keeps the connection until closed, as a pending read does a socket's
+    Ptr self(this->shared_from_this());
+    shm_->Start([self] {
+      self->ShmReceive();
+    }, [self] {
+      self->ShmWrite();
+    }, [self] {
+      if (self->socket_.is_open()) {
+        self->Close();
+        self->OnError("receive failed");
+      }
+    });
+  }
+
+  // on the poller thread, the receive was armed
+  void ShmReceive() {
+    size_t bytes_transferred = shm_->Read(input_buffer_->write_buffer(),
+        input_buffer_->writable_bytes());
+    // a bad ring closed the transport, the poller closes the connection next
+    if (!bytes_transferred) {
+      return;
+    }
+    input_buffer_->consume(bytes_transferred);
+    if (!OnReceive()) {
+      Close();
+      return;
+    }
+    memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
+  }
+
+  // Frames are copied into the ring on the sending thread, one sender at a time.
+  // When the ring is full the rest of the frame stays in sending_frame_ and the poller
+  // carries on once the peer has read, the sending thread never waits for the peer
+  void ShmWrite() {
+    while (true) {
+      OutputFrame frame;
+      {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        if (!sending_frame_.head && !PopFrame(sending_frame_)) {
+          sending_ = false;
+          return;
+        }
+        frame = sending_frame_;
+      }
+      if (frame.file_bytes != frame.file_offset) {
+        if (!ShmReadFiles(frame)) {
+          ClearSendQueues();
+          Close();
+          OnError("send failed");
+          return;
+        }
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        sending_frame_ = frame;
+      }
+      iovec iov[kMaxGather];
+      size_t count = FrameIovec(frame, iov);
+      size_t written = 0;
+      bool full = false;
+      for (size_t i = 0; i < count && !full; ++i) {
+        ssize_t bytes = shm_->Write(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+        if (bytes < 0) {
+          ClearSendQueues();
+          Close();
+          OnError("send failed");
+          return;
+        }
+        written += bytes;
+        full = static_cast<size_t>(bytes) < iov[i].iov_len;
+      }
+      memory_account_.Charge(MemoryBudget::kOutputBuffer,
+          -static_cast<std::ptrdiff_t>(written));
+      bool done;
+      {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        sending_frame_.Advance(written);
+        done = !sending_frame_.bytes();
+        if (done) {
+          sending_frame_ = OutputFrame();
+        }
+      }
+      if (!done) {
+        // resumed by the poller unless the peer made room meanwhile
+        if (full && !shm_->WaitWritable()) {
+          return;
+        }
+        continue;
+      }
+      if (!OnSend()) {
+        ClearSendQueues();
+        Close();
+        return;
+      }
+      if (receive_after_send_) {
+        AsyncReceive();
+      }
+    }
+  }
+
+  // the ring is a copy anyway, the files of a frame are read in before it goes out
+  // and charged from then on
+  bool ShmReadFiles(OutputFrame& frame) {
+    for (auto& slice : frame.slices) {
+      if (slice.fd < 0) {
+        continue;
+      }
+      std::shared_ptr<Buffer> file(std::make_shared<Buffer>());
+      if (!file->write(slice)) {
+        return false;
+      }
+      slice = BufferSlice { file->read_buffer(), file->readable_bytes(), file };
+    }
+    memory_account_.Charge(MemoryBudget::kOutputBuffer, frame.file_bytes - frame.file_offset);
+    frame.file_bytes = frame.file_offset = 0;
+    return true;
+  }
+
+#if defined(ASIO_PBRPC_IO_URING)
+  // The multishot receive runs while the connection reads. Bytes arriving while nobody
+  // asked for them wait in the stash for the next AsyncReceive and stop the receive,
+  // so a parked connection leaves the rest in the kernel as on epoll
+  void UringReceive() {
+    {
+      std::lock_guard<std::mutex> lock(uring_mutex_);
+      if (uring_closed_) {
+        return;
+      }
+      if (uring_stash_.empty()) {
+        uring_armed_ = true;
+        // a cancelled one restarts with its last completion
+        if (!uring_receive_) {
+          StartUringReceive();
+        }
+        return;
+      }
+      input_buffer_->write(uring_stash_.data(), uring_stash_.size());
+      std::string().swap(uring_stash_);
+    }
+    auto self(this->shared_from_this());
+    io_service().post([this, self] {
+      if (!OnReceive()) {
+        Close();
+        return;
+      }
+      memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
+    });
+  }
+
+  // with uring_mutex_ held, the operation keeps the connection until its last completion
+  void StartUringReceive() {
+    Ptr self(this->shared_from_this());
+    uring_cancelling_ = false;
+    uring_receive_ = uring_->Receive(socket_.native_handle(),
+        [self](int result, uint32_t flags) {
+      self->OnUringReceive(result, flags);
+    });
+  }
+
+  // on the loop, one completion at a time
+  void OnUringReceive(int result, uint32_t flags) {
+    bool armed = false;
+    {
+      std::lock_guard<std::mutex> lock(uring_mutex_);
+      if (result > 0) {
+        const char* data = uring_->Buffer(flags);
+        armed = uring_armed_;
+        uring_armed_ = false;
+        if (armed) {
+          input_buffer_->write(data, result);
+        } else {
+          uring_stash_.append(data, result);
+          if (uring_receive_ && !uring_cancelling_ && (flags & IORING_CQE_F_MORE)) {
+            uring_cancelling_ = true;
+            uring_->Cancel(uring_receive_);
+          }
+        }
+      }
+      uring_->Recycle(flags);
+      if (!(flags & IORING_CQE_F_MORE)) {
+        uring_receive_ = 0;
+        // out of provided buffers, submissions or stopped by us, not by the peer,
+        // read on if somebody asks
+        if ((result > 0 || result == -ENOBUFS || result == -EBUSY || result == -ECANCELED) &&
+            !uring_closed_ && uring_armed_) {
+          StartUringReceive();
+        }
+      }
+    }
+    if (result > 0) {
+      if (armed) {
+        if (!OnReceive()) {
+          Close();
+          return;
+        }
+      }
+      memory_account_.Set(MemoryBudget::kInputBuffer, InputMemory());
+      return;
+    }
+    if (result == -ENOBUFS || result == -EBUSY || result == -ECANCELED) {
+      return;
+    }
+    if (socket_.is_open()) {
+      Close();
+      OnError("receive failed");
+    }
+  }
+
+  // the file at the front of the frame goes through the pipe, a chunk of its capacity
+  // at a time, the kernel moves the pages both ways
+  void UringFileWrite(const OutputFrame& frame) {
+    if (uring_pipe_[0] < 0 && pipe2(uring_pipe_, O_CLOEXEC) < 0) {
+      OnWrite(frame, boost::system::error_code(errno, boost::system::system_category()), 0,
+          true);
+      return;
+    }
+    size_t skip;
+    const BufferSlice* slice = FrontFile(frame, &skip);
+    auto self(this->shared_from_this());
+    uring_->Splice(slice->fd, slice->offset + skip, uring_pipe_[1],
+        std::min(slice->size - skip, static_cast<size_t>(kPipeSize)),
+        [this, self, frame](int result, uint32_t) {
+      if (result <= 0) {
+        // the file ends before the slice does
+        OnWrite(frame, result ? boost::system::error_code(-result,
+            boost::system::system_category()) : boost::asio::error::eof, 0, true);
+        return;
+      }
+      UringDrainPipe(frame, result, result);
+    });
+  }
+
+  // moves the pending bytes of the chunk from the pipe to the socket
+  void UringDrainPipe(const OutputFrame& frame, size_t pending, size_t chunk) {
+    auto self(this->shared_from_this());
+    uring_->Splice(uring_pipe_[0], -1, socket_.native_handle(), pending,
+        [this, self, frame, pending, chunk](int result, uint32_t) {
+      if (result <= 0) {
+        OnWrite(frame, result ? boost::system::error_code(-result,
+            boost::system::system_category()) : boost::asio::error::eof, 0, true);
+        return;
+      }
+      if (static_cast<size_t>(result) < pending) {
+        UringDrainPipe(frame, pending - result, chunk);
+        return;
+      }
+      OnWrite(frame, boost::system::error_code(), chunk, true);
+    });
+  }
+#endif
+
+  // the input buffer and the bytes read ahead of it
+  size_t InputMemory() {
+#if defined(ASIO_PBRPC_IO_URING)
+    std::lock_guard<std::mutex> lock(uring_mutex_);
+    return input_buffer_->capacity() + uring_stash_.capacity();
+#else
+    return input_buffer_->capacity();
+#endif
+  }
+
+  // With the send lock held, the next frame to write, lower lanes first.
+  // A frame larger than the fragment size goes a fragment at a time, the rest of it
+  // queued behind the other frames of its lane, so they take turns with it
+  bool PopFrame(OutputFrame& frame) {
+    for (size_t lane = 0; lane < kSendLanes; ++lane) {
+      std::deque<OutputFrame>& send_queue = send_queues_[lane];
+      if (send_queue.empty()) {
+        continue;
+      }
+      OutputFrame& front = send_queue.front();
+      if (!front.fragment_id) {
+        size_t fragment_bytes = fragment_bytes_.load(std::memory_order_relaxed);
+        if (fragment_bytes && front.bytes() > fragment_bytes) {
+          front.fragment_id = ++fragment_sequence_;
+          front.fragment_bytes = fragment_bytes;
+        }
+      }
+      size_t bytes = std::min(front.fragment_bytes, front.bytes());
+      bool last = bytes == front.bytes();
+      BufferPtr fragment_head;
+      if (front.fragment_id) {
+        fragment_head = FragmentHead(front.fragment_id, bytes, last);
+      }
+      if (!fragment_head) {
+        frame = std::move(front);
+        send_queue.pop_front();
+        return true;
+      }
+      memory_account_.Charge(MemoryBudget::kOutputBuffer, fragment_head->readable_bytes());
+      frame = front.Cut(bytes, std::move(fragment_head));
+      if (last) {
+        send_queue.pop_front();
+      } else if (send_queue.size() > 1) {
+        send_queue.emplace_back(std::move(front));
+        send_queue.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void ClearSendQueues() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (sending_frame_.head) {
+      memory_account_.Charge(MemoryBudget::kOutputBuffer,
+          -static_cast<std::ptrdiff_t>(sending_frame_.memory()));
+      sending_frame_ = OutputFrame();
+    }
+    for (auto& send_queue : send_queues_) {
+      for (auto& frame : send_queue) {
+        memory_account_.Charge(MemoryBudget::kOutputBuffer,
+            -static_cast<std::ptrdiff_t>(frame.memory()));
+      }
+      send_queue.clear();
+    }
+    sending_ = false;
+  }
+
   void Expire(const std::chrono::milliseconds& timeout) {
     if (timeout > std::chrono::milliseconds::zero()) {
 //      auto self(this->shared_from_this());
       timer_.expires_from_now(timeout);
 //      timer_.async_wait([this, self](const boost::system::error_code& ec) {
-      timer_.async_wait([this](const boost::system::error_code& ec) {
+      timer_.async_wait([this](const boost::system::error_code&) {
         if (timer_lock_.test_and_set(std::memory_order_acquire)) {
           return;
         }
@@ -362,11 +1442,8 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
     try {
       connect_future_.get();
     } catch (const boost::system::system_error& se) {
-      std::cerr << "connect failed, local(" <<
-          socket_.local_endpoint().address().to_string() << ":" <<
-          socket_.local_endpoint().port() << "), remote(" <<
-          remote_.address().to_string() << ":" <<
-          remote_.port() << "): " << se.what() << std::endl;
+      std::cerr << "connect failed, remote(" << EndpointText(remote_) << "): " <<
+          se.what() << std::endl;
       Close();
       return false;
     }
@@ -402,12 +1479,44 @@ class TCPConnection : public std::enable_shared_from_this<TCPConnection<InputBuf
   }
 
   std::reference_wrapper<boost::asio::io_service> io_service_;
-  boost::asio::ip::tcp::socket socket_;
-  boost::asio::ip::tcp::endpoint local_, remote_;
+  Socket socket_;
+ protected:
+  // declared in the order of initialization
+  void* server_;
+
+ private:
+  Endpoint local_, remote_;
   BufferPtr input_buffer_ { std::make_shared<InputBuffer>() };
+  std::shared_ptr<ShmTransport> shm_;
+#if defined(ASIO_PBRPC_IO_URING)
+  std::shared_ptr<IoUringLoop> uring_;
+  std::mutex uring_mutex_;
+  uint64_t uring_receive_ { 0 };
+  bool uring_cancelling_ { false };
+  bool uring_armed_ { false };
+  bool uring_closed_ { false };
+  std::string uring_stash_;
+  // file slices are spliced into it, then out to the socket
+  int uring_pipe_[2] { -1, -1 };
+#endif
+  MemoryBudget::Account memory_account_;
+  std::mutex send_mutex_;
+  std::deque<OutputFrame> send_queues_[kSendLanes];
+  OutputFrame sending_frame_;
+  bool sending_ { false };
+  std::atomic<size_t> fragment_bytes_ { 0 };
+  uint64_t fragment_sequence_ { 0 };
+  bool receive_after_send_ { true };
   std::string error_;
   std::chrono::milliseconds connect_timeout_ { 10 }, send_timeout_ { 10 }, receive_timeout_ { 10 };
   SteadyTimer timer_;
+  // zero copy sends, zero_copy_bytes_ drops to zero once the kernel copies instead
+  std::atomic<size_t> zero_copy_bytes_ { 0 };
+  std::mutex zero_copy_mutex_;
+  uint32_t zero_copy_sequence_ { 0 };
+  std::deque<ZeroCopyPending> zero_copy_pending_;
+  SteadyTimer zero_copy_timer_;
+  std::atomic<bool> zero_copy_waiting_ { false };
   std::atomic_flag timer_lock_ { ATOMIC_FLAG_INIT };
   // for future connect, send and receive
   std::future<void> connect_future_;
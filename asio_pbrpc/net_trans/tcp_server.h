@@ -6,27 +6,38 @@
 
 #pragma once
 
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <iostream>
 #include <vector>
 #include <boost/asio.hpp>
 
+#include "endpoint.h"
 #include "executors.h"
+#include "io_uring_loop.h"
+#include "memory_budget.h"
 #include "tcp_connection.h"
 
 namespace asio_pbrpc {
 
+// Accepts connections on any number of endpoints of the connection's protocol,
+// with StreamProtocol on TCP and Unix domain endpoints together.
 template <class Connection>
 class TCPServer {
  public:
+  typedef typename Connection::Protocol Protocol;
+  typedef typename Connection::Endpoint Endpoint;
+
   static_assert(std::is_base_of<TCPConnection<typename
-      Connection::BufferPtr::element_type>, Connection>::value, "");
+      Connection::BufferPtr::element_type, Protocol>, Connection>::value, "");
 
   typedef typename Connection::Ptr ConnectionPtr;
 
-  TCPServer(const boost::asio::ip::tcp::endpoint& server,
-      const std::string& name = "") :
-    name_(name), acceptor_(listening_executor_.io_service(), server) {}
+  TCPServer(const Endpoint& server, const std::string& name = "") : name_(name) {
+    listeners_.emplace_back(Listener {
+        std::make_shared<Acceptor>(listening_executor_.io_service(), server), false });
+  }
 
   TCPServer(const std::string& host, int port, const std::string& name = "") :
     TCPServer(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(host), port), name) {}
@@ -34,11 +45,75 @@ class TCPServer {
   TCPServer(int port, const std::string& name = "") :
     TCPServer("127.0.0.1", port, name) {}
 
+  virtual ~TCPServer() {
+    for (auto& path : paths_) {
+      std::remove(path.c_str());
+    }
+  }
+
+  // another endpoint to accept on, before Start
+  bool Listen(const Endpoint& server) {
+    return Listen(server, false);
+  }
+  // a Unix domain socket, a file left at the path by an earlier run is replaced
+  // and the file is removed with the server
+  bool Listen(const std::string& path) {
+    return Listen(path, false);
+  }
+  // a generic endpoint converts from anything, a literal would be ambiguous
+  bool Listen(const char* path) {
+    return Listen(std::string(path));
+  }
+
+  // a Unix domain socket for clients connecting with ShmConnect,
+  // each connection then talks through shared memory rings
+  bool ListenShm(const std::string& path) {
+    return Listen(path, true);
+  }
+
+  // connections go through io_uring when built with it and the kernel has it,
+  // through the epoll reactor otherwise, before Start
+  void io_uring(bool io_uring) {
+    io_uring_ = io_uring;
+  }
+
+  // responses of at least min_bytes are sent with MSG_ZEROCOPY on TCP connections,
+  // zero, the default, copies them all
+  void zero_copy(size_t min_bytes) {
+    zero_copy_bytes_ = min_bytes;
+  }
+
+  // responses larger than bytes go out in fragments taking turns with the other
+  // responses of their connection, zero, the default, sends them whole
+  void fragment_bytes(size_t bytes) {
+    fragment_bytes_ = bytes;
+  }
+
   void Start() {
     listening_executor_.Start();
-    conenection_executor_.Start(4);
+    // a thread per loop, the handlers of a connection never run at once
+    conenection_executor_.Start(kConnectionLoops, 1);
+    if (io_uring_) {
+#if defined(ASIO_PBRPC_IO_URING)
+      uring_.clear();
+      for (size_t i = 0; i < conenection_executor_.size(); ++i) {
+        std::shared_ptr<IoUringLoop> uring(
+            IoUringLoop::Create(conenection_executor_.at(i).io_service()));
+        if (!uring) {
+          std::cerr << "io_uring unavailable, connections use epoll" << std::endl;
+          uring_.clear();
+          break;
+        }
+        uring_.emplace_back(std::move(uring));
+      }
+#else
+      std::cerr << "built without io_uring, connections use epoll" << std::endl;
+#endif
+    }
     working_executor_.Start(4, std::max(std::thread::hardware_concurrency() / 4, 1u));
-    StartAccept();
+    for (auto& listener : listeners_) {
+      StartAccept(listener);
+    }
   }
 
   void Stop() {
@@ -51,33 +126,100 @@ class TCPServer {
     return name_;
   }
 
+  MemoryBudget& memory_budget() {
+    return memory_budget_;
+  }
+
  protected:
-  Executor conenection_executor_;
+  static const size_t kConnectionLoops = 4;
+
+  Executors conenection_executor_;
   Executors working_executor_;
 
  private:
   TCPServer(const TCPServer&) = delete;
   TCPServer& operator=(const TCPServer&) = delete;
 
-  void StartAccept() {
+  typedef boost::asio::basic_socket_acceptor<Protocol> Acceptor;
+
+  struct Listener {
+    std::shared_ptr<Acceptor> acceptor;
+    // connections hand over shared memory rings first
+    bool shm;
+  };
+
+  bool Listen(const Endpoint& server, bool shm) {
+    try {
+      listeners_.emplace_back(Listener {
+          std::make_shared<Acceptor>(listening_executor_.io_service(), server), shm });
+    } catch (const boost::system::system_error& se) {
+      std::cerr << "listen on " << EndpointText(server) << " failed: " << se.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+  bool Listen(const std::string& path, bool shm) {
+    std::remove(path.c_str());
+    if (!Listen(LocalEndpoint(path), shm)) {
+      return false;
+    }
+    paths_.emplace_back(path);
+    return true;
+  }
+
+  // connections take turns over the loops, each stays on its own
+  void StartAccept(const Listener& listener) {
+    size_t loop = next_loop_++ % conenection_executor_.size();
     ConnectionPtr connection(std::make_shared<Connection>(
-        listening_executor_.io_service(), this));
-    acceptor_.async_accept(connection->socket(),
-        [this, connection](const boost::system::error_code& ec) {
+        conenection_executor_.at(loop).io_service(), this));
+    connection->memory_account().budget(&memory_budget_);
+    listener.acceptor->async_accept(connection->socket(),
+        [this, listener, connection, loop](const boost::system::error_code& ec) {
       if (ec) {
         std::cerr << "accept failed: " << ec.message() << std::endl;
         return;
       }
-      if (connection->Start()) {
-        connection->AsyncReceive();
+      if (zero_copy_bytes_ && !listener.shm) {
+        connection->zero_copy(zero_copy_bytes_);
+      }
+      connection->fragment_bytes(fragment_bytes_);
+#if defined(ASIO_PBRPC_IO_URING)
+      if (!uring_.empty() && !listener.shm) {
+        connection->io_uring(uring_[loop]);
+      }
+#endif
+      if (!listener.shm) {
+        if (connection->Start()) {
+          connection->AsyncReceive();
+        }
+      } else {
+        // the client sends the rings right after connecting, a slow one only holds up
+        // its own connection
+        connection->AsyncShmAccept([connection] {
+          if (connection->Start()) {
+            connection->AsyncReceive();
+          }
+        });
       }
-      StartAccept();
+      StartAccept(listener);
     });
   }
 
   const std::string name_;
+  MemoryBudget memory_budget_;
   Executor listening_executor_;
-  boost::asio::ip::tcp::acceptor acceptor_;
+  std::vector<Listener> listeners_;
+  // Unix domain socket files to remove
+  std::vector<std::string> paths_;
+  bool io_uring_ { false };
+  size_t zero_copy_bytes_ { 0 };
+  size_t fragment_bytes_ { 0 };
+  // accepts all run on the listening thread
+  size_t next_loop_ { 0 };
+#if defined(ASIO_PBRPC_IO_URING)
+  // one per connection loop, its completions run there
+  std::vector<std::shared_ptr<IoUringLoop>> uring_;
+#endif
 };
 
 }
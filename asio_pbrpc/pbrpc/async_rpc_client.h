@@ -6,93 +6,509 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #include <google/protobuf/service.h>
 
 #include <asio_pbrpc/net_trans/tcp_connection.h>
 #include <asio_pbrpc/net_trans/executor.h>
+#include "client_rpc_controller.h"
 #include "rpc_buffer.h"
+#include "rpc_stream.h"
 
 namespace asio_pbrpc {
 
-class AsyncRPCClient : public TCPConnection<RPCBuffer>,
-                  public google::protobuf::RpcChannel {
+// Any number of calls may be pending, responses are matched by call id.
+// A call with a deadline fails on its own once the deadline passes,
+// StartCancel on its ClientRPCController fails it at once and tells the server to drop it.
+// With batching on, calls made close together share one frame each way.
+// Streams of messages both ways share the connection with the calls.
+class AsyncRPCClient : public TCPConnection<RPCBuffer, StreamProtocol>,
+                  public google::protobuf::RpcChannel, public RPCCancellable {
  public:
-  using TCPConnection<RPCBuffer>::TCPConnection;
+  using TCPConnection<RPCBuffer, StreamProtocol>::TCPConnection;
 
   AsyncRPCClient(boost::asio::io_service& io_service, Executor& executor) :
-    TCPConnection(io_service), executor_(executor) {}
+    TCPConnection(io_service), executor_(executor), batch_timer_(io_service) {
+    // responses are read by a receive loop, idle reads must not time out
+    timeout(std::chrono::milliseconds(10), std::chrono::milliseconds(10),
+        std::chrono::milliseconds::zero());
+    receive_after_send(false);
+  }
 
   virtual ~AsyncRPCClient() {}
 
+  // a TCP or a Unix domain endpoint
+  bool SyncConnect(const Endpoint& remote) {
+    if (!TCPConnection::SyncConnect(remote)) {
+      return false;
+    }
+    connected_.store(true, std::memory_order_release);
+    return true;
+  }
+  bool SyncConnect(const std::string& host, int port) {
+    return SyncConnect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(host), port));
+  }
+  // a server on the same host listening on a Unix domain socket
+  bool SyncConnect(const std::string& path) {
+    return SyncConnect(LocalEndpoint(path));
+  }
+  bool SyncConnect(const char* path) {
+    return SyncConnect(LocalEndpoint(path));
+  }
+  // connecting() until connected or failed
+  void AsyncConnect(const Endpoint& remote) {
+    connecting_.store(true, std::memory_order_release);
+    TCPConnection::AsyncConnect(remote);
+  }
+  void AsyncConnect(const std::string& host, int port) {
+    AsyncConnect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(host), port));
+  }
+  void AsyncConnect(const std::string& path) {
+    AsyncConnect(LocalEndpoint(path));
+  }
+  void AsyncConnect(const char* path) {
+    AsyncConnect(LocalEndpoint(path));
+  }
+  // through shared memory with a server on this host listening with ListenShm
+  bool ShmConnect(const std::string& path,
+      size_t ring_size = ShmTransport::kDefaultRingSize) {
+    if (!TCPConnection::ShmConnect(path, ring_size)) {
+      return false;
+    }
+    connected_.store(true, std::memory_order_release);
+    return true;
+  }
+
   void CallMethod(const google::protobuf::MethodDescriptor* method,
       google::protobuf::RpcController* controller,
       const google::protobuf::Message* request,
       google::protobuf::Message* response,
       google::protobuf::Closure* done) override {
-    size_t method_id = std::hash<std::string>()(method->full_name());
+    Call(RPCMethodId(method->full_name()), controller, request, nullptr, response, done);
+  }
+
+  // by a method id known ahead, as generated stubs call, the name is not hashed per call
+  void CallMethod(uint64_t method_id, google::protobuf::RpcController* controller,
+      const google::protobuf::Message* request,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) {
+    Call(method_id, controller, request, nullptr, response, done);
+  }
+
+  // the request serialized once by the caller, its bytes are shared by every connection
+  // sending it, only the header is written per call
+  void CallMethod(const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller,
+      const SharedPayload& request,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) {
+    Call(RPCMethodId(method->full_name()), controller, nullptr, request, response, done);
+  }
+
+  // A stream of the method, the messages read from it are of the method's output type.
+  // The controller's deadline, priority and tenant go with it, window is the message
+  // bytes read ahead. Writes wait for the server to accept the stream
+  std::shared_ptr<RPCStream> OpenStream(const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller = nullptr, size_t window = kRPCStreamWindow) {
+    return OpenStream(RPCMethodId(method->full_name()),
+        *google::protobuf::MessageFactory::generated_factory()->GetPrototype(
+            method->output_type()), controller, window);
+  }
+  // by a method id known ahead, the messages read are made from response_prototype
+  std::shared_ptr<RPCStream> OpenStream(uint64_t method_id,
+      const google::protobuf::Message& response_prototype,
+      google::protobuf::RpcController* controller = nullptr, size_t window = kRPCStreamWindow) {
+    RPCHeader header;
+    header.method_id = method_id;
+    header.deadline = RPCControllerDeadline(controller);
+    header.priority = RPCControllerPriority(controller);
+    header.tenant = RPCControllerTenant(controller);
+    // streams and calls share the ids of the connection
+    header.call_id = next_call_id_.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::shared_ptr<RPCStream> stream(std::make_shared<RPCStream>(shared_from_this(), streams_,
+        header, MessagePtr(response_prototype.New()), window));
+    if (!connected()) {
+      stream->Fail("not connected");
+      return stream;
+    }
+    streams_->Add(header.call_id, stream);
+    if (!receiving_.exchange(true, std::memory_order_acq_rel)) {
+      AsyncReceive();
+    }
+    stream->Open();
+    return stream;
+  }
+
+  // calls made within the window after the first unsent one go out in one frame,
+  // up to max_calls or max_bytes, zero disables
+  void batching(const std::chrono::microseconds& window, size_t max_calls = 64,
+      size_t max_bytes = 64 << 10) {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    batch_window_ = window;
+    batch_max_calls_ = std::max<size_t>(max_calls, 1);
+    batch_max_bytes_ = max_bytes;
+  }
+
+  void Cancel(uint64_t call_id) override {
+    PendingCall call;
+    if (!Remove(call_id, call)) {
+      return;
+    }
+    RPCHeader header;
+    header.call_id = call_id;
+    header.flags = kRPCFlagCancel;
     BufferPtr output_buffer(std::make_shared<RPCBuffer>());
-    output_buffer->Serialize(method_id, *request);
-    response_ = response;
-    controller_ = controller;
-    done_ = done;
-    try {
-      promise_ = std::promise<void>();
-    } catch (const std::future_error&) {}
-    AsyncSend(output_buffer);
+    output_buffer->Serialize(header);
+    AsyncSend(output_buffer, kRPCPriorityHigh);
+    Complete(std::move(call), "cancelled");
   }
 
+  // until no call is pending
   void Wait() {
-    try {
-      promise_.get_future().wait();
-    } catch (const std::future_error&) {}
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_.empty(); });
+  }
+
+  size_t outstanding() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size();
+  }
+
+  bool connected() const {
+    return connected_.load(std::memory_order_acquire);
+  }
+  bool connecting() const {
+    return connecting_.load(std::memory_order_acquire);
+  }
+
+  // larger responses close the connection, failing the pending calls, no limit by default
+  void max_message_length(size_t max_message_length) {
+    input_buffer()->max_message_length(max_message_length);
   }
 
  protected:
-  bool DoReceive() {
+  struct PendingCall {
+    google::protobuf::Message* response { nullptr };
+    google::protobuf::RpcController* controller { nullptr };
+    google::protobuf::Closure* done { nullptr };
+    std::shared_ptr<SteadyTimer> timer;
+  };
+
+  bool OnConnect() override {
+    connected_.store(true, std::memory_order_release);
+    connecting_.store(false, std::memory_order_release);
+    return true;
+  }
+
+  bool OnReceive() override {
     while (true) {
-      size_t method_id;
-      boost::tribool ret = input_buffer()->Parse(method_id, *response_);
-      if (!ret) {
-        if (controller_) {
-          controller_->SetFailed("parse failed");
+      auto head = input_buffer()->ParseMessageLength();
+      if (!head.first) {
+        std::cerr << "bad message!" << std::endl;
+        return false;
+      } else if (boost::indeterminate(head.first)) {
+        AsyncReceive();
+        return true;
+      }
+      RPCHeader header = input_buffer()->ParseHeader();
+      size_t pb_length = head.second - sizeof(RPCHeader);
+      if (header.flags & kRPCFlagFragment) {
+        // the whole frame is parsed from the front once its last fragment is in
+        if (!input_buffer()->Reassemble(header, pb_length)) {
+          return false;
         }
+        continue;
+      }
+      if (header.flags & kRPCFlagBatch) {
+        // the responses follow as ordinary frames
+        continue;
+      }
+      size_t attachment_bytes;
+      if (!input_buffer()->ParseAttachments(header, pb_length, attachment_sizes_,
+          attachment_bytes)) {
+        std::cerr << "bad attachments!" << std::endl;
         return false;
-      } else if (ret) {
-        break;
       }
+      if (header.flags & kRPCStreamFlags) {
+        std::shared_ptr<RPCStream> stream(streams_->Find(header.call_id));
+        if (!stream) {
+          // the stream is over
+          input_buffer()->retrieve(pb_length);
+        } else if (!stream->OnFrame(header, *input_buffer(), pb_length)) {
+          return false;
+        }
+        input_buffer()->retrieve(attachment_bytes);
+        continue;
+      }
+      PendingCall call;
+      if (!Remove(header.call_id, call)) {
+        // expired or cancelled
+        input_buffer()->retrieve(pb_length + attachment_bytes);
+        continue;
+      }
+      if (header.status != kRPCOk) {
+        input_buffer()->retrieve(pb_length + attachment_bytes);
+        Complete(std::move(call), RPCStatusText(header.status));
+      } else if (!input_buffer()->ParseMessage(*call.response, pb_length)) {
+        input_buffer()->retrieve(attachment_bytes);
+        Complete(std::move(call), "parse failed");
+      } else {
+        if (!attachment_sizes_.empty()) {
+          RPCAttachments attachments(RPCTakeAttachments(*this, attachment_sizes_));
+          if (ClientRPCController* client_controller =
+              dynamic_cast<ClientRPCController*>(call.controller)) {
+            client_controller->response_attachments(std::move(attachments));
+          }
+        }
+        Complete(std::move(call));
+      }
+    }
+  }
+
+  void OnError(const std::string& error) override {
+    connected_.store(false, std::memory_order_release);
+    connecting_.store(false, std::memory_order_release);
+    receiving_.store(false, std::memory_order_release);
+    decltype(pending_) pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending.swap(pending_);
+    }
+    for (auto& call : pending) {
+      TransportFailed(call.second.controller);
+      Complete(std::move(call.second), error);
+    }
+    streams_->FailAll(error);
+  }
+
+  bool OnClose() override {
+    connected_.store(false, std::memory_order_release);
+    streams_->FailAll("connection closed");
+    return true;
+  }
+
+  BufferPtr FragmentHead(uint64_t fragment_id, size_t bytes, bool last) override {
+    BufferPtr head(std::make_shared<RPCBuffer>());
+    head->SerializeFragment(fragment_id, bytes, last);
+    return head;
+  }
+
+  // exactly one of request and payload is set
+  void Call(uint64_t method_id, google::protobuf::RpcController* controller,
+      const google::protobuf::Message* request, const SharedPayload& payload,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) {
+    RPCHeader header;
+    header.method_id = method_id;
+    header.deadline = RPCControllerDeadline(controller);
+    header.priority = RPCControllerPriority(controller);
+    header.tenant = RPCControllerTenant(controller);
+    header.call_id = next_call_id_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (RPCDeadline::Expired(header.deadline)) {
+      Complete(PendingCall { response, controller, done, nullptr },
+          RPCStatusText(kRPCDeadlineExceeded));
+      return;
+    }
+    if (!connected()) {
+      TransportFailed(controller);
+      Complete(PendingCall { response, controller, done, nullptr }, "not connected");
+      return;
+    }
+    PendingCall call { response, controller, done, nullptr };
+    if (header.deadline) {
+      call.timer = std::make_shared<SteadyTimer>(io_service());
+      call.timer->expires_from_now(std::chrono::duration_cast<SteadyTimer::duration_type>(
+          RPCDeadline::Remaining(header.deadline)));
+      auto self(std::static_pointer_cast<AsyncRPCClient>(shared_from_this()));
+      uint64_t call_id = header.call_id;
+      call.timer->async_wait([self, call_id](const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+        PendingCall call;
+        if (self->Remove(call_id, call)) {
+          self->Complete(std::move(call), RPCStatusText(kRPCDeadlineExceeded));
+        }
+      });
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.emplace(header.call_id, std::move(call));
+    }
+    if (ClientRPCController* client_controller = dynamic_cast<ClientRPCController*>(controller)) {
+      client_controller->cancellable(
+          std::static_pointer_cast<AsyncRPCClient>(shared_from_this()), header.call_id);
+      // cancelled before it was sent
+      if (client_controller->cancel_started()) {
+        Cancel(header.call_id);
+        return;
+      }
+    }
+    if (!receiving_.exchange(true, std::memory_order_acq_rel)) {
       AsyncReceive();
     }
-    if (!done_) {
-      return true;
+    size_t lane = header.priority < kRPCPriorityCount ? header.priority : kDefaultSendLane;
+    // attachments are sent from where they are, never copied into a batch
+    const RPCAttachments* attachments = RPCControllerAttachments(controller);
+    if (!payload && !attachments && Batch(header, *request, lane)) {
+      return;
     }
-    try {
-      done_->Run();
-    } catch (...) {
+    BufferPtr output_buffer(std::make_shared<RPCBuffer>());
+    if (!attachments) {
+      if (payload) {
+        output_buffer->SerializeHead(header, payload->size());
+      } else {
+        output_buffer->Serialize(header, *request);
+      }
+      AsyncSend(output_buffer, payload, lane);
+      return;
+    }
+    RPCAttachments slices;
+    slices.reserve(attachments->size() + 1);
+    if (payload) {
+      output_buffer->SerializeHead(header, payload->size(), *attachments);
+      slices.emplace_back(RPCAttachment { payload->data(), payload->size(), payload });
+    } else {
+      output_buffer->Serialize(header, *request, *attachments);
+    }
+    slices.insert(slices.end(), attachments->begin(), attachments->end());
+    AsyncSend(output_buffer, std::move(slices), lane);
+  }
+
+  // false if batching is off
+  bool Batch(const RPCHeader& header, const google::protobuf::Message& request, size_t lane) {
+    BufferPtr output_buffer;
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex_);
+      if (!batch_window_.count()) {
+        return false;
+      }
+      if (!batch_buffer_) {
+        batch_buffer_ = std::make_shared<RPCBuffer>();
+        batch_buffer_->BeginBatch();
+        batch_lane_ = lane;
+        auto self(std::static_pointer_cast<AsyncRPCClient>(shared_from_this()));
+        uint64_t generation = batch_generation_;
+        batch_timer_.expires_from_now(
+            std::chrono::duration_cast<SteadyTimer::duration_type>(batch_window_));
+        batch_timer_.async_wait([self, generation](const boost::system::error_code& ec) {
+          if (ec == boost::asio::error::operation_aborted) {
+            return;
+          }
+          self->FlushBatch(generation);
+        });
+      }
+      batch_buffer_->Serialize(header, request);
+      batch_lane_ = std::min(batch_lane_, lane);
+      if (++batch_calls_ >= batch_max_calls_ ||
+          batch_buffer_->readable_bytes() >= batch_max_bytes_) {
+        lane = batch_lane_;
+        output_buffer = TakeBatch();
+      }
+    }
+    if (output_buffer) {
+      AsyncSend(output_buffer, lane);
+    }
+    return true;
+  }
+
+  // the window of the batch started in generation passed
+  void FlushBatch(uint64_t generation) {
+    BufferPtr output_buffer;
+    size_t lane;
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex_);
+      if (generation != batch_generation_ || !batch_buffer_) {
+        return;
+      }
+      lane = batch_lane_;
+      output_buffer = TakeBatch();
+    }
+    AsyncSend(output_buffer, lane);
+  }
+
+  // with the batch lock held
+  BufferPtr TakeBatch() {
+    BufferPtr output_buffer;
+    output_buffer.swap(batch_buffer_);
+    if (batch_calls_ == 1) {
+      output_buffer->UnwrapBatch();
+    } else {
+      output_buffer->EndBatch(batch_calls_);
+    }
+    batch_calls_ = 0;
+    ++batch_generation_;
+    boost::system::error_code ec;
+    batch_timer_.cancel(ec);
+    return output_buffer;
+  }
+
+  bool Remove(uint64_t call_id, PendingCall& call) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto ite = pending_.find(call_id);
+    if (ite == pending_.end()) {
       return false;
     }
+    call = std::move(ite->second);
+    pending_.erase(ite);
     return true;
   }
 
-  bool OnReceive() override {
-    bool ret = DoReceive();
-    try {
-      promise_.set_value();
-    } catch (const std::future_error&) {}
-    return ret;
+  void Complete(PendingCall call, const char* error = nullptr) {
+    if (call.timer) {
+      call.timer->cancel();
+    }
+    if (error && call.controller) {
+      call.controller->SetFailed(error);
+    }
+    if (call.done) {
+      try {
+        call.done->Run();
+      } catch (...) {}
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty()) {
+      idle_.notify_all();
+    }
+  }
+  void Complete(PendingCall call, const std::string& error) {
+    Complete(std::move(call), error.c_str());
   }
 
-  void OnError(const std::string& error) override {
-    if (controller_) {
-      controller_->SetFailed(error);
+  static void TransportFailed(google::protobuf::RpcController* controller) {
+    if (ClientRPCController* client_controller = dynamic_cast<ClientRPCController*>(controller)) {
+      client_controller->transport_failed(true);
     }
   }
 
  private:
   Executor& executor_;
-  google::protobuf::Closure* done_ { nullptr };
-  google::protobuf::Message* response_ { nullptr };
-  google::protobuf::RpcController* controller_ { nullptr };
-  std::promise<void> promise_;
+  std::atomic_uint64_t next_call_id_ { 0 };
+  std::atomic_bool connected_ { false };
+  std::atomic_bool connecting_ { false };
+  std::atomic_bool receiving_ { false };
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  std::unordered_map<uint64_t, PendingCall> pending_;
+  std::shared_ptr<RPCStreamTable> streams_ { std::make_shared<RPCStreamTable>() };
+  // of the response being received
+  std::vector<size_t> attachment_sizes_;
+  std::mutex batch_mutex_;
+  std::chrono::microseconds batch_window_ { 0 };
+  size_t batch_max_calls_ { 64 };
+  size_t batch_max_bytes_ { 64 << 10 };
+  BufferPtr batch_buffer_;
+  size_t batch_calls_ { 0 };
+  size_t batch_lane_ { kDefaultSendLane };
+  uint64_t batch_generation_ { 0 };
+  SteadyTimer batch_timer_;
 };
 
 }
@@ -0,0 +1,244 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+
+#include "client_rpc_controller.h"
+#include "rpc_buffer.h"
+
+namespace asio_pbrpc {
+
+// RpcChannel decorator answering calls of cacheable methods from memory.
+// Entries are keyed by the method and the request's serialized bytes, expire after the method's
+// ttl and are evicted least recently used first from a byte bounded, sharded cache.
+// Concurrent misses of one key share a single call to the underlying channel.
+// A hit runs done on the calling thread, after copying the cached response.
+class CachedRPCChannel : public google::protobuf::RpcChannel {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  CachedRPCChannel(google::protobuf::RpcChannel* channel,
+      size_t capacity = size_t(64) << 20, size_t shards = 16) :
+    channel_(channel), shards_(std::max<size_t>(shards, 1)),
+    shard_capacity_(capacity / shards_.size()) {}
+
+  // only these methods are cached, their answers may be up to ttl old
+  void cache(const google::protobuf::MethodDescriptor* method,
+      const std::chrono::milliseconds& ttl) {
+    std::lock_guard<std::mutex> lock(ttls_mutex_);
+    ttls_[method] = ttl;
+  }
+
+  void CallMethod(const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller,
+      const google::protobuf::Message* request,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) override {
+    Clock::duration ttl;
+    {
+      std::lock_guard<std::mutex> lock(ttls_mutex_);
+      auto ite = ttls_.find(method);
+      if (ite == ttls_.end()) {
+        channel_->CallMethod(method, controller, request, response, done);
+        return;
+      }
+      ttl = ite->second;
+    }
+    // serialization is not canonical for every message, equal requests may still miss,
+    // but equal bytes are always an equal request
+    std::string key(reinterpret_cast<const char*>(&method), sizeof(method));
+    request->AppendToString(&key);
+    Shard& shard = shards_[std::hash<std::string>()(key) % shards_.size()];
+    MessagePtr cached;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto ite = shard.index.find(key);
+      if (ite != shard.index.end()) {
+        if (Clock::now() < ite->second->expire_time) {
+          shard.lru.splice(shard.lru.begin(), shard.lru, ite->second);
+          cached = ite->second->response;
+        } else {
+          Erase(shard, ite->second);
+        }
+      }
+      if (!cached) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        auto flight = shard.flights.find(key);
+        if (flight != shard.flights.end()) {
+          flight->second.emplace_back(Waiter { controller, response, done });
+          coalesced_.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        shard.flights[key];
+      }
+    }
+    if (cached) {
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      response->CopyFrom(*cached);
+      if (done) {
+        done->Run();
+      }
+      return;
+    }
+    std::shared_ptr<Flight> flight(std::make_shared<Flight>());
+    flight->shard = &shard;
+    flight->key = std::move(key);
+    flight->ttl = ttl;
+    flight->caller = Waiter { controller, response, done };
+    flight->response.reset(response->New());
+    flight->controller.deadline(RPCControllerDeadline(controller));
+    flight->controller.priority(RPCControllerPriority(controller));
+    flight->controller.tenant(RPCControllerTenant(controller));
+    channel_->CallMethod(method, &flight->controller, request, flight->response.get(),
+        google::protobuf::NewCallback(this, &CachedRPCChannel::Land, flight));
+  }
+
+  void Clear() {
+    for (auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.lru.clear();
+      shard.index.clear();
+      shard.bytes = 0;
+    }
+  }
+
+  size_t hits() const {
+    return hits_.load(std::memory_order_relaxed);
+  }
+  size_t misses() const {
+    return misses_.load(std::memory_order_relaxed);
+  }
+  size_t evictions() const {
+    return evictions_.load(std::memory_order_relaxed);
+  }
+  // misses answered by a call already in flight
+  size_t coalesced() const {
+    return coalesced_.load(std::memory_order_relaxed);
+  }
+  size_t bytes() {
+    size_t total = 0;
+    for (auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      total += shard.bytes;
+    }
+    return total;
+  }
+
+ private:
+  CachedRPCChannel(const CachedRPCChannel&) = delete;
+  CachedRPCChannel& operator=(const CachedRPCChannel&) = delete;
+
+  struct Entry {
+    std::string key;
+    MessagePtr response;
+    size_t bytes;
+    Clock::time_point expire_time;
+  };
+
+  struct Waiter {
+    google::protobuf::RpcController* controller;
+    google::protobuf::Message* response;
+    google::protobuf::Closure* done;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    // most recently used first
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes { 0 };
+    // keys being fetched, with the callers waiting for them
+    std::unordered_map<std::string, std::vector<Waiter>> flights;
+  };
+
+  struct Flight {
+    Shard* shard;
+    std::string key;
+    Clock::duration ttl;
+    Waiter caller;
+    MessagePtr response;
+    ClientRPCController controller;
+  };
+
+  // with the shard lock held
+  void Erase(Shard& shard, std::list<Entry>::iterator entry) {
+    shard.bytes -= entry->bytes;
+    shard.index.erase(entry->key);
+    shard.lru.erase(entry);
+  }
+
+  void Land(std::shared_ptr<Flight> flight) {
+    Shard& shard = *flight->shard;
+    bool failed = flight->controller.Failed();
+    std::vector<Waiter> waiters;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto ite = shard.flights.find(flight->key);
+      if (ite != shard.flights.end()) {
+        waiters.swap(ite->second);
+        shard.flights.erase(ite);
+      }
+      if (!failed) {
+        auto old = shard.index.find(flight->key);
+        if (old != shard.index.end()) {
+          Erase(shard, old->second);
+        }
+        size_t bytes = flight->key.size() * 2 + flight->response->SpaceUsedLong();
+        if (bytes <= shard_capacity_) {
+          shard.lru.emplace_front(Entry { flight->key, flight->response, bytes,
+              Clock::now() + flight->ttl });
+          shard.index.emplace(flight->key, shard.lru.begin());
+          shard.bytes += bytes;
+          while (shard.bytes > shard_capacity_) {
+            Erase(shard, std::prev(shard.lru.end()));
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+      }
+    }
+    waiters.emplace_back(flight->caller);
+    for (auto& waiter : waiters) {
+      if (failed) {
+        if (waiter.controller) {
+          waiter.controller->SetFailed(flight->controller.ErrorText());
+        }
+      } else {
+        waiter.response->CopyFrom(*flight->response);
+      }
+      if (waiter.done) {
+        waiter.done->Run();
+      }
+    }
+  }
+
+  google::protobuf::RpcChannel* channel_;
+  std::mutex ttls_mutex_;
+  std::unordered_map<const google::protobuf::MethodDescriptor*, Clock::duration> ttls_;
+  std::vector<Shard> shards_;
+  const size_t shard_capacity_;
+  std::atomic_size_t hits_ { 0 };
+  std::atomic_size_t misses_ { 0 };
+  std::atomic_size_t evictions_ { 0 };
+  std::atomic_size_t coalesced_ { 0 };
+};
+
+}
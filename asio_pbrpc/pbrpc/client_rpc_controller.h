@@ -7,11 +7,25 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 
 #include <google/protobuf/service.h>
 
+#include "rpc_buffer.h"
+#include "rpc_deadline.h"
+
 namespace asio_pbrpc {
 
+// channels able to abandon a pending call
+class RPCCancellable {
+ public:
+  virtual ~RPCCancellable() {}
+  virtual void Cancel(uint64_t call_id) = 0;
+};
+
 class ClientRPCController : public google::protobuf::RpcController {
  public:
   virtual ~ClientRPCController() {}
@@ -19,20 +33,60 @@ class ClientRPCController : public google::protobuf::RpcController {
   void Reset() override {
     reason_.clear();
     failed_.store(false, std::memory_order_relaxed);
+    transport_failed_.store(false, std::memory_order_relaxed);
     cancel_.store(false, std::memory_order_relaxed);
     cancelled_.store(false, std::memory_order_relaxed);
+    deadline_ = 0;
+    priority_ = kRPCPriorityDefault;
+    tenant_ = 0;
+    request_attachments_.clear();
+    response_attachments_.clear();
+    std::lock_guard<std::mutex> lock(cancel_mutex_);
+    cancellable_.reset();
+    call_id_ = 0;
   }
 
   bool Failed() const override {
     return failed_.load(std::memory_order_acquire);
   }
 
+  // failed without a reply, the call could not be sent or the connection broke,
+  // rather than the server answering with a failure
+  bool transport_failed() const {
+    return transport_failed_.load(std::memory_order_acquire);
+  }
+  void transport_failed(bool transport_failed) {
+    transport_failed_.store(transport_failed, std::memory_order_release);
+  }
+
   std::string ErrorText() const override {
     return reason_;
   }
 
+  // the pending call fails at once, the server drops it if it has not started yet
   void StartCancel() override {
     cancel_.store(true, std::memory_order_release);
+    std::shared_ptr<RPCCancellable> cancellable;
+    uint64_t call_id;
+    {
+      std::lock_guard<std::mutex> lock(cancel_mutex_);
+      cancellable = cancellable_.lock();
+      call_id = call_id_;
+    }
+    if (cancellable) {
+      cancellable->Cancel(call_id);
+    }
+  }
+
+  bool cancel_started() const {
+    return cancel_.load(std::memory_order_acquire);
+  }
+
+  // set by the channel sending the call
+  void cancellable(std::weak_ptr<RPCCancellable> cancellable, uint64_t call_id) {
+    std::lock_guard<std::mutex> lock(cancel_mutex_);
+    cancellable_ = std::move(cancellable);
+    call_id_ = call_id;
   }
 
   void SetFailed(const std::string& reason) override {
@@ -54,11 +108,94 @@ class ClientRPCController : public google::protobuf::RpcController {
     cancelled_.store(true, std::memory_order_release);
   }
 
+  // relative to now, sent to the server as an absolute deadline
+  void timeout(const std::chrono::microseconds& timeout) {
+    deadline_ = RPCDeadline::After(timeout);
+  }
+
+  // microseconds since the system clock epoch
+  void deadline(int64_t deadline) {
+    deadline_ = deadline;
+  }
+  // if none is set, the deadline of the request being served by this thread
+  int64_t deadline() const {
+    return deadline_ ? deadline_ : RPCDeadline::Current();
+  }
+
+  // overrides the priority the server registered for the method
+  void priority(RPCPriority priority) {
+    priority_ = priority;
+  }
+  RPCPriority priority() const {
+    return priority_;
+  }
+
+  // requests of a tenant share the server fairly with other tenants
+  void tenant(uint32_t tenant) {
+    tenant_ = tenant;
+  }
+  uint32_t tenant() const {
+    return tenant_;
+  }
+
+  // raw bytes sent after the request message without being copied,
+  // the owner keeps them valid until sent, none for bytes outliving the channel
+  void AddRequestAttachment(const char* data, size_t size,
+      std::shared_ptr<const void> owner = nullptr) {
+    request_attachments_.emplace_back(RPCAttachment { data, size, std::move(owner) });
+  }
+  const RPCAttachments& request_attachments() const {
+    return request_attachments_;
+  }
+
+  // received after the response message, valid while the controller holds them
+  const RPCAttachments& response_attachments() const {
+    return response_attachments_;
+  }
+  void response_attachments(RPCAttachments attachments) {
+    response_attachments_ = std::move(attachments);
+  }
+
  private:
   std::string reason_;
   std::atomic_bool failed_ { false };
+  std::atomic_bool transport_failed_ { false };
   std::atomic_bool cancel_ { false };
   std::atomic_bool cancelled_ { false };
+  std::mutex cancel_mutex_;
+  std::weak_ptr<RPCCancellable> cancellable_;
+  uint64_t call_id_ { 0 };
+  int64_t deadline_ { 0 };
+  RPCPriority priority_ { kRPCPriorityDefault };
+  uint32_t tenant_ { 0 };
+  RPCAttachments request_attachments_;
+  RPCAttachments response_attachments_;
 };
 
+inline int64_t RPCControllerDeadline(const google::protobuf::RpcController* controller) {
+  const ClientRPCController* client_controller =
+      dynamic_cast<const ClientRPCController*>(controller);
+  return client_controller ? client_controller->deadline() : RPCDeadline::Current();
+}
+
+inline RPCPriority RPCControllerPriority(const google::protobuf::RpcController* controller) {
+  const ClientRPCController* client_controller =
+      dynamic_cast<const ClientRPCController*>(controller);
+  return client_controller ? client_controller->priority() : kRPCPriorityDefault;
+}
+
+inline uint32_t RPCControllerTenant(const google::protobuf::RpcController* controller) {
+  const ClientRPCController* client_controller =
+      dynamic_cast<const ClientRPCController*>(controller);
+  return client_controller ? client_controller->tenant() : 0;
+}
+
+inline const RPCAttachments* RPCControllerAttachments(
+    const google::protobuf::RpcController* controller) {
+  const ClientRPCController* client_controller =
+      dynamic_cast<const ClientRPCController*>(controller);
+  return client_controller && !client_controller->request_attachments().empty() ?
+      &client_controller->request_attachments() : nullptr;
+}
+
 }
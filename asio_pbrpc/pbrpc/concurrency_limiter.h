@@ -0,0 +1,143 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+namespace asio_pbrpc {
+
+// Adaptive limit on requests in flight, gradient style:
+// a long term average of handler latency is the no-load baseline,
+// the average of the last window is compared against it,
+// the limit shrinks when latency rises above the baseline and
+// grows by a queue allowance of sqrt(limit) otherwise.
+class ConcurrencyLimiter {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  ConcurrencyLimiter(size_t initial_limit = 20, size_t min_limit = 2,
+      size_t max_limit = 1000) :
+    min_limit_(min_limit), max_limit_(max_limit),
+    estimated_limit_(initial_limit), limit_(initial_limit) {}
+
+  bool TryAcquire() {
+    size_t in_flight = in_flight_.load(std::memory_order_relaxed);
+    do {
+      if (enabled_.load(std::memory_order_relaxed) &&
+          in_flight >= limit_.load(std::memory_order_relaxed)) {
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!in_flight_.compare_exchange_weak(in_flight, in_flight + 1,
+        std::memory_order_acq_rel));
+    admitted_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // call once for every admitted request, with its handler latency
+  void Release(Clock::duration latency) {
+    size_t in_flight = in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+    Sample(latency, in_flight);
+  }
+  // for an admitted stream, whose length says nothing of the load,
+  // or a call that never ran
+  void Release() {
+    in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  void enable(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  // latency tolerated above the baseline before the limit shrinks
+  void tolerance(double tolerance) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tolerance_ = std::max(tolerance, 1.0);
+  }
+
+  void window(const std::chrono::milliseconds& window) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_ = window;
+  }
+
+  size_t limit() const {
+    return limit_.load(std::memory_order_relaxed);
+  }
+  size_t in_flight() const {
+    return in_flight_.load(std::memory_order_relaxed);
+  }
+  size_t admitted() const {
+    return admitted_.load(std::memory_order_relaxed);
+  }
+  size_t rejected() const {
+    return rejected_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  ConcurrencyLimiter(const ConcurrencyLimiter&) = delete;
+  ConcurrencyLimiter& operator=(const ConcurrencyLimiter&) = delete;
+
+  static constexpr size_t kMinWindowSamples = 10;
+  static constexpr double kLongRttDecay = 0.05;
+  static constexpr double kSmoothing = 0.2;
+
+  void Sample(Clock::duration latency, size_t in_flight) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_rtt_ += std::chrono::duration<double, std::micro>(latency).count();
+    ++window_samples_;
+    window_max_in_flight_ = std::max(window_max_in_flight_, in_flight);
+    Clock::time_point current_time(Clock::now());
+    if (window_samples_ < kMinWindowSamples || current_time - window_start_ < window_) {
+      return;
+    }
+    double short_rtt = std::max(window_rtt_ / window_samples_, 1.0);
+    if (long_rtt_ <= 0) {
+      long_rtt_ = short_rtt;
+    } else {
+      long_rtt_ = long_rtt_ * (1 - kLongRttDecay) + short_rtt * kLongRttDecay;
+      // recovering from overload, let the baseline catch up quickly
+      if (long_rtt_ > short_rtt * 2) {
+        long_rtt_ = long_rtt_ * 0.9 + short_rtt * 0.1;
+      }
+    }
+    // enough load to learn about the limit, a mostly idle window says nothing
+    if (window_max_in_flight_ * 2 >= estimated_limit_) {
+      double gradient = std::max(0.5, std::min(1.0, tolerance_ * long_rtt_ / short_rtt));
+      double new_limit = estimated_limit_ * gradient + std::sqrt(estimated_limit_);
+      estimated_limit_ = estimated_limit_ * (1 - kSmoothing) + new_limit * kSmoothing;
+      estimated_limit_ = std::max<double>(min_limit_,
+          std::min<double>(max_limit_, estimated_limit_));
+      limit_.store(static_cast<size_t>(estimated_limit_), std::memory_order_relaxed);
+    }
+    window_start_ = current_time;
+    window_rtt_ = 0;
+    window_samples_ = 0;
+    window_max_in_flight_ = 0;
+  }
+
+  const size_t min_limit_, max_limit_;
+  std::mutex mutex_;
+  double tolerance_ { 2.0 };
+  std::chrono::milliseconds window_ { 100 };
+  double estimated_limit_;
+  double long_rtt_ { 0 };
+  double window_rtt_ { 0 };
+  size_t window_samples_ { 0 };
+  size_t window_max_in_flight_ { 0 };
+  Clock::time_point window_start_ { Clock::now() };
+  std::atomic_bool enabled_ { true };
+  std::atomic_size_t limit_;
+  std::atomic_size_t in_flight_ { 0 };
+  std::atomic_size_t admitted_ { 0 };
+  std::atomic_size_t rejected_ { 0 };
+};
+
+}
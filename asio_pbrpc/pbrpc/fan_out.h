@@ -0,0 +1,232 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+
+#include "async_rpc_client.h"
+#include "client_rpc_controller.h"
+#include "rpc_buffer.h"
+#include "rpc_deadline.h"
+
+namespace asio_pbrpc {
+
+// Scatter-gather of one method over many connections, all calls are in flight at once.
+// Responses are reported as they arrive, the fan-out completes once every target replied,
+// a quorum or the first target succeeded, or the deadline passed, keeping the partial results,
+// the targets still pending then are cancelled.
+// A request shared by all targets is serialized once and its bytes are shared by all the sends.
+// Create it with std::make_shared, set it up and call Start once.
+class FanOut : public std::enable_shared_from_this<FanOut> {
+ public:
+  enum Completion {
+    kAll,
+    kQuorum,
+    kFirstSuccess,
+  };
+
+  typedef std::shared_ptr<AsyncRPCClient> Target;
+  // target index, its controller and response
+  typedef std::function<void(size_t, const ClientRPCController&,
+      const google::protobuf::Message&)> ResponseCallback;
+  typedef std::function<void(FanOut&)> DoneCallback;
+
+  FanOut() = default;
+
+  // the quorum counts successful responses
+  void completion(Completion completion, size_t quorum = 0) {
+    completion_ = completion;
+    quorum_ = quorum;
+  }
+
+  // applies to every target, a deadline inherited from a handler is kept otherwise
+  void timeout(const std::chrono::microseconds& timeout) {
+    deadline_ = RPCDeadline::After(timeout);
+  }
+  void deadline(int64_t deadline) {
+    deadline_ = deadline;
+  }
+  void priority(RPCPriority priority) {
+    priority_ = priority;
+  }
+  void tenant(uint32_t tenant) {
+    tenant_ = tenant;
+  }
+
+  // called on the I/O threads, one at a time
+  void on_response(ResponseCallback on_response) {
+    on_response_ = std::move(on_response);
+  }
+  void on_done(DoneCallback on_done) {
+    on_done_ = std::move(on_done);
+  }
+
+  // the same request to every target
+  void Start(const std::vector<Target>& targets,
+      const google::protobuf::MethodDescriptor* method,
+      const google::protobuf::Message& request,
+      const google::protobuf::Message& response_prototype) {
+    AsyncRPCClient::SharedPayload payload(
+        std::make_shared<const std::string>(request.SerializeAsString()));
+    Prepare(targets.size(), response_prototype);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      targets[i]->CallMethod(method, &controllers_[i], payload, responses_[i].get(),
+          google::protobuf::NewCallback(&FanOut::Done, shared_from_this(), i));
+    }
+  }
+
+  // one request per target, in the same order
+  void Start(const std::vector<Target>& targets,
+      const google::protobuf::MethodDescriptor* method,
+      const std::vector<const google::protobuf::Message*>& requests,
+      const google::protobuf::Message& response_prototype) {
+    assert(targets.size() == requests.size());
+    Prepare(targets.size(), response_prototype);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      targets[i]->CallMethod(method, &controllers_[i], requests[i], responses_[i].get(),
+          google::protobuf::NewCallback(&FanOut::Done, shared_from_this(), i));
+    }
+  }
+
+  // until the fan-out completes and on_done returned
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_condition_.wait(lock, [this] { return done_; });
+  }
+
+  bool finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return finished_;
+  }
+
+  // results are stable once finished, responses of targets not replied are unspecified
+  size_t size() const {
+    return responses_.size();
+  }
+  bool replied(size_t index) const {
+    return replied_[index];
+  }
+  bool succeeded(size_t index) const {
+    return replied_[index] && !controllers_[index].Failed();
+  }
+  const ClientRPCController& controller(size_t index) const {
+    return controllers_[index];
+  }
+  const google::protobuf::Message& response(size_t index) const {
+    return *responses_[index];
+  }
+  size_t successes() const {
+    return successes_;
+  }
+  size_t failures() const {
+    return failures_;
+  }
+
+ private:
+  FanOut(const FanOut&) = delete;
+  FanOut& operator=(const FanOut&) = delete;
+
+  void Prepare(size_t size, const google::protobuf::Message& response_prototype) {
+    controllers_.reset(new ClientRPCController[size]);
+    replied_.assign(size, false);
+    responses_.clear();
+    for (size_t i = 0; i < size; ++i) {
+      responses_.emplace_back(response_prototype.New());
+      controllers_[i].deadline(deadline_ ? deadline_ : RPCDeadline::Current());
+      controllers_[i].priority(priority_);
+      controllers_[i].tenant(tenant_);
+    }
+    if (!size) {
+      Finish();
+    }
+  }
+
+  static void Done(std::shared_ptr<FanOut> self, size_t index) {
+    {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      if (self->finished_) {
+        return;
+      }
+      self->replied_[index] = true;
+      if (self->controllers_[index].Failed()) {
+        ++self->failures_;
+      } else {
+        ++self->successes_;
+      }
+      if (self->on_response_) {
+        self->on_response_(index, self->controllers_[index], *self->responses_[index]);
+      }
+      if (!self->Complete()) {
+        return;
+      }
+    }
+    self->Finish();
+  }
+
+  // with the lock held
+  bool Complete() const {
+    size_t size = responses_.size();
+    switch (completion_) {
+    case kQuorum:
+      // a quorum out of reach completes too
+      return successes_ >= quorum_ || successes_ + failures_ == size ||
+          size - failures_ < quorum_;
+    case kFirstSuccess:
+      return successes_ || failures_ == size;
+    default:
+      return successes_ + failures_ == size;
+    }
+  }
+
+  void Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) {
+        return;
+      }
+      finished_ = true;
+    }
+    for (size_t i = 0; i < responses_.size(); ++i) {
+      if (!replied_[i]) {
+        controllers_[i].StartCancel();
+      }
+    }
+    if (on_done_) {
+      on_done_(*this);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    done_condition_.notify_all();
+  }
+
+  Completion completion_ { kAll };
+  size_t quorum_ { 0 };
+  int64_t deadline_ { 0 };
+  RPCPriority priority_ { kRPCPriorityDefault };
+  uint32_t tenant_ { 0 };
+  ResponseCallback on_response_;
+  DoneCallback on_done_;
+  std::unique_ptr<ClientRPCController[]> controllers_;
+  std::vector<MessagePtr> responses_;
+  std::vector<bool> replied_;
+  size_t successes_ { 0 }, failures_ { 0 };
+  std::mutex mutex_;
+  std::condition_variable done_condition_;
+  bool finished_ { false };
+  bool done_ { false };
+};
+
+}
@@ -6,70 +6,104 @@
 
 #pragma once
 
+#include <memory>
+#include <type_traits>
+
+#include <google/protobuf/message.h>
 #include <google/protobuf/service.h>
 
-#include <asio_pbrpc/net_trans/tcp_connection.h>
-#include <asio_pbrpc/net_trans/executor.h>
-#include "rpc_buffer.h"
+#include "async_rpc_client.h"
+#include "client_rpc_controller.h"
+#include "rpc_future.h"
 
 namespace asio_pbrpc {
 
-class FutureRPCClient : public TCPConnection<RPCBuffer>,
-                  public google::protobuf::RpcChannel {
+// Every call returns its own RPCFuture, calls are pipelined on the connection.
+// Chain dependent calls with then and wait for many with WhenAll or WhenAny,
+// Wait still blocks until no call is pending.
+class FutureRPCClient : public AsyncRPCClient {
  public:
-  using TCPConnection<RPCBuffer>::TCPConnection;
-
-  FutureRPCClient(boost::asio::io_service& io_service, Executor& executor) :
-    TCPConnection(io_service), executor_(executor) {}
+  using AsyncRPCClient::AsyncRPCClient;
 
   virtual ~FutureRPCClient() {}
 
-  void CallMethod(const google::protobuf::MethodDescriptor* method,
-      google::protobuf::RpcController* controller,
-      const google::protobuf::Message* request,
-      google::protobuf::Message* response,
-      google::protobuf::Closure* done) override {
-    size_t method_id = std::hash<std::string>()(method->full_name());
-    BufferPtr output_buffer(std::make_shared<RPCBuffer>());
-    output_buffer->Serialize(method_id, *request);
-    if (!SyncSend(output_buffer)) {
-      if (controller) {
-        controller->SetFailed("send failed");
-      }
-      return;
-    }
-    response_ = response;
-    controller_ = controller;
-    Receive();
+  // the request is serialized before returning,
+  // deadline, priority and tenant are taken from the options if given.
+  // a generated response type may be named, a plain message is made from the method otherwise
+  template <class Response = google::protobuf::Message>
+  RPCFuture<Response> Call(const google::protobuf::MethodDescriptor* method,
+      const google::protobuf::Message& request, const ClientRPCController* options = nullptr) {
+    return Start(RPCMethodId(method->full_name()), request, NewResponse<Response>(method),
+        options);
   }
 
-  void Wait() {
-    while (true) {
-      if (!WaitForReceive()) {
-        if (controller_) {
-          controller_->SetFailed("receive failed");
-        }
-        return;
-      }
-      size_t method_id;
-      boost::tribool ret = input_buffer()->Parse(method_id, *response_);
-      if (!ret) {
-        if (controller_) {
-          controller_->SetFailed("parse failed");
-        }
-        return;
-      } else if (ret) {
-        break;
+  // by a method id known ahead, as generated stubs call,
+  // neither the method's name nor its descriptor is touched per call
+  template <class Response>
+  RPCFuture<Response> Call(uint64_t method_id, const google::protobuf::Message& request,
+      const ClientRPCController* options = nullptr) {
+    return Start(method_id, request, std::make_shared<Response>(), options);
+  }
+
+ private:
+  // the closure run when the call completes, it keeps itself alive until then
+  template <class Response>
+  class FutureCall : public google::protobuf::Closure {
+   public:
+    void Run() override {
+      std::shared_ptr<FutureCall> self(std::move(self_));
+      if (controller.Failed()) {
+        promise.SetFailed(controller.ErrorText());
+      } else {
+        promise.SetValue(std::move(response));
       }
-      break; // ?
     }
+
+    ClientRPCController controller;
+    std::shared_ptr<Response> response;
+    RPCPromise<Response> promise;
+
+   private:
+    friend class FutureRPCClient;
+    std::shared_ptr<FutureCall> self_;
+  };
+
+  template <class Response>
+  RPCFuture<Response> Start(uint64_t method_id, const google::protobuf::Message& request,
+      std::shared_ptr<Response> response, const ClientRPCController* options) {
+    std::shared_ptr<FutureCall<Response>> call(std::make_shared<FutureCall<Response>>());
+    call->response = std::move(response);
+    if (options) {
+      call->controller.deadline(options->deadline());
+      call->controller.priority(options->priority());
+      call->controller.tenant(options->tenant());
+    }
+    std::weak_ptr<FutureCall<Response>> weak_call(call);
+    call->promise.canceller([weak_call] {
+      if (std::shared_ptr<FutureCall<Response>> call = weak_call.lock()) {
+        call->controller.StartCancel();
+      }
+    });
+    RPCFuture<Response> future(call->promise.future());
+    Response* raw_response = call->response.get();
+    call->self_ = call;
+    CallMethod(method_id, &call->controller, &request, raw_response, call.get());
+    return future;
   }
 
- private:
-  Executor& executor_;
-  google::protobuf::Closure* done_ { nullptr };
-  google::protobuf::Message* response_ { nullptr };
-  google::protobuf::RpcController* controller_ { nullptr };
+  template <class Response>
+  static typename std::enable_if<!std::is_same<Response, google::protobuf::Message>::value,
+      std::shared_ptr<Response>>::type
+  NewResponse(const google::protobuf::MethodDescriptor*) {
+    return std::make_shared<Response>();
+  }
+  template <class Response>
+  static typename std::enable_if<std::is_same<Response, google::protobuf::Message>::value,
+      std::shared_ptr<Response>>::type
+  NewResponse(const google::protobuf::MethodDescriptor* method) {
+    return std::shared_ptr<Response>(google::protobuf::MessageFactory::generated_factory()->
+        GetPrototype(method->output_type())->New());
+  }
 };
 
 }
@@ -0,0 +1,667 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+
+#include <asio_pbrpc/net_trans/chrono_timer.h>
+#include <asio_pbrpc/net_trans/executor.h>
+#include "async_rpc_client.h"
+#include "client_rpc_controller.h"
+
+namespace asio_pbrpc {
+
+// RpcChannel over several server endpoints with a few warm connections each.
+// A call goes to the better of two random healthy endpoints,
+// by least outstanding requests or by peak EWMA latency times outstanding requests.
+// Endpoints with all connections broken or too many calls in a row failing to reach them
+// leave the rotation, they are probed periodically and come back with a weight ramping up
+// over the slow start window.
+// Calls of idempotent methods can be hedged: a call not answered after a delay is sent
+// to a second endpoint too, the first reply wins and the other attempt is cancelled.
+// The channel must outlive the calls it sends.
+class PooledRPCChannel : public google::protobuf::RpcChannel {
+ public:
+  enum Balancer {
+    kLeastOutstanding,
+    kPeakEwma,
+  };
+
+  PooledRPCChannel(boost::asio::io_service& io_service, Executor& executor,
+      size_t connections_per_endpoint = 2, Balancer balancer = kLeastOutstanding) :
+    io_service_(io_service), executor_(executor),
+    connections_per_endpoint_(std::max<size_t>(connections_per_endpoint, 1)),
+    balancer_(balancer), probe_timer_(io_service),
+    probe_state_(std::make_shared<ProbeState>()) {
+    probe_state_->channel = this;
+  }
+
+  virtual ~PooledRPCChannel() {
+    Stop();
+    // a probe running now finishes first, later ones find no channel
+    std::lock_guard<std::mutex> lock(probe_state_->mutex);
+    probe_state_->channel = nullptr;
+  }
+
+  // connects synchronously, returns false if no connection could be established,
+  // the endpoint is kept and probed anyway
+  bool AddEndpoint(const std::string& host, int port) {
+    return AddEndpoint(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(host), port));
+  }
+  // a TCP or a Unix domain endpoint
+  bool AddEndpoint(const AsyncRPCClient::Endpoint& remote) {
+    std::shared_ptr<Endpoint> endpoint(std::make_shared<Endpoint>());
+    endpoint->remote = remote;
+    for (size_t i = 0; i < connections_per_endpoint_; ++i) {
+      std::shared_ptr<AsyncRPCClient> connection(NewConnection());
+      connection->SyncConnect(endpoint->remote);
+      endpoint->connections.emplace_back(connection);
+    }
+    endpoint->slow_start_time = Clock::now();
+    bool healthy = endpoint->healthy();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      endpoints_.emplace_back(endpoint);
+    }
+    StartProbe();
+    return healthy;
+  }
+
+  void RemoveEndpoint(const std::string& host, int port) {
+    RemoveEndpoint(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(host), port));
+  }
+  void RemoveEndpoint(const AsyncRPCClient::Endpoint& remote) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    endpoints_.erase(std::remove_if(endpoints_.begin(), endpoints_.end(),
+        [&remote](const std::shared_ptr<Endpoint>& endpoint) {
+      return endpoint->remote == remote;
+    }), endpoints_.end());
+  }
+
+  void Stop() {
+    probing_.store(false, std::memory_order_release);
+    boost::system::error_code ec;
+    probe_timer_.cancel(ec);
+  }
+
+  void CallMethod(const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller,
+      const google::protobuf::Message* request,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) override {
+    std::chrono::microseconds hedge_delay;
+    if (HedgeDelay(method, hedge_delay)) {
+      std::make_shared<HedgedCall>(this, method, controller, request, response, done)->
+          Start(hedge_delay);
+      return;
+    }
+    if (!Send(nullptr, method, controller, request, response, done)) {
+      if (controller) {
+        controller->SetFailed("no available endpoint");
+      }
+      if (done) {
+        done->Run();
+      }
+    }
+  }
+
+  // marks a method idempotent, its calls get a second attempt on another endpoint
+  // when not answered after the delay, or after the p95 latency observed so far if zero
+  void hedge(const google::protobuf::MethodDescriptor* method,
+      const std::chrono::microseconds& delay = std::chrono::microseconds::zero()) {
+    std::lock_guard<std::mutex> lock(hedge_mutex_);
+    hedge_policies_[method].delay = delay;
+  }
+
+  // second attempts are limited to this fraction of the hedged methods' calls
+  void hedge_budget(double hedge_budget) {
+    std::lock_guard<std::mutex> lock(hedge_mutex_);
+    hedge_budget_ = std::max(hedge_budget, 0.0);
+  }
+
+  // second attempts sent, and how many of them answered first
+  size_t hedges() const {
+    return hedges_.load(std::memory_order_relaxed);
+  }
+  size_t hedge_wins() const {
+    return hedge_wins_.load(std::memory_order_relaxed);
+  }
+  double hedge_rate() const {
+    size_t calls = hedged_calls_.load(std::memory_order_relaxed);
+    return calls ? static_cast<double>(hedges()) / calls : 0;
+  }
+  double hedge_win_rate() const {
+    size_t hedges = this->hedges();
+    return hedges ? static_cast<double>(hedge_wins()) / hedges : 0;
+  }
+
+  // consecutive calls failing to reach an endpoint that take it out of the rotation,
+  // replies with a failure status do not count
+  void failure_threshold(size_t failure_threshold) {
+    failure_threshold_ = std::max<size_t>(failure_threshold, 1);
+  }
+  void probe_interval(const std::chrono::milliseconds& probe_interval) {
+    probe_interval_ = probe_interval;
+  }
+  void slow_start(const std::chrono::milliseconds& slow_start) {
+    slow_start_ = slow_start;
+  }
+
+  size_t healthy_endpoints() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::count_if(endpoints_.begin(), endpoints_.end(),
+        [](const std::shared_ptr<Endpoint>& endpoint) { return endpoint->healthy(); });
+  }
+  size_t outstanding() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t total = 0;
+    for (auto& endpoint : endpoints_) {
+      total += endpoint->outstanding.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+ private:
+  PooledRPCChannel(const PooledRPCChannel&) = delete;
+  PooledRPCChannel& operator=(const PooledRPCChannel&) = delete;
+
+  typedef std::chrono::steady_clock Clock;
+
+  // burst of second attempts allowed after a quiet period
+  static constexpr double kMaxHedgeTokens = 10;
+
+  struct Endpoint {
+    AsyncRPCClient::Endpoint remote;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<AsyncRPCClient>> connections;
+    std::atomic_size_t outstanding { 0 };
+    std::atomic_size_t failures { 0 };
+    // microseconds
+    std::atomic<double> latency { 0 };
+    Clock::time_point slow_start_time;
+
+    bool healthy() {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto& connection : connections) {
+        if (connection->connected()) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::shared_ptr<AsyncRPCClient> Pick() {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::shared_ptr<AsyncRPCClient> picked;
+      size_t picked_outstanding = 0;
+      for (auto& connection : connections) {
+        if (!connection->connected()) {
+          continue;
+        }
+        size_t outstanding = connection->outstanding();
+        if (!picked || outstanding < picked_outstanding) {
+          picked = connection;
+          picked_outstanding = outstanding;
+        }
+      }
+      return picked;
+    }
+
+    void Close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto& connection : connections) {
+        connection->Close();
+      }
+    }
+  };
+
+  // completes the caller's closure and feeds latency and failures back to the endpoint
+  class PooledCall : public google::protobuf::Closure {
+   public:
+    PooledCall(std::shared_ptr<Endpoint> endpoint, google::protobuf::RpcController* controller,
+        google::protobuf::Closure* done, size_t failure_threshold) :
+      endpoint_(endpoint), controller_(controller), done_(done),
+      failure_threshold_(failure_threshold), start_time_(Clock::now()) {
+      endpoint_->outstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    google::protobuf::RpcController* controller() {
+      return controller_ ? controller_ : &own_controller_;
+    }
+
+    void Run() override {
+      endpoint_->outstanding.fetch_sub(1, std::memory_order_relaxed);
+      ClientRPCController* client_controller = dynamic_cast<ClientRPCController*>(controller());
+      if (client_controller && client_controller->cancel_started()) {
+        // abandoned by the caller, says nothing about the endpoint
+      } else if (controller()->Failed()) {
+        // a reply with a failure status, or a deadline running out, says the endpoint
+        // still answers, only failing to reach it counts
+        if (client_controller && client_controller->transport_failed() &&
+            endpoint_->failures.fetch_add(1, std::memory_order_relaxed) + 1 >= failure_threshold_) {
+          endpoint_->Close();
+        }
+      } else {
+        endpoint_->failures.store(0, std::memory_order_relaxed);
+        double latency = std::chrono::duration<double, std::micro>(Clock::now() - start_time_).count();
+        double current = endpoint_->latency.load(std::memory_order_relaxed);
+        // peak sensitive, jumps up at once and decays slowly
+        endpoint_->latency.store(latency > current ? latency : current * 0.9 + latency * 0.1,
+            std::memory_order_relaxed);
+      }
+      google::protobuf::Closure* done = done_;
+      delete this;
+      if (done) {
+        done->Run();
+      }
+    }
+
+   private:
+    std::shared_ptr<Endpoint> endpoint_;
+    google::protobuf::RpcController* controller_;
+    ClientRPCController own_controller_;
+    google::protobuf::Closure* done_;
+    size_t failure_threshold_;
+    Clock::time_point start_time_;
+  };
+
+  // latency histogram with buckets a quarter octave wide, older samples fade out
+  class LatencyHistogram {
+   public:
+    void Add(const std::chrono::microseconds& latency) {
+      double us = std::max<double>(latency.count(), 1);
+      size_t bucket = std::min<size_t>(std::log2(us) * 4, kBuckets - 1);
+      ++buckets_[bucket];
+      if (++samples_ >= kDecaySamples) {
+        samples_ = 0;
+        for (auto& count : buckets_) {
+          count /= 2;
+        }
+      }
+    }
+
+    // zero until there are enough samples
+    std::chrono::microseconds Percentile(double percentile) const {
+      size_t total = 0;
+      for (auto count : buckets_) {
+        total += count;
+      }
+      if (total < kMinSamples) {
+        return std::chrono::microseconds::zero();
+      }
+      size_t rank = static_cast<size_t>(std::ceil(total * percentile)), seen = 0;
+      for (size_t i = 0; i < kBuckets; ++i) {
+        if ((seen += buckets_[i]) >= rank) {
+          // upper bound of the bucket
+          return std::chrono::microseconds(static_cast<int64_t>(std::exp2((i + 1) / 4.0)));
+        }
+      }
+      return std::chrono::microseconds::zero();
+    }
+
+   private:
+    static const size_t kBuckets = 128;
+    static const size_t kMinSamples = 20;
+    static const size_t kDecaySamples = 1024;
+
+    size_t buckets_[kBuckets] {};
+    size_t samples_ { 0 };
+  };
+
+  struct HedgePolicy {
+    std::chrono::microseconds delay { 0 };
+    LatencyHistogram latency;
+  };
+
+  // one call of a hedged method, up to two attempts on different endpoints,
+  // each with its own response so the loser can never touch the caller's,
+  // the caller cancelling cancels every attempt
+  class HedgedCall : public RPCCancellable, public std::enable_shared_from_this<HedgedCall> {
+   public:
+    HedgedCall(PooledRPCChannel* channel, const google::protobuf::MethodDescriptor* method,
+        google::protobuf::RpcController* controller, const google::protobuf::Message* request,
+        google::protobuf::Message* response, google::protobuf::Closure* done) :
+      channel_(channel), method_(method), controller_(controller),
+      // the caller may free its request once the first reply is in
+      request_(request->New()), response_(response), done_(done), timer_(channel->io_service_) {
+      request_->CopyFrom(*request);
+      const RPCAttachments* attachments = RPCControllerAttachments(controller);
+      for (auto& attempt : attempts_) {
+        attempt.response.reset(response->New());
+        attempt.controller.deadline(RPCControllerDeadline(controller));
+        attempt.controller.priority(RPCControllerPriority(controller));
+        attempt.controller.tenant(RPCControllerTenant(controller));
+        // shared by both attempts, not copied
+        if (attachments) {
+          for (auto& attachment : *attachments) {
+            attempt.controller.AddRequestAttachment(attachment.data, attachment.size,
+                attachment.owner);
+          }
+        }
+      }
+    }
+
+    void Start(const std::chrono::microseconds& delay) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        outstanding_ = 1;
+      }
+      if (ClientRPCController* client_controller =
+          dynamic_cast<ClientRPCController*>(controller_)) {
+        client_controller->cancellable(shared_from_this(), 0);
+        // cancelled before it was sent, the attempt goes out cancelled
+        if (client_controller->cancel_started()) {
+          Cancel(0);
+        }
+      }
+      if (!Send(0, nullptr)) {
+        attempts_[0].controller.SetFailed("no available endpoint");
+        Done(shared_from_this(), 0);
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      // zero until the method's latency is known
+      if (finished_ || !delay.count()) {
+        return;
+      }
+      auto self(shared_from_this());
+      timer_.expires_from_now(std::chrono::duration_cast<SteadyTimer::duration_type>(delay));
+      timer_.async_wait([self](const boost::system::error_code& ec) {
+        if (ec != boost::asio::error::operation_aborted) {
+          self->Hedge();
+        }
+      });
+    }
+
+    void Cancel(uint64_t) override {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished_) {
+          return;
+        }
+        cancelled_ = true;
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+      }
+      // an attempt not sent yet is cancelled as it goes out
+      for (auto& attempt : attempts_) {
+        attempt.controller.StartCancel();
+      }
+    }
+
+   private:
+    struct Attempt {
+      MessagePtr response;
+      ClientRPCController controller;
+      std::shared_ptr<Endpoint> endpoint;
+      Clock::time_point start_time;
+    };
+
+    bool Send(size_t index, std::shared_ptr<Endpoint> exclude) {
+      Attempt& attempt = attempts_[index];
+      attempt.start_time = Clock::now();
+      return channel_->Send(exclude, method_, &attempt.controller, request_.get(),
+          attempt.response.get(), google::protobuf::NewCallback(&HedgedCall::Done,
+          shared_from_this(), index), &attempt.endpoint);
+    }
+
+    void Hedge() {
+      std::shared_ptr<Endpoint> exclude;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished_ || cancelled_ || !channel_->TakeHedgeToken()) {
+          return;
+        }
+        ++outstanding_;
+        exclude = attempts_[0].endpoint;
+      }
+      if (!Send(1, exclude)) {
+        // no other endpoint, the first attempt decides
+        attempts_[1].controller.SetFailed("no available endpoint");
+        Done(shared_from_this(), 1);
+        return;
+      }
+      channel_->hedges_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void Done(std::shared_ptr<HedgedCall> self, size_t index) {
+      Attempt& attempt = self->attempts_[index];
+      bool failed = attempt.controller.Failed();
+      bool cancel_other;
+      {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        --self->outstanding_;
+        // a failed attempt waits for the other one
+        if (self->finished_ || (failed && self->outstanding_)) {
+          return;
+        }
+        self->finished_ = true;
+        cancel_other = self->outstanding_ > 0;
+        boost::system::error_code ec;
+        self->timer_.cancel(ec);
+      }
+      if (cancel_other) {
+        self->attempts_[1 - index].controller.StartCancel();
+      }
+      if (failed) {
+        if (self->controller_) {
+          self->controller_->SetFailed(attempt.controller.ErrorText());
+        }
+      } else {
+        self->channel_->RecordLatency(self->method_,
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - attempt.start_time));
+        if (index) {
+          self->channel_->hedge_wins_.fetch_add(1, std::memory_order_relaxed);
+        }
+        self->response_->GetReflection()->Swap(self->response_, attempt.response.get());
+        if (ClientRPCController* client_controller =
+            dynamic_cast<ClientRPCController*>(self->controller_)) {
+          client_controller->response_attachments(attempt.controller.response_attachments());
+        }
+      }
+      if (self->done_) {
+        self->done_->Run();
+      }
+    }
+
+    PooledRPCChannel* channel_;
+    const google::protobuf::MethodDescriptor* method_;
+    google::protobuf::RpcController* controller_;
+    MessagePtr request_;
+    google::protobuf::Message* response_;
+    google::protobuf::Closure* done_;
+    SteadyTimer timer_;
+    Attempt attempts_[2];
+    std::mutex mutex_;
+    size_t outstanding_ { 0 };
+    bool finished_ { false };
+    bool cancelled_ { false };
+  };
+
+  // false if no endpoint is available, done is not run then
+  bool Send(std::shared_ptr<Endpoint> exclude, const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller, const google::protobuf::Message* request,
+      google::protobuf::Message* response, google::protobuf::Closure* done,
+      std::shared_ptr<Endpoint>* picked = nullptr) {
+    std::shared_ptr<Endpoint> endpoint(Pick(exclude));
+    std::shared_ptr<AsyncRPCClient> connection(endpoint ? endpoint->Pick() : nullptr);
+    if (!connection) {
+      delete done;
+      return false;
+    }
+    if (picked) {
+      *picked = endpoint;
+    }
+    PooledCall* call = new PooledCall(endpoint, controller, done, failure_threshold_);
+    connection->CallMethod(method, call->controller(), request, response, call);
+    return true;
+  }
+
+  bool HedgeDelay(const google::protobuf::MethodDescriptor* method,
+      std::chrono::microseconds& delay) {
+    std::lock_guard<std::mutex> lock(hedge_mutex_);
+    auto ite = hedge_policies_.find(method);
+    if (ite == hedge_policies_.end()) {
+      return false;
+    }
+    hedged_calls_.fetch_add(1, std::memory_order_relaxed);
+    hedge_tokens_ += hedge_budget_;
+    if (hedge_tokens_ > kMaxHedgeTokens) {
+      hedge_tokens_ = kMaxHedgeTokens;
+    }
+    delay = ite->second.delay.count() ? ite->second.delay : ite->second.latency.Percentile(0.95);
+    return true;
+  }
+
+  // called with a hedged call's own lock held, never the other way round
+  bool TakeHedgeToken() {
+    std::lock_guard<std::mutex> lock(hedge_mutex_);
+    if (hedge_tokens_ < 1) {
+      return false;
+    }
+    hedge_tokens_ -= 1;
+    return true;
+  }
+
+  void RecordLatency(const google::protobuf::MethodDescriptor* method,
+      const std::chrono::microseconds& latency) {
+    std::lock_guard<std::mutex> lock(hedge_mutex_);
+    auto ite = hedge_policies_.find(method);
+    if (ite != hedge_policies_.end()) {
+      ite->second.latency.Add(latency);
+    }
+  }
+
+  std::shared_ptr<AsyncRPCClient> NewConnection() {
+    return std::make_shared<AsyncRPCClient>(io_service_, executor_);
+  }
+
+  // weight ramps from 0.1 to 1 over the slow start window
+  double Score(Endpoint& endpoint) {
+    double weight = 1;
+    auto elapsed = Clock::now() - endpoint.slow_start_time;
+    if (elapsed < slow_start_) {
+      weight = std::max(0.1, std::chrono::duration<double>(elapsed).count() /
+          std::chrono::duration<double>(slow_start_).count());
+    }
+    double load = endpoint.outstanding.load(std::memory_order_relaxed) + 1;
+    if (balancer_ == kPeakEwma) {
+      load *= std::max(endpoint.latency.load(std::memory_order_relaxed), 1.0);
+    }
+    return load / weight;
+  }
+
+  // power of two choices, among the endpoints other than exclude
+  std::shared_ptr<Endpoint> Pick(const std::shared_ptr<Endpoint>& exclude) {
+    static thread_local std::minstd_rand random(std::random_device{}());
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<Endpoint>*> healthy;
+    healthy.reserve(endpoints_.size());
+    for (auto& endpoint : endpoints_) {
+      if (endpoint != exclude && endpoint->healthy() &&
+          endpoint->failures.load(std::memory_order_relaxed) < failure_threshold_) {
+        healthy.emplace_back(&endpoint);
+      }
+    }
+    if (healthy.empty()) {
+      return nullptr;
+    } else if (healthy.size() == 1) {
+      return *healthy.front();
+    }
+    size_t first = random() % healthy.size();
+    size_t second = (first + 1 + random() % (healthy.size() - 1)) % healthy.size();
+    return Score(**healthy[first]) <= Score(**healthy[second]) ? *healthy[first] : *healthy[second];
+  }
+
+  void StartProbe() {
+    if (probing_.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    Probe();
+  }
+
+  // the probe timer's handler reaches the channel through it, none once destroyed
+  struct ProbeState {
+    std::mutex mutex;
+    PooledRPCChannel* channel { nullptr };
+  };
+
+  // reconnects broken connections, leaving those still connecting,
+  // a recovered endpoint starts slow
+  void Probe() {
+    if (!probing_.load(std::memory_order_acquire)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& endpoint : endpoints_) {
+        bool healthy = endpoint->healthy() &&
+            endpoint->failures.load(std::memory_order_relaxed) < failure_threshold_;
+        std::lock_guard<std::mutex> endpoint_lock(endpoint->mutex);
+        for (auto& connection : endpoint->connections) {
+          if (!connection->connected() && !connection->connecting()) {
+            connection = NewConnection();
+            connection->AsyncConnect(endpoint->remote);
+          }
+        }
+        if (!healthy) {
+          endpoint->failures.store(0, std::memory_order_relaxed);
+          endpoint->slow_start_time = Clock::now();
+        }
+      }
+    }
+    probe_timer_.expires_from_now(probe_interval_);
+    std::shared_ptr<ProbeState> state(probe_state_);
+    probe_timer_.async_wait([state](const boost::system::error_code& ec) {
+      if (ec == boost::asio::error::operation_aborted) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->channel) {
+        state->channel->Probe();
+      }
+    });
+  }
+
+  boost::asio::io_service& io_service_;
+  Executor& executor_;
+  const size_t connections_per_endpoint_;
+  const Balancer balancer_;
+  size_t failure_threshold_ { 5 };
+  std::chrono::milliseconds probe_interval_ { 1000 };
+  std::chrono::milliseconds slow_start_ { 10000 };
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Endpoint>> endpoints_;
+  SteadyTimer probe_timer_;
+  std::shared_ptr<ProbeState> probe_state_;
+  std::atomic_bool probing_ { false };
+  std::mutex hedge_mutex_;
+  std::unordered_map<const google::protobuf::MethodDescriptor*, HedgePolicy> hedge_policies_;
+  double hedge_budget_ { 0.1 };
+  double hedge_tokens_ { 0 };
+  std::atomic_size_t hedged_calls_ { 0 };
+  std::atomic_size_t hedges_ { 0 };
+  std::atomic_size_t hedge_wins_ { 0 };
+};
+
+}
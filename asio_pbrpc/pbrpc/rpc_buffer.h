@@ -6,8 +6,12 @@
 
 #pragma once
 
+#include <cstdint>
+#include <limits>
 #include <string>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/logic/tribool.hpp>
 #include <google/protobuf/message.h>
@@ -22,25 +26,154 @@ class RPCBuffer;
 
 typedef std::shared_ptr<google::protobuf::Message> MessagePtr;
 typedef std::shared_ptr<RPCBuffer> RPCBufferPtr;
+// raw bytes sent after the protobuf message, written from where they are
+typedef BufferSlice RPCAttachment;
+typedef std::vector<RPCAttachment> RPCAttachments;
+
+// attachments this small are copied out of the input buffer on receipt,
+// larger ones are used in place and keep its storage alive
+static const size_t kRPCAttachmentCopyBytes = 16 << 10;
+
+// frames a peer may have in part at a time, and their bytes, before the connection closes
+static const size_t kRPCMaxPartialFrames = 64;
+static const size_t kRPCMaxPartialBytes = 64 << 20;
+// a frame length is believed only so far ahead of the bytes, the buffer grows with them
+static const size_t kRPCMaxReserveBytes = 16 << 20;
+
+enum RPCStatus : uint32_t {
+  kRPCOk = 0,
+  kRPCOverloaded,
+  kRPCDeadlineExceeded,
+  kRPCFailed,
+};
+
+// lower is more urgent, default lets the server pick the method's priority
+enum RPCPriority : uint8_t {
+  kRPCPriorityHigh = 0,
+  kRPCPriorityNormal,
+  kRPCPriorityLow,
+  kRPCPriorityCount,
+  kRPCPriorityDefault = 0xff,
+};
+
+enum RPCFlag : uint16_t {
+  // the client gave up on call id, no message follows
+  kRPCFlagCancel = 1 << 0,
+  // whole frames of several calls follow, call id is their count
+  kRPCFlagBatch = 1 << 1,
+  // a message of the stream whose id is the call id
+  kRPCFlagStream = 1 << 2,
+  // the sender's last frame on the stream, no message follows,
+  // with a non-ok status the stream broke both ways
+  kRPCFlagStreamEnd = 1 << 3,
+  // the receiver takes that many more message bytes of the stream, a uint64_t in place
+  // of the message. the client's first frame of a stream is one and carries the method id
+  kRPCFlagStreamCredit = 1 << 4,
+  // bytes of a frame sent in fragments, call id is the sender's id of the frame,
+  // the frame is whole once the fragment with the end flag too is in
+  kRPCFlagFragment = 1 << 5,
+  kRPCFlagFragmentEnd = 1 << 6,
+};
+
+// any frame of a stream
+static const uint16_t kRPCStreamFlags =
+    kRPCFlagStream | kRPCFlagStreamEnd | kRPCFlagStreamCredit;
+
+// FNV-1a of the method's full name, the same on every platform,
+// generated code computes it at compile time
+inline constexpr uint64_t RPCMethodId(const char* full_name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *full_name; ++full_name) {
+    hash = (hash ^ static_cast<uint8_t>(*full_name)) * 1099511628211ULL;
+  }
+  return hash;
+}
+inline uint64_t RPCMethodId(const std::string& full_name) {
+  return RPCMethodId(full_name.c_str());
+}
+
+// FNV-1a as well, for bytes hashed alike by every build and run, unlike std::hash
+inline uint64_t RPCHash(const std::string& bytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char byte : bytes) {
+    hash = (hash ^ static_cast<uint8_t>(byte)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline const char* RPCStatusText(uint32_t status) {
+  switch (status) {
+  case kRPCOk: return "ok";
+  case kRPCOverloaded: return "server overloaded";
+  case kRPCDeadlineExceeded: return "deadline exceeded";
+  case kRPCFailed: return "server handler failed";
+  default: return "unknown status";
+  }
+}
+
+// fixed size header following the message length,
+// a response with a non-ok status carries no protobuf message.
+// the sizes of the attachments follow as uint64_t, the attachments follow the message
+struct RPCHeader {
+  size_t method_id { 0 };
+  // echoed in the response, requests of a connection may be answered out of order
+  uint64_t call_id { 0 };
+  // microseconds since the system clock epoch, 0 for none
+  int64_t deadline { 0 };
+  uint32_t status { kRPCOk };
+  uint8_t priority { kRPCPriorityDefault };
+  // fills the padding before flags, the header goes on the wire byte for byte
+  uint8_t reserved { 0 };
+  uint16_t flags { 0 };
+  // requests of a tenant share the server fairly with other tenants, 0 for none
+  uint32_t tenant { 0 };
+  uint32_t attachments { 0 };
+};
 
 class RPCBuffer : public Buffer {
  public:
+  // the length is only consumed once the whole message is readable
   std::pair<boost::tribool, size_t> ParseMessageLength() {
     if (!readable<size_t>()) {
       return std::make_pair(boost::indeterminate, 0);
     }
-    size_t message_length = read<size_t>();
-    if (message_length < sizeof(size_t)) {
+    size_t message_length = peek<size_t>();
+    if (message_length < sizeof(RPCHeader) || message_length > max_message_length_) {
       return std::make_pair(false, 0);
     }
-    if (readable_bytes() < message_length) {
+    if (!readable(sizeof(size_t) + message_length)) {
+      reserve(std::min(sizeof(size_t) + message_length - readable_bytes(),
+          kRPCMaxReserveBytes));
       return std::make_pair(boost::indeterminate, 0);
     }
+    retrieve(sizeof(size_t));
     return std::make_pair(true, message_length);
   }
 
-  size_t ParseMethodId() {
-    return read<size_t>();
+  RPCHeader ParseHeader() {
+    return read<RPCHeader>();
+  }
+
+  // length is what follows the header and becomes the message length,
+  // false if the sizes do not fit in it
+  bool ParseAttachments(const RPCHeader& header, size_t& length, std::vector<size_t>& sizes,
+      size_t& attachment_bytes) {
+    sizes.clear();
+    attachment_bytes = 0;
+    if (header.attachments > length / sizeof(uint64_t)) {
+      return false;
+    }
+    length -= header.attachments * sizeof(uint64_t);
+    for (uint32_t i = 0; i < header.attachments; ++i) {
+      uint64_t size = read<uint64_t>();
+      if (size > length) {
+        return false;
+      }
+      length -= size;
+      attachment_bytes += size;
+      sizes.push_back(size);
+    }
+    return true;
   }
 
   bool ParseMessage(google::protobuf::Message& message, size_t pb_length) {
@@ -50,29 +183,218 @@ class RPCBuffer : public Buffer {
     return true;
   }
 
-  boost::tribool Parse(size_t& method_id, google::protobuf::Message& message) {
-    auto head = ParseMessageLength();
-    if (!head.first) {
-      std::cerr << "bad message!" << std::endl;
+  // A fragment at the front of the buffer, length bytes after its header.
+  // Once the last fragment of a frame is in, the whole frame is put back at the front
+  // to be parsed next, in the room its fragments were read from, so the bytes behind
+  // it are not copied. False if the fragments do not make a frame or the frames in part
+  // go over their limits
+  bool Reassemble(const RPCHeader& header, size_t length) {
+    auto ite = fragments_.find(header.call_id);
+    if (ite == fragments_.end()) {
+      if (fragments_.size() >= max_partial_frames_) {
+        std::cerr << "too many fragmented messages!" << std::endl;
+        return false;
+      }
+      ite = fragments_.emplace(header.call_id, Buffer()).first;
+    }
+    Buffer& frame = ite->second;
+    size_t frame_bytes = frame.readable_bytes() + length;
+    if (frame_bytes > sizeof(size_t) && frame_bytes - sizeof(size_t) > max_message_length_) {
+      std::cerr << "fragmented message too long!" << std::endl;
+      return false;
+    }
+    if (partial_bytes_ + length > max_partial_bytes_) {
+      std::cerr << "fragmented messages too long!" << std::endl;
+      return false;
+    }
+    frame.write(read(length), length);
+    partial_bytes_ += length;
+    if (!(header.flags & kRPCFlagFragmentEnd)) {
+      return true;
+    }
+    partial_bytes_ -= frame.readable_bytes();
+    if (!frame.readable<size_t>() ||
+        frame.peek<size_t>() != frame.readable_bytes() - sizeof(size_t)) {
+      std::cerr << "bad fragments!" << std::endl;
+      fragments_.erase(header.call_id);
+      return false;
+    }
+    prepend(frame.read_buffer(), frame.readable_bytes());
+    fragments_.erase(header.call_id);
+    return true;
+  }
+
+  // bytes of the frames whose other fragments are still to come
+  size_t partial_bytes() const {
+    return partial_bytes_;
+  }
+
+  // with attachment sizes, the attachments of an ok message are left unread for
+  // RPCTakeAttachments, otherwise they are skipped
+  boost::tribool Parse(RPCHeader& header, google::protobuf::Message& message,
+      std::vector<size_t>* attachment_sizes = nullptr) {
+    std::pair<boost::tribool, size_t> head;
+    while (true) {
+      head = ParseMessageLength();
+      if (!head.first) {
+        std::cerr << "bad message!" << std::endl;
+        return false;
+      } else if (boost::indeterminate(head.first)) {
+        return boost::indeterminate;
+      }
+      header = ParseHeader();
+      if (!(header.flags & kRPCFlagFragment)) {
+        break;
+      }
+      if (!Reassemble(header, head.second - sizeof(RPCHeader))) {
+        return false;
+      }
+    }
+    size_t pb_length = head.second - sizeof(RPCHeader);
+    std::vector<size_t> sizes;
+    size_t attachment_bytes;
+    if (!ParseAttachments(header, pb_length, sizes, attachment_bytes)) {
+      std::cerr << "bad attachments!" << std::endl;
       return false;
-    } else if (head.first == boost::indeterminate) {
-      return boost::indeterminate;
     }
-    method_id = ParseMethodId();
-    size_t pb_length = head.second - sizeof(size_t);
+    if (attachment_sizes) {
+      attachment_sizes->clear();
+    }
+    if (header.status != kRPCOk) {
+      retrieve(pb_length + attachment_bytes);
+      return true;
+    }
     if (!ParseMessage(message, pb_length)) {
       std::cerr << "parse protobuf failed: " << typeid(message).name() << std::endl;
       return false;
     }
+    if (attachment_sizes) {
+      attachment_sizes->swap(sizes);
+    } else {
+      retrieve(attachment_bytes);
+    }
     return true;
   }
 
+  // the message is serialized in place, behind the header,
+  // the attachments are sent after the buffer
+  void Serialize(const RPCHeader& header, const google::protobuf::Message& message,
+      const RPCAttachments& attachments = RPCAttachments()) {
+    size_t pb_length = message.ByteSizeLong();
+    SerializeHead(header, pb_length, attachments);
+    reserve(pb_length);
+    message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(write_buffer()));
+    consume(pb_length);
+  }
   void Serialize(size_t method_id, const google::protobuf::Message& message) {
-    std::string pb(message.SerializeAsString());
-    write<size_t>(sizeof(size_t) + pb.length());
-    write<size_t>(method_id);
-    write(pb.c_str(), pb.length());
+    RPCHeader header;
+    header.method_id = method_id;
+    Serialize(header, message);
+  }
+
+  // length and header of a frame whose message bytes are sent separately,
+  // the attachment count of the header is set from the attachments
+  void SerializeHead(const RPCHeader& header, size_t pb_length,
+      const RPCAttachments& attachments = RPCAttachments()) {
+    size_t length = sizeof(RPCHeader) + attachments.size() * sizeof(uint64_t) + pb_length;
+    for (auto& attachment : attachments) {
+      length += attachment.size;
+    }
+    RPCHeader attached(header);
+    attached.attachments = attachments.size();
+    write<size_t>(length);
+    write<RPCHeader>(attached);
+    for (auto& attachment : attachments) {
+      write<uint64_t>(attachment.size);
+    }
   }
+
+  // header only, for error responses and cancellations
+  void Serialize(const RPCHeader& header) {
+    SerializeHead(header, 0);
+  }
+
+  // the head of bytes of a frame sent in fragments, the bytes follow it
+  void SerializeFragment(uint64_t fragment_id, size_t bytes, bool last) {
+    RPCHeader header;
+    header.call_id = fragment_id;
+    header.flags = kRPCFlagFragment;
+    if (last) {
+      header.flags |= kRPCFlagFragmentEnd;
+    }
+    SerializeHead(header, bytes);
+  }
+
+  // a batch frame starts an empty buffer, frames are appended with Serialize
+  void BeginBatch() {
+    RPCHeader header;
+    header.flags = kRPCFlagBatch;
+    SerializeHead(header, 0);
+  }
+  void EndBatch(size_t frames) {
+    RPCHeader header(*reinterpret_cast<const RPCHeader*>(read_buffer() + sizeof(size_t)));
+    header.call_id = frames;
+    poke<size_t>(0, readable_bytes() - sizeof(size_t));
+    poke<RPCHeader>(sizeof(size_t), header);
+  }
+  // a batch of one is sent as a plain frame without the batch head
+  void UnwrapBatch() {
+    retrieve(sizeof(size_t) + sizeof(RPCHeader));
+  }
+
+  // larger frames fail to parse, no limit by default, the server sets its own
+  void max_message_length(size_t max_message_length) {
+    max_message_length_ = max_message_length;
+  }
+  size_t max_message_length() const {
+    return max_message_length_;
+  }
+
+  // the peer's frames in part are not charged to the memory budget, a reader parked
+  // on them could never read the rest, these limits bound them instead
+  void max_partial_frames(size_t max_partial_frames) {
+    max_partial_frames_ = max_partial_frames;
+  }
+  void max_partial_bytes(size_t max_partial_bytes) {
+    max_partial_bytes_ = max_partial_bytes;
+  }
+
+ private:
+  size_t max_message_length_ { std::numeric_limits<size_t>::max() };
+  // frames received in part by fragment id
+  std::unordered_map<uint64_t, Buffer> fragments_;
+  size_t partial_bytes_ { 0 };
+  size_t max_partial_frames_ { kRPCMaxPartialFrames };
+  size_t max_partial_bytes_ { kRPCMaxPartialBytes };
 };
 
+// the attachments at the front of the connection's input buffer, once their message is read
+template <class Connection>
+RPCAttachments RPCTakeAttachments(Connection& connection, const std::vector<size_t>& sizes) {
+  RPCAttachments attachments;
+  size_t attachment_bytes = 0;
+  for (size_t size : sizes) {
+    attachment_bytes += size;
+  }
+  std::shared_ptr<const void> owner;
+  const char* data;
+  if (attachment_bytes <= kRPCAttachmentCopyBytes) {
+    auto copy(std::make_shared<const std::string>(
+        connection.input_buffer()->read_buffer(), attachment_bytes));
+    connection.input_buffer()->retrieve(attachment_bytes);
+    data = copy->data();
+    owner = std::move(copy);
+  } else {
+    auto taken(connection.TakeInput(attachment_bytes));
+    data = taken->read_buffer();
+    owner = std::move(taken);
+  }
+  attachments.reserve(sizes.size());
+  for (size_t size : sizes) {
+    attachments.emplace_back(RPCAttachment { data, size, owner });
+    data += size;
+  }
+  return attachments;
+}
+
 }
@@ -0,0 +1,270 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+// coroutines need a C++20 compiler, the rest of the library does not
+#if defined(__cpp_impl_coroutine)
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#include <asio_pbrpc/net_trans/chrono_timer.h>
+#include "rpc_deadline.h"
+#include "rpc_future.h"
+
+namespace asio_pbrpc {
+
+// Coroutine frames by size class in thread local free lists,
+// a frame freed on another thread than it was made on joins that thread's list.
+class RPCFramePool {
+ public:
+  static void* Allocate(size_t size) {
+    size_t index = Index(size);
+    if (index >= kClasses) {
+      return ::operator new(size);
+    }
+    FreeList& list = lists()[index];
+    if (Node* node = list.head) {
+      list.head = node->next;
+      --list.size;
+      return node;
+    }
+    return ::operator new((index + 1) * kGranularity);
+  }
+
+  static void Deallocate(void* frame, size_t size) {
+    size_t index = Index(size);
+    if (index >= kClasses) {
+      ::operator delete(frame);
+      return;
+    }
+    FreeList& list = lists()[index];
+    if (list.size >= kMaxCached) {
+      ::operator delete(frame);
+      return;
+    }
+    Node* node = static_cast<Node*>(frame);
+    node->next = list.head;
+    list.head = node;
+    ++list.size;
+  }
+
+ private:
+  static constexpr size_t kGranularity = 64;
+  static constexpr size_t kClasses = 32;
+  // frames per size class and thread
+  static constexpr size_t kMaxCached = 256;
+
+  struct Node {
+    Node* next;
+  };
+
+  struct FreeList {
+    ~FreeList() {
+      while (Node* node = head) {
+        head = node->next;
+        ::operator delete(node);
+      }
+    }
+
+    Node* head { nullptr };
+    size_t size { 0 };
+  };
+
+  static size_t Index(size_t size) {
+    return size ? (size - 1) / kGranularity : 0;
+  }
+
+  static FreeList* lists() {
+    static thread_local FreeList lists[kClasses];
+    return lists;
+  }
+};
+
+// resumes a suspended coroutine under the deadline it was suspended with,
+// so calls made after a co_await still inherit the deadline of the request being served
+inline std::function<void()> RPCResumer(std::coroutine_handle<> handle) {
+  int64_t deadline = RPCDeadline::Current();
+  return [handle, deadline] {
+    RPCDeadline::Scope deadline_scope(deadline);
+    handle.resume();
+  };
+}
+
+// A coroutine returning RPCFuture<Value> starts at once and runs until its first co_await,
+// the future is ready with what it co_returns, or failed with what it throws.
+// A handler may start one and return, calling done from the coroutine when finished.
+template <class Value>
+class RPCCoroutinePromiseBase {
+ public:
+  RPCFuture<Value> get_return_object() {
+    return promise_.future();
+  }
+
+  std::suspend_never initial_suspend() noexcept {
+    return {};
+  }
+  // the frame is freed once the coroutine finishes
+  std::suspend_never final_suspend() noexcept {
+    return {};
+  }
+
+  void unhandled_exception() {
+    try {
+      throw;
+    } catch (const std::exception& e) {
+      promise_.SetFailed(e.what());
+    } catch (...) {
+      promise_.SetFailed("coroutine threw");
+    }
+  }
+
+  static void* operator new(size_t size) {
+    return RPCFramePool::Allocate(size);
+  }
+  static void operator delete(void* frame, size_t size) {
+    RPCFramePool::Deallocate(frame, size);
+  }
+
+ protected:
+  RPCPromise<Value> promise_;
+};
+
+template <class Value>
+class RPCCoroutinePromise : public RPCCoroutinePromiseBase<Value> {
+ public:
+  void return_value(Value value) {
+    this->promise_.SetValue(std::make_shared<Value>(std::move(value)));
+  }
+  void return_value(std::shared_ptr<Value> value) {
+    this->promise_.SetValue(std::move(value));
+  }
+};
+
+template <>
+class RPCCoroutinePromise<void> : public RPCCoroutinePromiseBase<void> {
+ public:
+  void return_void() {
+    promise_.SetValue();
+  }
+};
+
+// co_await on a future gives the future back once it is ready
+template <class Value>
+class RPCFutureAwaiter {
+ public:
+  RPCFutureAwaiter(RPCFuture<Value> future, boost::asio::io_service* io_service) :
+    future_(std::move(future)), io_service_(io_service) {}
+
+  bool await_ready() const {
+    return future_.ready();
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    // the coroutine may resume, finish and free this awaiter before OnReady returns
+    RPCFuture<Value> future(future_);
+    std::function<void()> resume(RPCResumer(handle));
+    boost::asio::io_service* io_service = io_service_;
+    if (!io_service) {
+      future.OnReady(std::move(resume));
+      return;
+    }
+    future.OnReady([io_service, resume] {
+      io_service->post(resume);
+    });
+  }
+
+  RPCFuture<Value> await_resume() const {
+    return future_;
+  }
+
+ private:
+  RPCFuture<Value> future_;
+  boost::asio::io_service* io_service_;
+};
+
+// resumes on the thread completing the future, an I/O thread of the client for a call
+template <class Value>
+RPCFutureAwaiter<Value> operator co_await(RPCFuture<Value> future) {
+  return RPCFutureAwaiter<Value>(std::move(future), nullptr);
+}
+
+// resumes on the event loop, a handler passes the loop of its connection
+template <class Value>
+RPCFutureAwaiter<Value> RPCAwait(RPCFuture<Value> future, boost::asio::io_service& io_service) {
+  return RPCFutureAwaiter<Value>(std::move(future), &io_service);
+}
+
+// co_await suspends for the duration, resuming on the event loop
+class RPCSleep {
+ public:
+  template <class Rep, class Period>
+  RPCSleep(boost::asio::io_service& io_service,
+      const std::chrono::duration<Rep, Period>& duration) :
+    timer_(std::make_shared<SteadyTimer>(io_service)),
+    duration_(std::chrono::duration_cast<SteadyTimer::duration_type>(duration)) {}
+
+  bool await_ready() const {
+    return duration_.count() <= 0;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    std::shared_ptr<SteadyTimer> timer(timer_);
+    std::function<void()> resume(RPCResumer(handle));
+    timer->expires_from_now(duration_);
+    timer->async_wait([timer, resume](const boost::system::error_code&) {
+      resume();
+    });
+  }
+
+  void await_resume() const {}
+
+ private:
+  std::shared_ptr<SteadyTimer> timer_;
+  SteadyTimer::duration_type duration_;
+};
+
+// co_await continues the coroutine on the event loop,
+// like a handler moving onto the loop of its connection
+class RPCResumeOn {
+ public:
+  explicit RPCResumeOn(boost::asio::io_service& io_service) : io_service_(io_service) {}
+
+  bool await_ready() const {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    io_service_.post(RPCResumer(handle));
+  }
+
+  void await_resume() const {}
+
+ private:
+  boost::asio::io_service& io_service_;
+};
+
+}
+
+namespace std {
+
+template <class Value, class... Args>
+struct coroutine_traits<asio_pbrpc::RPCFuture<Value>, Args...> {
+  typedef asio_pbrpc::RPCCoroutinePromise<Value> promise_type;
+};
+
+}
+
+#endif
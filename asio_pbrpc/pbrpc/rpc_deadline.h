@@ -0,0 +1,64 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace asio_pbrpc {
+
+// Absolute deadlines travel in the frame header as microseconds since the system clock epoch,
+// 0 means no deadline. Clocks of clients and servers are expected to be synchronized.
+class RPCDeadline {
+ public:
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  static int64_t After(const std::chrono::microseconds& timeout) {
+    return Now() + timeout.count();
+  }
+
+  static bool Expired(int64_t deadline) {
+    return deadline && deadline <= Now();
+  }
+
+  // 0 if no deadline, could be negative if already expired
+  static std::chrono::microseconds Remaining(int64_t deadline) {
+    return std::chrono::microseconds(deadline ? deadline - Now() : 0);
+  }
+
+  // deadline of the request served by the current thread, inherited by nested calls
+  static int64_t Current() {
+    return current();
+  }
+
+  class Scope {
+   public:
+    explicit Scope(int64_t deadline) : saved_(current()) {
+      current() = deadline;
+    }
+    ~Scope() {
+      current() = saved_;
+    }
+
+   private:
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    int64_t saved_;
+  };
+
+ private:
+  static int64_t& current() {
+    static thread_local int64_t deadline = 0;
+    return deadline;
+  }
+};
+
+}
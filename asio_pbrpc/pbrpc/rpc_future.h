@@ -0,0 +1,320 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <asio_pbrpc/net_trans/executor.h>
+
+namespace asio_pbrpc {
+
+template <class Value> class RPCFuture;
+template <class Value> class RPCPromise;
+
+// outcome shared by a promise and its futures, set once
+template <class Value>
+struct RPCFutureState {
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool ready { false };
+  bool failed { false };
+  std::string reason;
+  std::shared_ptr<Value> value;
+  std::vector<std::function<void()>> callbacks;
+  std::function<void()> cancel;
+
+  void Set(bool failed, std::string reason, std::shared_ptr<Value> value) {
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (ready) {
+        return;
+      }
+      this->failed = failed;
+      this->reason = std::move(reason);
+      this->value = std::move(value);
+      ready = true;
+      callbacks.swap(this->callbacks);
+      condition.notify_all();
+    }
+    for (auto& callback : callbacks) {
+      callback();
+    }
+  }
+
+  void OnReady(std::function<void()> callback) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!ready) {
+        callbacks.emplace_back(std::move(callback));
+        return;
+      }
+    }
+    callback();
+  }
+};
+
+// what a continuation returning Result makes of then
+template <class Result>
+struct RPCThen {
+  static_assert(std::is_void<Result>::value, "a continuation returns nothing or an RPCFuture");
+  typedef void Value;
+
+  // the promise, an RPCPromise<void>, is defined below
+  template <class F, class Future, class Promise>
+  static void Run(F& f, Future& future, Promise& promise) {
+    try {
+      f(future);
+    } catch (...) {
+      promise.SetFailed("continuation threw");
+      return;
+    }
+    promise.SetValue();
+  }
+};
+
+// a continuation starting another call, then follows that call
+template <class Next>
+struct RPCThen<RPCFuture<Next>> {
+  typedef Next Value;
+
+  // the promise, an RPCPromise<Next>, is defined below
+  template <class F, class Future, class Promise>
+  static void Run(F& f, Future& future, Promise& promise) {
+    try {
+      promise.Follow(f(future));
+    } catch (...) {
+      promise.SetFailed("continuation threw");
+    }
+  }
+};
+
+// Result of an asynchronous call, copies share it.
+// Continuations run once it is ready, on an executor or on the thread completing it,
+// so chains of dependent calls need no thread blocked on them.
+template <class Value>
+class RPCFuture {
+ public:
+  typedef typename std::add_lvalue_reference<const Value>::type ValueReference;
+
+  RPCFuture() = default;
+
+  bool valid() const {
+    return static_cast<bool>(state_);
+  }
+
+  bool ready() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->ready;
+  }
+
+  void Wait() const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->condition.wait(lock, [this] { return state_->ready; });
+  }
+  // false if not ready in time
+  template <class Rep, class Period>
+  bool WaitFor(const std::chrono::duration<Rep, Period>& timeout) const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    return state_->condition.wait_for(lock, timeout, [this] { return state_->ready; });
+  }
+
+  // only once ready
+  bool Failed() const {
+    return state_->failed;
+  }
+  const std::string& ErrorText() const {
+    return state_->reason;
+  }
+  ValueReference value() const {
+    return *state_->value;
+  }
+  std::shared_ptr<Value> value_ptr() const {
+    return state_->value;
+  }
+
+  // cancels the call behind the future, if it can be
+  void Cancel() const {
+    std::function<void()> cancel;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (state_->ready) {
+        return;
+      }
+      cancel = state_->cancel;
+    }
+    if (cancel) {
+      cancel();
+    }
+  }
+
+  // callback runs on the thread completing the future, or at once if it is ready
+  void OnReady(std::function<void()> callback) const {
+    state_->OnReady(std::move(callback));
+  }
+
+  // f(future) runs on the executor once ready, f returns nothing,
+  // or the future of another call which the returned future then follows
+  template <class F>
+  RPCFuture<typename RPCThen<typename std::result_of<F(RPCFuture&)>::type>::Value>
+  then(Executor& executor, F f) const {
+    typedef RPCThen<typename std::result_of<F(RPCFuture&)>::type> Then;
+    RPCPromise<typename Then::Value> promise;
+    RPCFuture self(*this);
+    state_->OnReady([&executor, self, f, promise]() mutable {
+      executor.Execute([self, f, promise]() mutable {
+        Then::Run(f, self, promise);
+      });
+    });
+    return promise.future();
+  }
+
+  // f runs on the thread completing the future, an I/O thread for calls, keep it short
+  template <class F>
+  RPCFuture<typename RPCThen<typename std::result_of<F(RPCFuture&)>::type>::Value>
+  then(F f) const {
+    typedef RPCThen<typename std::result_of<F(RPCFuture&)>::type> Then;
+    RPCPromise<typename Then::Value> promise;
+    RPCFuture self(*this);
+    state_->OnReady([self, f, promise]() mutable {
+      Then::Run(f, self, promise);
+    });
+    return promise.future();
+  }
+
+ private:
+  friend class RPCPromise<Value>;
+
+  explicit RPCFuture(std::shared_ptr<RPCFutureState<Value>> state) : state_(std::move(state)) {}
+
+  std::shared_ptr<RPCFutureState<Value>> state_;
+};
+
+template <class Value>
+class RPCPromise {
+ public:
+  RPCPromise() : state_(std::make_shared<RPCFutureState<Value>>()) {}
+
+  RPCFuture<Value> future() const {
+    return RPCFuture<Value>(state_);
+  }
+
+  // only the first outcome counts
+  void SetValue(std::shared_ptr<Value> value = nullptr) const {
+    state_->Set(false, std::string(), std::move(value));
+  }
+  void SetFailed(const std::string& reason) const {
+    state_->Set(true, reason, nullptr);
+  }
+
+  // ready with the outcome of another future
+  void Follow(const RPCFuture<Value>& future) const {
+    std::shared_ptr<RPCFutureState<Value>> state(state_);
+    std::shared_ptr<RPCFutureState<Value>> other(future.state_);
+    other->OnReady([state, other] {
+      state->Set(other->failed, other->reason, other->value);
+    });
+  }
+
+  // how Cancel on the futures abandons the work
+  void canceller(std::function<void()> cancel) const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->cancel = std::move(cancel);
+  }
+
+ private:
+  std::shared_ptr<RPCFutureState<Value>> state_;
+};
+
+// counts futures down to zero, keeping the first failure
+class RPCJoin {
+ public:
+  explicit RPCJoin(size_t count) : remaining_(count) {
+    if (!count) {
+      promise_.SetValue();
+    }
+  }
+
+  template <class Value>
+  static void Add(const std::shared_ptr<RPCJoin>& join, const RPCFuture<Value>& future) {
+    future.OnReady([join, future] {
+      join->Arrive(future.Failed(), future.ErrorText());
+    });
+  }
+
+  RPCFuture<void> future() const {
+    return promise_.future();
+  }
+
+ private:
+  void Arrive(bool failed, const std::string& reason) {
+    if (failed) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!failed_) {
+        failed_ = true;
+        reason_ = reason;
+      }
+    }
+    if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    if (failed_) {
+      promise_.SetFailed(reason_);
+    } else {
+      promise_.SetValue();
+    }
+  }
+
+  std::atomic_size_t remaining_;
+  std::mutex mutex_;
+  bool failed_ { false };
+  std::string reason_;
+  RPCPromise<void> promise_;
+};
+
+// ready once every future is, failed with the first failure if any failed
+template <class Value>
+RPCFuture<void> WhenAll(const std::vector<RPCFuture<Value>>& futures) {
+  std::shared_ptr<RPCJoin> join(std::make_shared<RPCJoin>(futures.size()));
+  for (auto& future : futures) {
+    RPCJoin::Add(join, future);
+  }
+  return join->future();
+}
+
+template <class... Values>
+RPCFuture<void> WhenAll(const RPCFuture<Values>&... futures) {
+  std::shared_ptr<RPCJoin> join(std::make_shared<RPCJoin>(sizeof...(futures)));
+  int expand[] = { 0, (RPCJoin::Add(join, futures), 0)... };
+  (void)expand;
+  return join->future();
+}
+
+// ready with the index of the first future ready, failed or not
+template <class Value>
+RPCFuture<size_t> WhenAny(const std::vector<RPCFuture<Value>>& futures) {
+  RPCPromise<size_t> promise;
+  if (futures.empty()) {
+    promise.SetFailed("no futures");
+  }
+  for (size_t i = 0; i < futures.size(); ++i) {
+    futures[i].OnReady([promise, i] {
+      promise.SetValue(std::make_shared<size_t>(i));
+    });
+  }
+  return promise.future();
+}
+
+}
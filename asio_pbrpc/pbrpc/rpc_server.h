@@ -6,22 +6,162 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include <asio_pbrpc/net_trans/request_scheduler.h>
 #include <asio_pbrpc/net_trans/tcp_connection.h>
 #include <asio_pbrpc/net_trans/tcp_server.h>
+#include "concurrency_limiter.h"
 #include "rpc_buffer.h"
+#include "rpc_deadline.h"
+#include "rpc_stream.h"
+#include "server_rpc_controller.h"
 
 namespace asio_pbrpc {
 
 class RPCServer;
 
-class RPCServerConnection : public TCPConnection<RPCBuffer> {
+// responses to the calls of a batch frame, sent in one frame once all are ready
+struct RPCResponseBatch {
+  std::mutex mutex;
+  RPCBufferPtr buffer;
+  // calls not answered yet
+  size_t pending;
+  size_t responses { 0 };
+  // in flight until the batch is queued, then charged as output
+  size_t charged { 0 };
+  uint8_t priority { kRPCPriorityLow };
+};
+
+class RPCServerConnection;
+struct RPCResultCache;
+
+// the handler run answering every identical request arriving until it is done
+struct RPCFlight {
+  struct Waiter {
+    std::shared_ptr<RPCServerConnection> connection;
+    RPCHeader header;
+    std::shared_ptr<RPCResponseBatch> batch;
+  };
+
+  std::shared_ptr<RPCResultCache> cache;
+  std::string key;
+  // requests coalesced into the running one, they share its outcome
+  std::vector<Waiter> waiters;
+};
+
+// serialized responses of one method by the request's serialized bytes
+struct RPCResultCache {
+  typedef std::shared_ptr<const std::string> Body;
+
+  struct Entry {
+    Body body;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expire_time;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::chrono::milliseconds ttl;
+  size_t capacity;
+  std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+  // most recently used first
+  std::list<std::string> lru;
+  size_t bytes { 0 };
+  std::unordered_map<std::string, std::shared_ptr<RPCFlight>> flights;
+  std::atomic_size_t hits { 0 };
+  std::atomic_size_t coalesced { 0 };
+  // handler runs
+  std::atomic_size_t misses { 0 };
+};
+
+struct RPCServerCall {
+  RPCHeader header;
+  MessagePtr request, response;
+  std::shared_ptr<ServerRPCController> controller;
+  std::shared_ptr<RPCResponseBatch> batch;
+  // set when the call answers identical requests too
+  std::shared_ptr<RPCFlight> flight;
+  std::chrono::steady_clock::time_point start_time;
+  std::ptrdiff_t in_flight_bytes;
+};
+
+// one request of a batch handed to a batch handler
+struct RPCBatchItem {
+  const google::protobuf::Message* request;
+  google::protobuf::Message* response;
+  // fails this request alone
+  ServerRPCController* controller;
+};
+
+// answers every item, then runs done once
+typedef std::function<void(std::vector<RPCBatchItem>&, google::protobuf::Closure*)>
+    RPCBatchHandler;
+
+struct RPCBatchEntry {
+  std::shared_ptr<RPCServerConnection> connection;
+  RPCServerCall call;
+};
+
+// requests of one method collected across connections for its batch handler
+struct RPCBatcher {
+  RPCBatchHandler handler;
+  size_t max_batch;
+  std::chrono::microseconds max_delay;
+  std::mutex mutex;
+  std::shared_ptr<std::vector<RPCBatchEntry>> pending;
+  uint64_t generation { 0 };
+  std::atomic_size_t batches { 0 };
+  std::atomic_size_t requests { 0 };
+};
+
+// runs on a worker once a client opens a stream of the method,
+// it may return at once and use the stream from anywhere, it finishes the stream
+typedef std::function<void(std::shared_ptr<RPCStream>)> RPCStreamHandler;
+
+// a method of a service generated by the asio_pbrpc protoc plugin,
+// its messages are made and its implementation is called without reflection
+struct RPCTypedMethod {
+  const char* name;
+  const char* full_name;
+  uint64_t method_id;
+  google::protobuf::Message* (*new_request)();
+  google::protobuf::Message* (*new_response)();
+  void (*invoke)(void* service, ServerRPCController* controller,
+      const google::protobuf::Message* request, google::protobuf::Message* response,
+      google::protobuf::Closure* done);
+};
+
+template <class Message>
+google::protobuf::Message* RPCNewMessage() {
+  return new Message;
+}
+
+// either a generic service and its method, or a generated method and its implementation
+struct RPCMethod {
+  std::shared_ptr<google::protobuf::Service> service;
+  const google::protobuf::MethodDescriptor* descriptor;
+  RPCPriority priority;
+  std::shared_ptr<RPCBatcher> batcher;
+  std::shared_ptr<RPCResultCache> cache;
+  const RPCTypedMethod* typed { nullptr };
+  std::shared_ptr<void> typed_service;
+  RPCStreamHandler stream_handler;
+  size_t stream_window { kRPCStreamWindow };
+};
+
+class RPCServerConnection : public TCPConnection<RPCBuffer, StreamProtocol> {
  public:
-  using TCPConnection<RPCBuffer>::TCPConnection;
+  using TCPConnection<RPCBuffer, StreamProtocol>::TCPConnection;
 
   virtual ~RPCServerConnection() {}
 
@@ -31,67 +171,881 @@ class RPCServerConnection : public TCPConnection<RPCBuffer> {
   }
 
  protected:
+  bool OnConnect() override;
   bool OnReceive() override;
+  bool OnClose() override;
+  BufferPtr FragmentHead(uint64_t fragment_id, size_t bytes, bool last) override;
+
+ private:
+  friend class RPCServer;
+
+  bool Dispatch(size_t message_length);
+  // a frame of a stream, opening it if the client names a method
+  bool DispatchStream(const RPCHeader& header, size_t pb_length);
+  void Cancel(uint64_t call_id);
+  // the handler is done with the call
+  void Respond(const RPCServerCall& call);
+  // the call's deadline passed before its handler ran
+  void Expire(const RPCServerCall& call);
+  void SendError(RPCHeader header, RPCStatus status,
+      const std::shared_ptr<RPCResponseBatch>& batch);
+  // a response whose message is already serialized
+  void SendBody(const RPCHeader& header, const SharedPayload& body,
+      const std::shared_ptr<RPCResponseBatch>& batch,
+      const RPCAttachments& attachments = RPCAttachments());
+  // a null output buffer for a call getting no response, the slices follow the buffer
+  void Reply(BufferPtr output_buffer, uint8_t priority,
+      const std::shared_ptr<RPCResponseBatch>& batch, RPCAttachments slices = RPCAttachments());
+  void Finish(const RPCServerCall& call);
+
+  // calls of the batch frame being parsed
+  std::shared_ptr<RPCResponseBatch> batch_;
+  size_t batch_remaining_ { 0 };
+  // of the request being dispatched
+  std::vector<size_t> attachment_sizes_;
+
+  // calls queued or running, by call id, for cancellation
+  std::mutex calls_mutex_;
+  std::unordered_map<uint64_t, std::shared_ptr<ServerRPCController>> calls_;
+  std::shared_ptr<RPCStreamTable> streams_ { std::make_shared<RPCStreamTable>() };
 };
 
 class RPCServer : public TCPServer<RPCServerConnection> {
  public:
-  using TCPServer<RPCServerConnection>::TCPServer;
+  template <class... Args>
+  RPCServer(Args&&... args) :
+    TCPServer<RPCServerConnection>(std::forward<Args>(args)...),
+    scheduler_(working_executor_, kRPCPriorityCount) {
+    static_assert(kRPCPriorityCount <= RPCServerConnection::kSendLanes, "");
+    scheduler_.weights({ 16, 4, 1 });
+  }
 
-  void RegisterService(std::shared_ptr<google::protobuf::Service> service) {
+  // priorities by method name, unlisted methods are normal
+  void RegisterService(std::shared_ptr<google::protobuf::Service> service,
+      const std::unordered_map<std::string, RPCPriority>& priorities = {}) {
     const google::protobuf::ServiceDescriptor* service_descriptor = service->GetDescriptor();
     for (int i = 0; i < service_descriptor->method_count(); ++i) {
       const google::protobuf::MethodDescriptor* method_descriptor = service_descriptor->method(i);
-      size_t method_id = std::hash<std::string>()(method_descriptor->full_name());
+      size_t method_id = RPCMethodId(method_descriptor->full_name());
       if (methods_.count(method_id)) {
         std::cerr << "duplicated method id!" << std::endl;
         continue;
       }
-      methods_.emplace(method_id, std::make_pair(service, method_descriptor));
+      auto priority = priorities.find(method_descriptor->name());
+      RPCMethod& registered = methods_[method_id];
+      registered.service = service;
+      registered.descriptor = method_descriptor;
+      registered.priority = priority == priorities.end() ? kRPCPriorityNormal : priority->second;
+    }
+  }
+
+  // a service generated by the protoc plugin, use the generated Register<Service> helper
+  void RegisterService(std::shared_ptr<void> service, const RPCTypedMethod* methods,
+      size_t method_count, const std::unordered_map<std::string, RPCPriority>& priorities = {}) {
+    for (size_t i = 0; i < method_count; ++i) {
+      const RPCTypedMethod& method = methods[i];
+      if (methods_.count(method.method_id)) {
+        std::cerr << "duplicated method id!" << std::endl;
+        continue;
+      }
+      auto priority = priorities.find(method.name);
+      RPCMethod& registered = methods_[method.method_id];
+      registered.descriptor = nullptr;
+      registered.priority = priority == priorities.end() ? kRPCPriorityNormal : priority->second;
+      registered.typed = &method;
+      registered.typed_service = service;
+    }
+  }
+
+  // requests of the method arriving within max_delay of each other, on any connection,
+  // are handed to the handler together, up to max_batch at a time.
+  // the method's service must be registered first, its CallMethod is bypassed
+  bool RegisterBatchHandler(const std::string& method_full_name, RPCBatchHandler handler,
+      size_t max_batch = 64,
+      const std::chrono::microseconds& max_delay = std::chrono::microseconds(200)) {
+    auto ite = methods_.find(RPCMethodId(method_full_name));
+    if (ite == methods_.end()) {
+      std::cerr << "method " << method_full_name << " is not registered!" << std::endl;
+      return false;
+    }
+    std::shared_ptr<RPCBatcher> batcher(std::make_shared<RPCBatcher>());
+    batcher->handler = std::move(handler);
+    batcher->max_batch = std::max<size_t>(max_batch, 1);
+    batcher->max_delay = max_delay;
+    ite->second.batcher = batcher;
+    return true;
+  }
+
+  // Streams the client opens on the method go to the handler, plain calls of it still
+  // reach the service. The method's service must be registered first, its request type
+  // is what the client writes. window is the message bytes of a stream read ahead
+  bool RegisterStreamHandler(const std::string& method_full_name, RPCStreamHandler handler,
+      size_t window = kRPCStreamWindow) {
+    auto ite = methods_.find(RPCMethodId(method_full_name));
+    if (ite == methods_.end()) {
+      std::cerr << "method " << method_full_name << " is not registered!" << std::endl;
+      return false;
+    }
+    ite->second.stream_handler = std::move(handler);
+    ite->second.stream_window = window;
+    return true;
+  }
+
+  // successful responses of the method are kept for ttl by the request's serialized bytes
+  // and sent again without running the handler or serializing, up to capacity bytes,
+  // identical requests arriving while one is handled wait for its response.
+  // a zero ttl only coalesces requests in flight.
+  // the method must be free of side effects, its response depending on the request only
+  bool RegisterResultCache(const std::string& method_full_name,
+      const std::chrono::milliseconds& ttl = std::chrono::milliseconds::zero(),
+      size_t capacity = size_t(16) << 20) {
+    auto ite = methods_.find(RPCMethodId(method_full_name));
+    if (ite == methods_.end()) {
+      std::cerr << "method " << method_full_name << " is not registered!" << std::endl;
+      return false;
+    }
+    std::shared_ptr<RPCResultCache> cache(std::make_shared<RPCResultCache>());
+    cache->ttl = ttl;
+    cache->capacity = capacity;
+    ite->second.cache = cache;
+    return true;
+  }
+
+  // requests of the method answered from its result cache
+  size_t cache_hits(const std::string& method_full_name) {
+    RPCResultCache* cache = FindResultCache(method_full_name);
+    return cache ? cache->hits.load(std::memory_order_relaxed) : 0;
+  }
+  // requests of the method answered by an identical one in flight
+  size_t coalesced_requests(const std::string& method_full_name) {
+    RPCResultCache* cache = FindResultCache(method_full_name);
+    return cache ? cache->coalesced.load(std::memory_order_relaxed) : 0;
+  }
+
+  // average number of requests per call of the method's batch handler
+  double batch_size(const std::string& method_full_name) {
+    auto ite = methods_.find(RPCMethodId(method_full_name));
+    if (ite == methods_.end() || !ite->second.batcher) {
+      return 0;
     }
+    size_t batches = ite->second.batcher->batches.load(std::memory_order_relaxed);
+    return batches ? static_cast<double>(
+        ite->second.batcher->requests.load(std::memory_order_relaxed)) / batches : 0;
+  }
+
+  ConcurrencyLimiter& concurrency_limiter() {
+    return concurrency_limiter_;
+  }
+
+  // requests wait here for a worker, one lane per priority weighted 16:4:1 unless changed,
+  // tenants, or connections for untagged requests, share a lane fairly
+  RequestScheduler& scheduler() {
+    return scheduler_;
+  }
+
+  // larger frames close the connection
+  void max_message_length(size_t max_message_length) {
+    max_message_length_ = max_message_length;
+  }
+
+  // streams a connection may have open at a time, more are refused as overloaded
+  void max_streams(size_t max_streams) {
+    max_streams_ = max_streams;
+  }
+
+  // fragmented frames a connection may have in part at a time and their bytes,
+  // past either the connection closes
+  void max_partial_frames(size_t max_partial_frames) {
+    max_partial_frames_ = max_partial_frames;
+  }
+  void max_partial_bytes(size_t max_partial_bytes) {
+    max_partial_bytes_ = max_partial_bytes;
+  }
+
+  // frames parsed from a connection before yielding the I/O loop to other connections
+  void read_budget(size_t read_budget) {
+    read_budget_ = std::max<size_t>(read_budget, 1);
+  }
+
+  void tenant_weight(uint32_t tenant, size_t weight) {
+    scheduler_.flow_weight(TenantFlow(tenant), weight);
+  }
+
+  // exponentially weighted average of the time requests wait for a worker, in microseconds
+  double queue_delay(uint32_t tenant) {
+    std::lock_guard<std::mutex> lock(tenants_mutex_);
+    auto ite = tenants_.find(tenant);
+    return ite == tenants_.end() ? 0 : ite->second.queue_delay;
+  }
+  size_t tenant_requests(uint32_t tenant) {
+    std::lock_guard<std::mutex> lock(tenants_mutex_);
+    auto ite = tenants_.find(tenant);
+    return ite == tenants_.end() ? 0 : ite->second.requests;
   }
 
  private:
   friend class RPCServerConnection;
 
-  std::unordered_map<size_t, std::pair<std::shared_ptr<google::protobuf::Service>,
-      const google::protobuf::MethodDescriptor*>> methods_;
+  struct TenantStats {
+    size_t requests { 0 };
+    double queue_delay { 0 };
+  };
+
+  static uint64_t TenantFlow(uint32_t tenant) {
+    return (uint64_t(1) << 63) | tenant;
+  }
+
+  // batches of a method share one flow
+  static uint64_t BatchFlow(const RPCBatcher* batcher) {
+    return (uint64_t(1) << 62) | reinterpret_cast<uintptr_t>(batcher);
+  }
+
+  void Collect(const std::shared_ptr<RPCBatcher>& batcher, RPCBatchEntry entry);
+  void FlushBatch(const std::shared_ptr<RPCBatcher>& batcher, uint64_t generation);
+  // with the batcher lock held
+  std::shared_ptr<std::vector<RPCBatchEntry>> TakeBatch(RPCBatcher& batcher);
+  void ScheduleBatch(const std::shared_ptr<RPCBatcher>& batcher,
+      std::shared_ptr<std::vector<RPCBatchEntry>> entries);
+
+  RPCResultCache* FindResultCache(const std::string& method_full_name) {
+    auto ite = methods_.find(RPCMethodId(method_full_name));
+    return ite == methods_.end() ? nullptr : ite->second.cache.get();
+  }
+
+  // false if the request was answered from the cache or joined an identical one in flight,
+  // otherwise the caller runs the handler for the returned flight
+  bool Lookup(const std::shared_ptr<RPCResultCache>& cache, std::string key,
+      const std::shared_ptr<RPCServerConnection>& connection, const RPCHeader& header,
+      const std::shared_ptr<RPCResponseBatch>& batch, std::shared_ptr<RPCFlight>& flight);
+  // answers the requests waiting for the flight, caching a successful body
+  void Land(RPCFlight& flight, RPCStatus status, const RPCResultCache::Body& body);
+  // whether a call is canceled and no identical request waits for it either
+  bool Abandon(const RPCServerCall& call);
+  // with the cache lock held
+  void Evict(RPCResultCache& cache,
+      std::unordered_map<std::string, RPCResultCache::Entry>::iterator entry);
+
+  void RecordQueueDelay(uint32_t tenant, std::chrono::steady_clock::duration delay) {
+    double delay_us = std::chrono::duration<double, std::micro>(delay).count();
+    std::lock_guard<std::mutex> lock(tenants_mutex_);
+    TenantStats& stats = tenants_[tenant];
+    stats.queue_delay = stats.requests++ ? stats.queue_delay * 0.9 + delay_us * 0.1 : delay_us;
+  }
+
+  ConcurrencyLimiter concurrency_limiter_;
+  RequestScheduler scheduler_;
+  size_t max_message_length_ { 16 << 20 };
+  size_t max_streams_ { kRPCMaxStreams };
+  size_t max_partial_frames_ { kRPCMaxPartialFrames };
+  size_t max_partial_bytes_ { kRPCMaxPartialBytes };
+  size_t read_budget_ { 16 };
+  std::mutex tenants_mutex_;
+  std::unordered_map<uint32_t, TenantStats> tenants_;
+
+  std::unordered_map<size_t, RPCMethod> methods_;
 };
 
+bool RPCServerConnection::OnConnect() {
+  input_buffer()->max_message_length(server().max_message_length_);
+  input_buffer()->max_partial_frames(server().max_partial_frames_);
+  input_buffer()->max_partial_bytes(server().max_partial_bytes_);
+  // requests are pipelined, keep reading while responses are pending,
+  // a client may stay idle between requests for as long as it likes
+  receive_after_send(false);
+  timeout(std::chrono::milliseconds(10), std::chrono::milliseconds(10),
+      std::chrono::milliseconds::zero());
+  return true;
+}
+
+bool RPCServerConnection::OnClose() {
+  streams_->FailAll("connection closed");
+  return true;
+}
+
+RPCServerConnection::BufferPtr RPCServerConnection::FragmentHead(uint64_t fragment_id,
+    size_t bytes, bool last) {
+  BufferPtr head(std::make_shared<RPCBuffer>());
+  head->SerializeFragment(fragment_id, bytes, last);
+  return head;
+}
+
 bool RPCServerConnection::OnReceive() {
-  auto head = input_buffer()->ParseMessageLength();
-  if (!head.first) {
-    std::cerr << "bad message!" << std::endl;
+  for (size_t i = 0; i < server().read_budget_; ++i) {
+    auto head = input_buffer()->ParseMessageLength();
+    if (!head.first) {
+      std::cerr << "bad message!" << std::endl;
+      return false;
+    } else if (boost::indeterminate(head.first)) {
+      AsyncReceive();
+      return true;
+    }
+    if (!Dispatch(head.second)) {
+      return false;
+    }
+  }
+  // read budget spent, let the other connections of this loop go first
+  auto self(shared_from_this());
+  io_service().post([this, self] {
+    if (!OnReceive()) {
+      Close();
+    }
+  });
+  return true;
+}
+
+bool RPCServerConnection::Dispatch(size_t message_length) {
+  RPCHeader header = input_buffer()->ParseHeader();
+  size_t pb_length = message_length - sizeof(RPCHeader);
+  if (header.flags & kRPCFlagFragment) {
+    // the whole frame is dispatched from the front once its last fragment is in,
+    // the input buffer bounds the frames in part
+    return input_buffer()->Reassemble(header, pb_length);
+  }
+  if (header.flags & kRPCFlagBatch) {
+    if (batch_remaining_ || !header.call_id) {
+      std::cerr << "bad batch!" << std::endl;
+      return false;
+    }
+    // the calls follow as ordinary frames
+    batch_ = std::make_shared<RPCResponseBatch>();
+    batch_->buffer = std::make_shared<RPCBuffer>();
+    batch_->buffer->BeginBatch();
+    batch_->pending = batch_remaining_ = header.call_id;
+    return true;
+  }
+  size_t attachment_bytes;
+  if (!input_buffer()->ParseAttachments(header, pb_length, attachment_sizes_,
+      attachment_bytes)) {
+    std::cerr << "bad attachments!" << std::endl;
     return false;
-  } else if (head.first == boost::indeterminate) {
-    AsyncReceive();
+  }
+  std::shared_ptr<RPCResponseBatch> batch;
+  if (batch_remaining_) {
+    batch = batch_;
+    if (!--batch_remaining_) {
+      batch_.reset();
+    }
+  }
+  if (header.flags & kRPCFlagCancel) {
+    input_buffer()->retrieve(pb_length + attachment_bytes);
+    Cancel(header.call_id);
+    Reply(nullptr, kRPCPriorityHigh, batch);
+    return true;
+  }
+  if (header.flags & kRPCStreamFlags) {
+    // stream messages carry no attachments, their frames are never batched
+    Reply(nullptr, kRPCPriorityHigh, batch);
+    if (!DispatchStream(header, pb_length)) {
+      return false;
+    }
+    input_buffer()->retrieve(attachment_bytes);
     return true;
   }
-  size_t method_id = input_buffer()->ParseMethodId();
-  auto ite = server().methods_.find(method_id);
+  auto ite = server().methods_.find(header.method_id);
   if (ite == server().methods_.end()) {
-    std::cerr << "method id " << method_id << " is not registered!" << std::endl;
+    std::cerr << "method id " << header.method_id << " is not registered!" << std::endl;
     return false;
   }
-  std::shared_ptr<google::protobuf::Service> service = ite->second.first;
-  const google::protobuf::MethodDescriptor* method_descriptor = ite->second.second;
-  MessagePtr request(service->GetRequestPrototype(method_descriptor).New());
-  MessagePtr response(service->GetResponsePrototype(method_descriptor).New());
-  size_t pb_length = head.second - sizeof(size_t);
-  if (!input_buffer()->ParseMessage(*request, pb_length)) {
-    std::cerr << "parse protobuf failed: " << typeid(*request).name() << std::endl;
+  // shed load before paying for the request
+  if (RPCDeadline::Expired(header.deadline)) {
+    input_buffer()->retrieve(pb_length + attachment_bytes);
+    SendError(header, kRPCDeadlineExceeded, batch);
+    return true;
+  }
+  if (header.priority >= kRPCPriorityCount) {
+    header.priority = ite->second.priority;
+  }
+  auto self(std::static_pointer_cast<RPCServerConnection>(shared_from_this()));
+  std::shared_ptr<RPCFlight> flight;
+  // the key is the message alone, requests with attachments always run the handler
+  if (ite->second.cache && attachment_sizes_.empty()) {
+    std::string key(input_buffer()->read_buffer(), pb_length);
+    if (!server().Lookup(ite->second.cache, std::move(key), self, header, batch, flight)) {
+      input_buffer()->retrieve(pb_length);
+      return true;
+    }
+  }
+  if (!server().concurrency_limiter_.TryAcquire()) {
+    input_buffer()->retrieve(pb_length + attachment_bytes);
+    SendError(header, kRPCOverloaded, batch);
+    if (flight) {
+      server().Land(*flight, kRPCOverloaded, nullptr);
+    }
+    return true;
+  }
+  // registration is over once the server runs, the method stays put
+  const RPCMethod* method = &ite->second;
+  RPCServerCall call;
+  call.header = header;
+  call.start_time = std::chrono::steady_clock::now();
+  if (method->typed) {
+    call.request.reset(method->typed->new_request());
+    call.response.reset(method->typed->new_response());
+  } else {
+    call.request.reset(method->service->GetRequestPrototype(method->descriptor).New());
+    call.response.reset(method->service->GetResponsePrototype(method->descriptor).New());
+  }
+  if (!input_buffer()->ParseMessage(*call.request, pb_length)) {
+    std::cerr << "parse protobuf failed: " << typeid(*call.request).name() << std::endl;
+    server().concurrency_limiter_.Release();
+    if (flight) {
+      server().Land(*flight, kRPCFailed, nullptr);
+    }
     return false;
   }
-  auto self(shared_from_this());
-  google::protobuf::Closure* done =
-      google::protobuf::NewCallback<std::pair<size_t, MessagePtr>, Ptr>(
-          [](std::pair<size_t, MessagePtr> output, Ptr self) {
+  call.controller = std::make_shared<ServerRPCController>();
+  if (!attachment_sizes_.empty()) {
+    call.controller->request_attachments(RPCTakeAttachments(*this, attachment_sizes_));
+  }
+  call.controller->deadline(header.deadline);
+  call.controller->io_service(io_service());
+  call.batch = batch;
+  call.flight = flight;
+  {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    calls_[header.call_id] = call.controller;
+  }
+  // the request lives until the handler is done, the serialized response is charged
+  // as output until it is written
+  call.in_flight_bytes = pb_length + attachment_bytes;
+  memory_account().Charge(MemoryBudget::kInFlight, call.in_flight_bytes);
+  if (method->batcher) {
+    server().Collect(method->batcher, RPCBatchEntry { self, call });
+    return true;
+  }
+  uint64_t flow = header.tenant ? RPCServer::TenantFlow(header.tenant) :
+      reinterpret_cast<uintptr_t>(this);
+  server().scheduler_.Schedule(header.priority, flow, message_length, header.deadline,
+      [self, method, call] {
+    // nobody waits for the response any more
+    if (self->server().Abandon(call)) {
+      self->Finish(call);
+      self->Reply(nullptr, call.header.priority, call.batch);
+      return;
+    }
+    self->server().RecordQueueDelay(call.header.tenant,
+        std::chrono::steady_clock::now() - call.start_time);
+    google::protobuf::Closure* done =
+        google::protobuf::NewCallback<RPCServerCall, std::shared_ptr<RPCServerConnection>>(
+            [](RPCServerCall call, std::shared_ptr<RPCServerConnection> self) {
+      self->Respond(call);
+    }, call, self);
+    // nested calls made by the handler inherit the deadline
+    RPCDeadline::Scope deadline_scope(call.header.deadline);
+    if (method->typed) {
+      method->typed->invoke(method->typed_service.get(), call.controller.get(),
+          call.request.get(), call.response.get(), done);
+    } else {
+      method->service->CallMethod(method->descriptor, call.controller.get(),
+          call.request.get(), call.response.get(), done);
+    }
+  }, [self, call] {
+    self->Expire(call);
+  });
+  return true;
+}
+
+bool RPCServerConnection::DispatchStream(const RPCHeader& header, size_t pb_length) {
+  std::shared_ptr<RPCStream> stream(streams_->Find(header.call_id));
+  if (stream) {
+    return stream->OnFrame(header, *input_buffer(), pb_length);
+  }
+  // what is left of a stream already over
+  if (!header.method_id || !(header.flags & kRPCFlagStreamCredit)) {
+    input_buffer()->retrieve(pb_length);
+    return true;
+  }
+  RPCHeader end;
+  end.call_id = header.call_id;
+  end.flags = kRPCFlagStreamEnd;
+  auto ite = server().methods_.find(header.method_id);
+  if (ite == server().methods_.end() || !ite->second.stream_handler) {
+    std::cerr << "method id " << header.method_id << " has no stream handler!" << std::endl;
+    input_buffer()->retrieve(pb_length);
+    SendError(end, kRPCFailed, nullptr);
+    return true;
+  }
+  const RPCMethod* method = &ite->second;
+  // an open stream holds a slot of the limiter and its window of memory until it is
+  // over, it is only let in while streams alone leave the budget short of exhausted,
+  // since the frames ending them are read in turn
+  size_t window = method->stream_window;
+  bool admitted = streams_->size() < server().max_streams_ &&
+      server().concurrency_limiter_.TryAcquire();
+  if (admitted) {
+    memory_account().Charge(MemoryBudget::kInFlight, window);
+    if (memory_account().Exhausted()) {
+      memory_account().Charge(MemoryBudget::kInFlight, -static_cast<std::ptrdiff_t>(window));
+      server().concurrency_limiter_.Release();
+      admitted = false;
+    }
+  }
+  if (!admitted) {
+    input_buffer()->retrieve(pb_length);
+    SendError(end, kRPCOverloaded, nullptr);
+    return true;
+  }
+  RPCHeader stream_header(header);
+  if (stream_header.priority >= kRPCPriorityCount) {
+    stream_header.priority = method->priority;
+  }
+  MessagePtr prototype(method->typed ? method->typed->new_request() :
+      method->service->GetRequestPrototype(method->descriptor).New());
+  stream = std::make_shared<RPCStream>(shared_from_this(), streams_, stream_header,
+      std::move(prototype), window);
+  std::weak_ptr<RPCServerConnection> connection(
+      std::static_pointer_cast<RPCServerConnection>(shared_from_this()));
+  RPCServer* rpc_server = &server();
+  stream->on_close([connection, rpc_server, window] {
+    rpc_server->concurrency_limiter_.Release();
+    if (std::shared_ptr<RPCServerConnection> self = connection.lock()) {
+      self->memory_account().Charge(MemoryBudget::kInFlight,
+          -static_cast<std::ptrdiff_t>(window));
+    }
+  });
+  streams_->Add(header.call_id, stream);
+  // takes the client's window, then grants ours
+  if (!stream->OnFrame(header, *input_buffer(), pb_length)) {
+    return false;
+  }
+  stream->Grant();
+  uint64_t flow = header.tenant ? RPCServer::TenantFlow(header.tenant) :
+      reinterpret_cast<uintptr_t>(this);
+  server().scheduler_.Schedule(stream_header.priority, flow, pb_length, header.deadline,
+      [method, stream] {
+    // nested calls made by the handler inherit the deadline
+    RPCDeadline::Scope deadline_scope(stream->deadline());
+    method->stream_handler(stream);
+  }, [stream] {
+    stream->Finish(kRPCDeadlineExceeded);
+  });
+  return true;
+}
+
+void RPCServerConnection::Cancel(uint64_t call_id) {
+  std::shared_ptr<ServerRPCController> controller;
+  {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    auto ite = calls_.find(call_id);
+    if (ite == calls_.end()) {
+      return;
+    }
+    controller = ite->second;
+  }
+  controller->Cancel();
+}
+
+void RPCServerConnection::Respond(const RPCServerCall& call) {
+  Finish(call);
+  if (call.controller->Failed()) {
+    SendError(call.header, kRPCFailed, call.batch);
+    if (call.flight) {
+      server().Land(*call.flight, kRPCFailed, nullptr);
+    }
+    return;
+  }
+  const RPCAttachments& attachments = call.controller->response_attachments();
+  if (!call.flight) {
     BufferPtr output_buffer(std::make_shared<RPCBuffer>());
-    output_buffer->Serialize(output.first, *output.second);
-    self->AsyncSend(output_buffer);
-  }, std::make_pair(method_id, response), self);
-  service->CallMethod(method_descriptor, nullptr, request.get(), response.get(), done);
+    output_buffer->Serialize(call.header, *call.response, attachments);
+    Reply(output_buffer, call.header.priority, call.batch, attachments);
+    return;
+  }
+  // serialized once for this call, the identical requests waiting and the cache,
+  // which get the message without the attachments
+  SharedPayload body(std::make_shared<const std::string>(call.response->SerializeAsString()));
+  SendBody(call.header, body, call.batch, attachments);
+  server().Land(*call.flight, kRPCOk, body);
+}
+
+void RPCServerConnection::Expire(const RPCServerCall& call) {
+  Finish(call);
+  SendError(call.header, kRPCDeadlineExceeded, call.batch);
+  if (call.flight) {
+    server().Land(*call.flight, kRPCDeadlineExceeded, nullptr);
+  }
+}
+
+void RPCServerConnection::SendError(RPCHeader header, RPCStatus status,
+    const std::shared_ptr<RPCResponseBatch>& batch) {
+  header.status = status;
+  BufferPtr output_buffer(std::make_shared<RPCBuffer>());
+  output_buffer->Serialize(header);
+  Reply(output_buffer, header.priority, batch);
+}
+
+void RPCServerConnection::SendBody(const RPCHeader& header, const SharedPayload& body,
+    const std::shared_ptr<RPCResponseBatch>& batch, const RPCAttachments& attachments) {
+  BufferPtr output_buffer(std::make_shared<RPCBuffer>());
+  output_buffer->SerializeHead(header, body->size(), attachments);
+  RPCAttachments slices;
+  slices.reserve(attachments.size() + 1);
+  slices.emplace_back(RPCAttachment { body->data(), body->size(), body });
+  slices.insert(slices.end(), attachments.begin(), attachments.end());
+  Reply(output_buffer, header.priority, batch, std::move(slices));
+}
+
+void RPCServerConnection::Reply(BufferPtr output_buffer, uint8_t priority,
+    const std::shared_ptr<RPCResponseBatch>& batch, RPCAttachments slices) {
+  size_t lane = priority < kRPCPriorityCount ? priority : kDefaultSendLane;
+  if (!batch) {
+    if (output_buffer) {
+      AsyncSend(output_buffer, std::move(slices), lane);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    if (output_buffer) {
+      // a batch is one buffer, its slices are copied in, files read in
+      size_t bytes = batch->buffer->readable_bytes();
+      batch->buffer->write(output_buffer->read_buffer(), output_buffer->readable_bytes());
+      for (auto& slice : slices) {
+        if (!batch->buffer->write(slice)) {
+          std::cerr << "read file failed!" << std::endl;
+          Close();
+          return;
+        }
+      }
+      bytes = batch->buffer->readable_bytes() - bytes;
+      batch->charged += bytes;
+      memory_account().Charge(MemoryBudget::kInFlight, bytes);
+      ++batch->responses;
+      // the most urgent call of the batch decides
+      batch->priority = std::min<uint8_t>(batch->priority, lane);
+    }
+    if (--batch->pending) {
+      return;
+    }
+  }
+  if (!batch->responses) {
+    return;
+  }
+  memory_account().Charge(MemoryBudget::kInFlight, -static_cast<std::ptrdiff_t>(batch->charged));
+  batch->buffer->EndBatch(batch->responses);
+  AsyncSend(batch->buffer, batch->priority);
+}
+
+void RPCServerConnection::Finish(const RPCServerCall& call) {
+  server().concurrency_limiter_.Release(std::chrono::steady_clock::now() - call.start_time);
+  memory_account().Charge(MemoryBudget::kInFlight, -call.in_flight_bytes);
+  {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    auto ite = calls_.find(call.header.call_id);
+    if (ite != calls_.end() && ite->second == call.controller) {
+      calls_.erase(ite);
+    }
+  }
+  call.controller->Finish();
+}
+
+void RPCServer::Collect(const std::shared_ptr<RPCBatcher>& batcher, RPCBatchEntry entry) {
+  std::shared_ptr<std::vector<RPCBatchEntry>> entries;
+  {
+    std::lock_guard<std::mutex> lock(batcher->mutex);
+    if (!batcher->pending) {
+      batcher->pending = std::make_shared<std::vector<RPCBatchEntry>>();
+      batcher->pending->reserve(batcher->max_batch);
+      // the first request of a batch waits at most max_delay for company
+      std::shared_ptr<SteadyTimer> timer(
+          std::make_shared<SteadyTimer>(entry.connection->io_service()));
+      timer->expires_from_now(
+          std::chrono::duration_cast<SteadyTimer::duration_type>(batcher->max_delay));
+      uint64_t generation = batcher->generation;
+      timer->async_wait([this, batcher, generation, timer](const boost::system::error_code& ec) {
+        if (ec != boost::asio::error::operation_aborted) {
+          FlushBatch(batcher, generation);
+        }
+      });
+    }
+    batcher->pending->emplace_back(std::move(entry));
+    if (batcher->pending->size() >= batcher->max_batch) {
+      entries = TakeBatch(*batcher);
+    }
+  }
+  if (entries) {
+    ScheduleBatch(batcher, std::move(entries));
+  }
+}
+
+void RPCServer::FlushBatch(const std::shared_ptr<RPCBatcher>& batcher, uint64_t generation) {
+  std::shared_ptr<std::vector<RPCBatchEntry>> entries;
+  {
+    std::lock_guard<std::mutex> lock(batcher->mutex);
+    // already sent full
+    if (generation != batcher->generation || !batcher->pending) {
+      return;
+    }
+    entries = TakeBatch(*batcher);
+  }
+  ScheduleBatch(batcher, std::move(entries));
+}
+
+std::shared_ptr<std::vector<RPCBatchEntry>> RPCServer::TakeBatch(RPCBatcher& batcher) {
+  std::shared_ptr<std::vector<RPCBatchEntry>> entries;
+  entries.swap(batcher.pending);
+  ++batcher.generation;
+  return entries;
+}
+
+void RPCServer::ScheduleBatch(const std::shared_ptr<RPCBatcher>& batcher,
+    std::shared_ptr<std::vector<RPCBatchEntry>> entries) {
+  // the most urgent request sets the lane, the batch only expires with its last request
+  uint8_t lane = kRPCPriorityLow;
+  size_t cost = 0;
+  int64_t deadline = 0;
+  bool unbounded = false;
+  for (auto& entry : *entries) {
+    lane = std::min(lane, entry.call.header.priority);
+    cost += entry.call.in_flight_bytes;
+    if (!entry.call.header.deadline) {
+      unbounded = true;
+    }
+    deadline = std::max(deadline, entry.call.header.deadline);
+  }
+  scheduler_.Schedule(lane, BatchFlow(batcher.get()), cost, unbounded ? 0 : deadline,
+      [this, batcher, entries] {
+    std::shared_ptr<std::vector<RPCBatchEntry>> live(
+        std::make_shared<std::vector<RPCBatchEntry>>());
+    live->reserve(entries->size());
+    int64_t deadline = 0;
+    for (auto& entry : *entries) {
+      RPCServerCall& call = entry.call;
+      if (Abandon(call)) {
+        entry.connection->Finish(call);
+        entry.connection->Reply(nullptr, call.header.priority, call.batch);
+      } else if (RPCDeadline::Expired(call.header.deadline)) {
+        entry.connection->Expire(call);
+      } else {
+        RecordQueueDelay(call.header.tenant, std::chrono::steady_clock::now() - call.start_time);
+        if (call.header.deadline && (!deadline || call.header.deadline < deadline)) {
+          deadline = call.header.deadline;
+        }
+        live->emplace_back(entry);
+      }
+    }
+    if (live->empty()) {
+      return;
+    }
+    batcher->batches.fetch_add(1, std::memory_order_relaxed);
+    batcher->requests.fetch_add(live->size(), std::memory_order_relaxed);
+    std::vector<RPCBatchItem> items;
+    items.reserve(live->size());
+    for (auto& entry : *live) {
+      items.emplace_back(RPCBatchItem { entry.call.request.get(), entry.call.response.get(),
+          entry.call.controller.get() });
+    }
+    google::protobuf::Closure* done =
+        google::protobuf::NewCallback<std::shared_ptr<std::vector<RPCBatchEntry>>>(
+            [](std::shared_ptr<std::vector<RPCBatchEntry>> live) {
+      for (auto& entry : *live) {
+        entry.connection->Respond(entry.call);
+      }
+    }, live);
+    // nested calls made by the handler inherit the earliest deadline
+    RPCDeadline::Scope deadline_scope(deadline);
+    batcher->handler(items, done);
+  }, [entries] {
+    for (auto& entry : *entries) {
+      entry.connection->Expire(entry.call);
+    }
+  });
+}
+
+bool RPCServer::Lookup(const std::shared_ptr<RPCResultCache>& cache, std::string key,
+    const std::shared_ptr<RPCServerConnection>& connection, const RPCHeader& header,
+    const std::shared_ptr<RPCResponseBatch>& batch, std::shared_ptr<RPCFlight>& flight) {
+  RPCResultCache::Body body;
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto entry = cache->entries.find(key);
+    if (entry != cache->entries.end()) {
+      if (std::chrono::steady_clock::now() < entry->second.expire_time) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, entry->second.lru);
+        body = entry->second.body;
+      } else {
+        Evict(*cache, entry);
+      }
+    }
+    if (!body) {
+      auto running = cache->flights.find(key);
+      if (running != cache->flights.end()) {
+        running->second->waiters.emplace_back(RPCFlight::Waiter { connection, header, batch });
+        cache->coalesced.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      flight = std::make_shared<RPCFlight>();
+      flight->cache = cache;
+      flight->key = key;
+      cache->flights.emplace(std::move(key), flight);
+      cache->misses.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  cache->hits.fetch_add(1, std::memory_order_relaxed);
+  connection->SendBody(header, body, batch);
+  return false;
+}
+
+void RPCServer::Land(RPCFlight& flight, RPCStatus status, const RPCResultCache::Body& body) {
+  RPCResultCache& cache = *flight.cache;
+  std::vector<RPCFlight::Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto running = cache.flights.find(flight.key);
+    if (running == cache.flights.end() || running->second.get() != &flight) {
+      return;
+    }
+    waiters.swap(flight.waiters);
+    cache.flights.erase(running);
+    if (status == kRPCOk && cache.ttl.count()) {
+      auto old = cache.entries.find(flight.key);
+      if (old != cache.entries.end()) {
+        Evict(cache, old);
+      }
+      size_t bytes = flight.key.size() * 2 + body->size();
+      if (bytes <= cache.capacity) {
+        cache.lru.emplace_front(flight.key);
+        cache.entries.emplace(flight.key, RPCResultCache::Entry { body, bytes,
+            std::chrono::steady_clock::now() + cache.ttl, cache.lru.begin() });
+        cache.bytes += bytes;
+        while (cache.bytes > cache.capacity) {
+          Evict(cache, cache.entries.find(cache.lru.back()));
+        }
+      }
+    }
+  }
+  for (auto& waiter : waiters) {
+    if (status == kRPCOk) {
+      waiter.connection->SendBody(waiter.header, body, waiter.batch);
+    } else {
+      waiter.connection->SendError(waiter.header, status, waiter.batch);
+    }
+  }
+}
+
+bool RPCServer::Abandon(const RPCServerCall& call) {
+  if (!call.controller->IsCanceled()) {
+    return false;
+  }
+  if (!call.flight) {
+    return true;
+  }
+  // still handled for the identical requests waiting
+  RPCResultCache& cache = *call.flight->cache;
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (!call.flight->waiters.empty()) {
+    return false;
+  }
+  cache.flights.erase(call.flight->key);
   return true;
 }
 
+void RPCServer::Evict(RPCResultCache& cache,
+    std::unordered_map<std::string, RPCResultCache::Entry>::iterator entry) {
+  cache.bytes -= entry->second.bytes;
+  cache.lru.erase(entry->second.lru);
+  cache.entries.erase(entry);
+}
+
 }
@@ -0,0 +1,469 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <asio_pbrpc/net_trans/tcp_connection.h>
+#include "rpc_buffer.h"
+#include "rpc_future.h"
+
+namespace asio_pbrpc {
+
+// message bytes a stream side takes before its reader catches up
+static const size_t kRPCStreamWindow = 256 << 10;
+// streams a server takes open on a connection at a time
+static const size_t kRPCMaxStreams = 64;
+
+class RPCStream;
+
+// the open streams of a connection by stream id
+class RPCStreamTable {
+ public:
+  std::shared_ptr<RPCStream> Find(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto ite = streams_.find(id);
+    return ite == streams_.end() ? nullptr : ite->second;
+  }
+
+  void Add(uint64_t id, std::shared_ptr<RPCStream> stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    streams_[id] = std::move(stream);
+  }
+
+  void Remove(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    streams_.erase(id);
+  }
+
+  // the connection is gone, every stream breaks
+  void FailAll(const std::string& reason);
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return streams_.size();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, std::shared_ptr<RPCStream>> streams_;
+};
+
+// Messages both ways under one stream id of a connection, the same on either end.
+// A side writes until it finishes, its peer reads them until then.
+// The peer grants credit for message bytes as they are read, a writer waiting for
+// each write keeps at most a window in flight, so a slow reader holds it back and
+// neither end holds more than a window of the stream whatever its length.
+class RPCStream : public std::enable_shared_from_this<RPCStream> {
+ public:
+  typedef TCPConnection<RPCBuffer, StreamProtocol> Connection;
+
+  // messages read are made from the prototype, the header carries the stream id,
+  // the method on the opening side, and the deadline, priority and tenant
+  RPCStream(const std::shared_ptr<Connection>& connection,
+      const std::shared_ptr<RPCStreamTable>& table, const RPCHeader& header,
+      MessagePtr prototype, size_t window = kRPCStreamWindow) :
+    connection_(connection), table_(table), header_(header), prototype_(std::move(prototype)),
+    window_(std::max<size_t>(window, 1)),
+    lane_(header.priority < kRPCPriorityCount ? header.priority :
+        Connection::kDefaultSendLane) {}
+
+  uint64_t id() const {
+    return header_.call_id;
+  }
+  // microseconds since the system clock epoch, 0 for none
+  int64_t deadline() const {
+    return header_.deadline;
+  }
+  uint32_t tenant() const {
+    return header_.tenant;
+  }
+
+  // the next message of the peer, ready with none once the peer finished,
+  // failed once the stream broke
+  RPCFuture<google::protobuf::Message> Read() {
+    RPCPromise<google::protobuf::Message> promise;
+    MessagePtr message;
+    size_t grant = 0;
+    std::string reason;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!received_.empty()) {
+        message = std::move(received_.front().message);
+        buffered_bytes_ -= received_.front().bytes;
+        grant = Consume(received_.front().bytes);
+        received_.pop_front();
+      } else if (failed_) {
+        reason = reason_;
+      } else if (!read_end_) {
+        readers_.emplace_back(promise);
+        return promise.future();
+      }
+    }
+    if (grant) {
+      Grant(grant);
+    }
+    if (!reason.empty()) {
+      promise.SetFailed(reason);
+    } else {
+      promise.SetValue(std::move(message));
+    }
+    return promise.future();
+  }
+
+  // ready once the message is sent, which waits for the peer to have room for it.
+  // one writer at a time, waiting for each write before the next keeps no more
+  // than a window queued
+  RPCFuture<void> Write(const google::protobuf::Message& message) {
+    RPCPromise<void> promise;
+    std::shared_ptr<RPCBuffer> frame(std::make_shared<RPCBuffer>());
+    frame->Serialize(Header(kRPCFlagStream), message);
+    size_t bytes = frame->readable_bytes() - sizeof(size_t) - sizeof(RPCHeader);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed_ || finishing_) {
+        std::string reason(failed_ ? reason_ : "stream finished");
+        promise.SetFailed(reason);
+        return promise.future();
+      }
+      writes_.emplace_back(PendingWrite { frame, bytes, promise });
+    }
+    Flush();
+    return promise.future();
+  }
+
+  // No more messages from this side once those written are sent.
+  // A failure status breaks the stream both ways at once and drops what is queued
+  void Finish(RPCStatus status = kRPCOk) {
+    if (status == kRPCOk) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed_ || finishing_) {
+          return;
+        }
+        finishing_ = true;
+      }
+      Flush();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed_) {
+        return;
+      }
+      end_sent_ = true;
+    }
+    std::shared_ptr<RPCBuffer> frame(std::make_shared<RPCBuffer>());
+    RPCHeader header(Header(kRPCFlagStreamEnd));
+    header.status = status;
+    frame->Serialize(header);
+    Send(frame, kRPCPriorityHigh);
+    Fail(RPCStatusText(status));
+  }
+
+  bool failed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_;
+  }
+  std::string ErrorText() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reason_;
+  }
+
+  // most message bytes received and not read yet at any time, within a window
+  // of the peer's writes
+  size_t peak_buffered_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_buffered_bytes_;
+  }
+
+  // runs once the stream is over both ways or broke
+  void on_close(std::function<void()> on_close) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    on_close_ = std::move(on_close);
+  }
+
+  // the client's first frame names the method and grants the server a window
+  void Open() {
+    RPCHeader header(Header(kRPCFlagStreamCredit));
+    header.method_id = header_.method_id;
+    header.deadline = header_.deadline;
+    header.priority = header_.priority;
+    header.tenant = header_.tenant;
+    std::shared_ptr<RPCBuffer> frame(std::make_shared<RPCBuffer>());
+    frame->SerializeHead(header, sizeof(uint64_t));
+    frame->write<uint64_t>(window_);
+    Send(frame, lane_);
+  }
+
+  // the peer may send bytes more message bytes
+  void Grant(size_t bytes) {
+    std::shared_ptr<RPCBuffer> frame(std::make_shared<RPCBuffer>());
+    frame->SerializeHead(Header(kRPCFlagStreamCredit), sizeof(uint64_t));
+    frame->write<uint64_t>(bytes);
+    Send(frame, kRPCPriorityHigh);
+  }
+  void Grant() {
+    Grant(window_);
+  }
+
+  // a frame of the stream at the front of the input buffer, length bytes after
+  // the header and attachment sizes, false if the peer broke the protocol
+  bool OnFrame(const RPCHeader& header, RPCBuffer& input, size_t length) {
+    if (header.flags & kRPCFlagStreamCredit) {
+      if (length != sizeof(uint64_t)) {
+        std::cerr << "bad stream credit!" << std::endl;
+        return false;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        credit_ += input.read<uint64_t>();
+      }
+      Flush();
+      return true;
+    }
+    if (header.flags & kRPCFlagStreamEnd) {
+      input.retrieve(length);
+      if (header.status != kRPCOk) {
+        Fail(RPCStatusText(header.status));
+        return true;
+      }
+      End();
+      return true;
+    }
+    MessagePtr message(prototype_->New());
+    if (!input.ParseMessage(*message, length)) {
+      std::cerr << "parse protobuf failed: " << typeid(*message).name() << std::endl;
+      Finish(kRPCFailed);
+      return true;
+    }
+    return Deliver(std::move(message), length);
+  }
+
+  // the stream broke, whatever waits on it fails
+  void Fail(const std::string& reason) {
+    std::deque<RPCPromise<google::protobuf::Message>> readers;
+    std::deque<PendingWrite> writes;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed_) {
+        return;
+      }
+      failed_ = true;
+      reason_ = reason;
+      readers.swap(readers_);
+      writes.swap(writes_);
+      received_.clear();
+      buffered_bytes_ = 0;
+    }
+    Close();
+    for (auto& reader : readers) {
+      reader.SetFailed(reason);
+    }
+    for (auto& write : writes) {
+      write.promise.SetFailed(reason);
+    }
+  }
+
+ private:
+  struct PendingWrite {
+    std::shared_ptr<RPCBuffer> frame;
+    size_t bytes;
+    RPCPromise<void> promise;
+  };
+
+  struct Received {
+    MessagePtr message;
+    size_t bytes;
+  };
+
+  RPCHeader Header(uint16_t flags) const {
+    RPCHeader header;
+    header.call_id = header_.call_id;
+    header.priority = header_.priority;
+    header.flags = flags;
+    return header;
+  }
+
+  // with the lock held, bytes read by the reader, the credit to grant if it is time
+  size_t Consume(size_t bytes) {
+    unacknowledged_ += bytes;
+    if (unacknowledged_ < window_ / 2 || read_end_) {
+      return 0;
+    }
+    size_t grant = unacknowledged_;
+    unacknowledged_ = 0;
+    return grant;
+  }
+
+  bool Deliver(MessagePtr message, size_t bytes) {
+    RPCPromise<google::protobuf::Message> reader;
+    bool waiting = false;
+    size_t grant = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed_ || read_end_) {
+        return true;
+      }
+      // the peer had no credit left for it
+      if (buffered_bytes_ >= window_) {
+        std::cerr << "stream window exceeded!" << std::endl;
+        return false;
+      }
+      if (!readers_.empty()) {
+        reader = readers_.front();
+        readers_.pop_front();
+        waiting = true;
+        grant = Consume(bytes);
+      } else {
+        buffered_bytes_ += bytes;
+        peak_buffered_bytes_ = std::max(peak_buffered_bytes_, buffered_bytes_);
+        received_.emplace_back(Received { std::move(message), bytes });
+      }
+    }
+    if (grant) {
+      Grant(grant);
+    }
+    if (waiting) {
+      reader.SetValue(std::move(message));
+    }
+    return true;
+  }
+
+  // the peer finished, readers waiting past its last message get none
+  void End() {
+    std::deque<RPCPromise<google::protobuf::Message>> readers;
+    bool done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed_ || read_end_) {
+        return;
+      }
+      read_end_ = true;
+      readers.swap(readers_);
+      done = end_sent_;
+    }
+    if (done) {
+      Close();
+    }
+    for (auto& reader : readers) {
+      reader.SetValue();
+    }
+  }
+
+  // sends the writes the peer has room for in order, then the end once all are out
+  void Flush() {
+    std::vector<PendingWrite> sent;
+    bool done = false;
+    {
+      std::lock_guard<std::mutex> send_lock(send_mutex_);
+      std::shared_ptr<RPCBuffer> end;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed_) {
+          return;
+        }
+        // a message may overdraw the credit left, so one larger than the window goes too
+        while (!writes_.empty() && credit_ > 0) {
+          credit_ -= writes_.front().bytes;
+          sent.emplace_back(std::move(writes_.front()));
+          writes_.pop_front();
+        }
+        if (writes_.empty() && finishing_ && !end_sent_) {
+          end_sent_ = true;
+          end = std::make_shared<RPCBuffer>();
+          end->Serialize(Header(kRPCFlagStreamEnd));
+          done = read_end_;
+        }
+      }
+      for (auto& write : sent) {
+        Send(write.frame, lane_);
+      }
+      if (end) {
+        Send(end, lane_);
+      }
+    }
+    if (done) {
+      Close();
+    }
+    for (auto& write : sent) {
+      write.promise.SetValue();
+    }
+  }
+
+  void Send(const std::shared_ptr<RPCBuffer>& frame, size_t lane) {
+    std::shared_ptr<Connection> connection(connection_.lock());
+    if (!connection) {
+      Fail("not connected");
+      return;
+    }
+    connection->AsyncSend(frame, lane);
+  }
+
+  // over both ways, the connection forgets it
+  void Close() {
+    if (std::shared_ptr<RPCStreamTable> table = table_.lock()) {
+      table->Remove(header_.call_id);
+    }
+    std::function<void()> on_close;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      on_close.swap(on_close_);
+    }
+    if (on_close) {
+      on_close();
+    }
+  }
+
+  std::weak_ptr<Connection> connection_;
+  std::weak_ptr<RPCStreamTable> table_;
+  const RPCHeader header_;
+  const MessagePtr prototype_;
+  const size_t window_;
+  const size_t lane_;
+
+  // one sender at a time keeps the frames in the order written
+  std::mutex send_mutex_;
+  mutable std::mutex mutex_;
+  bool failed_ { false };
+  std::string reason_;
+  // message bytes the peer still takes, a write may overdraw it
+  int64_t credit_ { 0 };
+  std::deque<PendingWrite> writes_;
+  bool finishing_ { false };
+  bool end_sent_ { false };
+  std::deque<Received> received_;
+  std::deque<RPCPromise<google::protobuf::Message>> readers_;
+  bool read_end_ { false };
+  size_t buffered_bytes_ { 0 };
+  size_t peak_buffered_bytes_ { 0 };
+  // read but not granted back yet, granted half a window at a time
+  size_t unacknowledged_ { 0 };
+  std::function<void()> on_close_;
+};
+
+inline void RPCStreamTable::FailAll(const std::string& reason) {
+  std::unordered_map<uint64_t, std::shared_ptr<RPCStream>> streams;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    streams.swap(streams_);
+  }
+  for (auto& stream : streams) {
+    stream.second->Fail(reason);
+  }
+}
+
+}
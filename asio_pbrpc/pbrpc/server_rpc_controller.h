@@ -0,0 +1,152 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+
+#include <boost/asio.hpp>
+#include <google/protobuf/service.h>
+
+#include "rpc_buffer.h"
+
+namespace asio_pbrpc {
+
+class ServerRPCController : public google::protobuf::RpcController {
+ public:
+  virtual ~ServerRPCController() {
+    Finish();
+  }
+
+  void Reset() override {
+    reason_.clear();
+    failed_.store(false, std::memory_order_relaxed);
+    request_attachments_.clear();
+    response_attachments_.clear();
+  }
+
+  bool Failed() const override {
+    return failed_.load(std::memory_order_acquire);
+  }
+
+  std::string ErrorText() const override {
+    return reason_;
+  }
+
+  // client side only
+  void StartCancel() override {}
+
+  void SetFailed(const std::string& reason) override {
+    reason_ = reason;
+    failed_.store(true, std::memory_order_release);
+  }
+
+  bool IsCanceled() const override {
+    return canceled_.load(std::memory_order_acquire);
+  }
+
+  // run exactly once, when the call is canceled or else once it is finished,
+  // at once if either already happened
+  void NotifyOnCancel(google::protobuf::Closure* callback) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!canceled_.load(std::memory_order_relaxed) && !finished_) {
+        cancel_callback_ = callback;
+        return;
+      }
+    }
+    callback->Run();
+  }
+
+  // the client gave up on the call
+  void Cancel() {
+    google::protobuf::Closure* callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_ || canceled_.exchange(true, std::memory_order_acq_rel)) {
+        return;
+      }
+      callback = cancel_callback_;
+      cancel_callback_ = nullptr;
+    }
+    if (callback) {
+      callback->Run();
+    }
+  }
+
+  // the call is done, a cancel callback still waiting runs now
+  void Finish() {
+    google::protobuf::Closure* callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+      callback = cancel_callback_;
+      cancel_callback_ = nullptr;
+    }
+    if (callback) {
+      callback->Run();
+    }
+  }
+
+  // microseconds since the system clock epoch, 0 if the client set none
+  int64_t deadline() const {
+    return deadline_;
+  }
+  void deadline(int64_t deadline) {
+    deadline_ = deadline;
+  }
+
+  // event loop of the connection the call came in on, coroutine handlers resume there
+  boost::asio::io_service& io_service() const {
+    assert(io_service_);
+    return *io_service_;
+  }
+  void io_service(boost::asio::io_service& io_service) {
+    io_service_ = &io_service;
+  }
+
+  // received after the request message, valid while the controller holds them
+  const RPCAttachments& request_attachments() const {
+    return request_attachments_;
+  }
+  void request_attachments(RPCAttachments attachments) {
+    request_attachments_ = std::move(attachments);
+  }
+
+  // raw bytes sent after the response message without being copied,
+  // the owner keeps them valid until sent, none for bytes outliving the server
+  void AddResponseAttachment(const char* data, size_t size,
+      std::shared_ptr<const void> owner = nullptr) {
+    response_attachments_.emplace_back(RPCAttachment { data, size, std::move(owner) });
+  }
+  // size bytes of the file from offset, streamed after the response message with sendfile
+  // and never read into memory, the owner keeps the descriptor open until sent
+  void AddResponseFile(int fd, off_t offset, size_t size,
+      std::shared_ptr<const void> owner = nullptr) {
+    response_attachments_.emplace_back(RPCAttachment { nullptr, size, std::move(owner), fd,
+        offset });
+  }
+  const RPCAttachments& response_attachments() const {
+    return response_attachments_;
+  }
+
+ private:
+  std::string reason_;
+  std::atomic_bool failed_ { false };
+  std::atomic_bool canceled_ { false };
+  std::mutex mutex_;
+  google::protobuf::Closure* cancel_callback_ { nullptr };
+  bool finished_ { false };
+  int64_t deadline_ { 0 };
+  boost::asio::io_service* io_service_ { nullptr };
+  RPCAttachments request_attachments_;
+  RPCAttachments response_attachments_;
+};
+
+}
@@ -0,0 +1,300 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/service.h>
+
+#include "pooled_rpc_channel.h"
+
+namespace asio_pbrpc {
+
+// RpcChannel routing every call to a shard by a key taken from the request.
+// Shards are placed with maglev hashing: a lookup is one table index,
+// and adding or removing a shard only remaps keys of about that shard's share.
+// Each shard is a PooledRPCChannel over the shard's replicas.
+// Calls route through an immutable table swapped atomically on every change,
+// a removed shard stays alive until its in-flight calls have finished.
+class ShardedRPCChannel : public google::protobuf::RpcChannel {
+ public:
+  // returns false if the request has no key
+  typedef std::function<bool(const google::protobuf::MethodDescriptor*,
+      const google::protobuf::Message&, uint64_t&)> KeyExtractor;
+
+  ShardedRPCChannel(boost::asio::io_service& io_service, Executor& executor,
+      size_t connections_per_endpoint = 2) :
+    io_service_(io_service), executor_(executor),
+    connections_per_endpoint_(connections_per_endpoint) {}
+
+  // the name places the shard on the ring, keep it stable across restarts
+  void AddShard(const std::string& name,
+      const std::vector<std::pair<std::string, int>>& endpoints) {
+    std::shared_ptr<Shard> shard(std::make_shared<Shard>());
+    shard->name = name;
+    shard->channel = std::make_shared<PooledRPCChannel>(io_service_, executor_,
+        connections_per_endpoint_);
+    for (auto& endpoint : endpoints) {
+      shard->channel->AddEndpoint(endpoint.first, endpoint.second);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Table> table(std::make_shared<Table>(*Load()));
+    Erase(*table, name);
+    table->shards.emplace_back(shard);
+    Rebuild(*table);
+    Publish(table);
+  }
+
+  void RemoveShard(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Table> table(std::make_shared<Table>(*Load()));
+    Erase(*table, name);
+    Rebuild(*table);
+    Publish(table);
+  }
+
+  // used for methods without a key field
+  void key_extractor(KeyExtractor key_extractor) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Table> table(std::make_shared<Table>(*Load()));
+    table->key_extractor = std::make_shared<KeyExtractor>(std::move(key_extractor));
+    Publish(table);
+  }
+
+  // dotted path of a string or integer field in the method's request, like "user.id"
+  bool key_field(const google::protobuf::MethodDescriptor* method, const std::string& path) {
+    std::vector<const google::protobuf::FieldDescriptor*> fields;
+    const google::protobuf::Descriptor* descriptor = method->input_type();
+    for (size_t begin = 0; begin <= path.size(); ) {
+      size_t end = std::min(path.find('.', begin), path.size());
+      const google::protobuf::FieldDescriptor* field = descriptor ?
+          descriptor->FindFieldByName(path.substr(begin, end - begin)) : nullptr;
+      if (!field || field->is_repeated()) {
+        std::cerr << "bad key field " << path << " of " << method->full_name() << std::endl;
+        return false;
+      }
+      fields.emplace_back(field);
+      descriptor = field->message_type();
+      begin = end + 1;
+    }
+    if (fields.back()->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+      std::cerr << "bad key field " << path << " of " << method->full_name() << std::endl;
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Table> table(std::make_shared<Table>(*Load()));
+    table->key_fields[method] = std::move(fields);
+    Publish(table);
+    return true;
+  }
+
+  void CallMethod(const google::protobuf::MethodDescriptor* method,
+      google::protobuf::RpcController* controller,
+      const google::protobuf::Message* request,
+      google::protobuf::Message* response,
+      google::protobuf::Closure* done) override {
+    std::shared_ptr<const Table> table(Load());
+    std::shared_ptr<PooledRPCChannel> channel;
+    uint64_t key;
+    if (!ExtractKey(*table, method, *request, key)) {
+      Fail(controller, done, "no routing key");
+      return;
+    }
+    if (!(channel = Route(*table, key))) {
+      Fail(controller, done, "no shard");
+      return;
+    }
+    PooledRPCChannel* raw = channel.get();
+    raw->CallMethod(method, controller, request, response,
+        new ShardCall(io_service_, std::move(channel), done));
+  }
+
+  // the shard owning a key, for callers grouping keys per shard
+  std::shared_ptr<PooledRPCChannel> Route(uint64_t key) const {
+    return Route(*Load(), key);
+  }
+
+ private:
+  ShardedRPCChannel(const ShardedRPCChannel&) = delete;
+  ShardedRPCChannel& operator=(const ShardedRPCChannel&) = delete;
+
+  // prime, much larger than the shard count
+  static const size_t kTableSize = 65537;
+
+  struct Shard {
+    std::string name;
+    std::shared_ptr<PooledRPCChannel> channel;
+  };
+
+  // never changed once published, writers copy it and swap the copy in
+  struct Table {
+    std::vector<std::shared_ptr<Shard>> shards;
+    std::vector<uint32_t> lookup;
+    std::shared_ptr<KeyExtractor> key_extractor;
+    std::unordered_map<const google::protobuf::MethodDescriptor*,
+        std::vector<const google::protobuf::FieldDescriptor*>> key_fields;
+  };
+
+  // holds the shard's channel until the call is done,
+  // the last reference of a removed shard drops on the io_service, off the channel's own stack
+  class ShardCall : public google::protobuf::Closure {
+   public:
+    ShardCall(boost::asio::io_service& io_service,
+        std::shared_ptr<PooledRPCChannel> channel, google::protobuf::Closure* done) :
+      io_service_(io_service), channel_(std::move(channel)), done_(done) {}
+
+    void Run() override {
+      boost::asio::io_service& io_service = io_service_;
+      std::shared_ptr<PooledRPCChannel> channel(std::move(channel_));
+      google::protobuf::Closure* done = done_;
+      delete this;
+      if (done) {
+        done->Run();
+      }
+      io_service.post([channel] { });
+    }
+
+   private:
+    boost::asio::io_service& io_service_;
+    std::shared_ptr<PooledRPCChannel> channel_;
+    google::protobuf::Closure* done_;
+  };
+
+  static uint64_t Mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  static void Fail(google::protobuf::RpcController* controller,
+      google::protobuf::Closure* done, const std::string& reason) {
+    if (controller) {
+      controller->SetFailed(reason);
+    }
+    if (done) {
+      done->Run();
+    }
+  }
+
+  std::shared_ptr<const Table> Load() const {
+    return std::atomic_load(&table_);
+  }
+
+  void Publish(std::shared_ptr<const Table> table) {
+    std::atomic_store(&table_, std::move(table));
+  }
+
+  static void Erase(Table& table, const std::string& name) {
+    table.shards.erase(std::remove_if(table.shards.begin(), table.shards.end(),
+        [&name](const std::shared_ptr<Shard>& shard) { return shard->name == name; }),
+        table.shards.end());
+  }
+
+  static std::shared_ptr<PooledRPCChannel> Route(const Table& table, uint64_t key) {
+    if (table.lookup.empty()) {
+      return nullptr;
+    }
+    return table.shards[table.lookup[Mix(key) % kTableSize]]->channel;
+  }
+
+  static bool ExtractKey(const Table& table, const google::protobuf::MethodDescriptor* method,
+      const google::protobuf::Message& request, uint64_t& key) {
+    auto ite = table.key_fields.find(method);
+    if (ite == table.key_fields.end()) {
+      return table.key_extractor && (*table.key_extractor)(method, request, key);
+    }
+    const std::vector<const google::protobuf::FieldDescriptor*>& fields = ite->second;
+    const google::protobuf::Message* message = &request;
+    for (size_t i = 0; i + 1 < fields.size(); ++i) {
+      message = &message->GetReflection()->GetMessage(*message, fields[i]);
+    }
+    const google::protobuf::Reflection* reflection = message->GetReflection();
+    const google::protobuf::FieldDescriptor* field = fields.back();
+    switch (field->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+      std::string scratch;
+      const std::string& value = reflection->GetStringReference(*message, field, &scratch);
+      key = RPCHash(value);
+      return true;
+    }
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+      key = reflection->GetInt32(*message, field);
+      return true;
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+      key = reflection->GetInt64(*message, field);
+      return true;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+      key = reflection->GetUInt32(*message, field);
+      return true;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+      key = reflection->GetUInt64(*message, field);
+      return true;
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+      key = reflection->GetEnumValue(*message, field);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // maglev population, every shard walks its own permutation of the table
+  // and takes the next free slot in turn until the table is full
+  static void Rebuild(Table& table) {
+    std::vector<std::shared_ptr<Shard>>& shards = table.shards;
+    table.lookup.clear();
+    if (shards.empty()) {
+      return;
+    }
+    // order independent of insertion
+    std::sort(shards.begin(), shards.end(),
+        [](const std::shared_ptr<Shard>& lhs, const std::shared_ptr<Shard>& rhs) {
+      return lhs->name < rhs->name;
+    });
+    std::vector<uint64_t> offsets, skips, nexts(shards.size(), 0);
+    for (auto& shard : shards) {
+      uint64_t hash = Mix(RPCHash(shard->name));
+      offsets.emplace_back(hash % kTableSize);
+      skips.emplace_back(Mix(hash) % (kTableSize - 1) + 1);
+    }
+    std::vector<uint32_t> lookup(kTableSize, UINT32_MAX);
+    size_t filled = 0;
+    while (true) {
+      for (size_t i = 0; i < shards.size(); ++i) {
+        uint64_t slot;
+        do {
+          slot = (offsets[i] + nexts[i]++ * skips[i]) % kTableSize;
+        } while (lookup[slot] != UINT32_MAX);
+        lookup[slot] = i;
+        if (++filled == kTableSize) {
+          table.lookup.swap(lookup);
+          return;
+        }
+      }
+    }
+  }
+
+  boost::asio::io_service& io_service_;
+  Executor& executor_;
+  const size_t connections_per_endpoint_;
+  std::mutex mutex_;  // serializes writers only
+  std::shared_ptr<const Table> table_ { std::make_shared<Table>() };
+};
+
+}
@@ -6,18 +6,25 @@
 
 #pragma once
 
+#include <poll.h>
+
+#include <cerrno>
+#include <vector>
+
 #include <google/protobuf/service.h>
 
 #include <asio_pbrpc/net_trans/tcp_connection.h>
 #include <asio_pbrpc/net_trans/executor.h>
+#include "client_rpc_controller.h"
 #include "rpc_buffer.h"
+#include "rpc_deadline.h"
 
 namespace asio_pbrpc {
 
-class SyncRPCClient : public TCPConnection<RPCBuffer>,
+class SyncRPCClient : public TCPConnection<RPCBuffer, StreamProtocol>,
                   public google::protobuf::RpcChannel {
  public:
-  using TCPConnection<RPCBuffer>::TCPConnection;
+  using TCPConnection<RPCBuffer, StreamProtocol>::TCPConnection;
 
   SyncRPCClient(boost::asio::io_service& io_service, Executor& executor) :
     TCPConnection(io_service), executor_(executor) {}
@@ -28,39 +35,110 @@ class SyncRPCClient : public TCPConnection<RPCBuffer>,
       google::protobuf::RpcController* controller,
       const google::protobuf::Message* request,
       google::protobuf::Message* response,
-      google::protobuf::Closure* done) override {
-    size_t method_id = std::hash<std::string>()(method->full_name());
-    BufferPtr output_buffer(std::make_shared<RPCBuffer>());
-    output_buffer->Serialize(method_id, *request);
-    if (!SyncSend(output_buffer)) {
+      google::protobuf::Closure*) override {
+    CallMethod(RPCMethodId(method->full_name()), controller, *request, response);
+  }
+
+  // by a method id known ahead, as generated stubs call, the name is not hashed per call
+  void CallMethod(uint64_t method_id, google::protobuf::RpcController* controller,
+      const google::protobuf::Message& request, google::protobuf::Message* response) {
+    RPCHeader header;
+    header.method_id = method_id;
+    header.deadline = RPCControllerDeadline(controller);
+    header.priority = RPCControllerPriority(controller);
+    header.tenant = RPCControllerTenant(controller);
+    header.call_id = ++next_call_id_;
+    if (RPCDeadline::Expired(header.deadline)) {
+      if (controller) {
+        controller->SetFailed(RPCStatusText(kRPCDeadlineExceeded));
+      }
+      return;
+    }
+    // the send completes before returning, so one buffer serves every call,
+    // attachments are written from where they are
+    static const RPCAttachments kNoAttachments;
+    const RPCAttachments* attachments = RPCControllerAttachments(controller);
+    if (!attachments) {
+      attachments = &kNoAttachments;
+    }
+    output_buffer_->retrieve();
+    output_buffer_->Serialize(header, request, *attachments);
+    if (!SyncSend(output_buffer_, *attachments)) {
       if (controller) {
         controller->SetFailed("send failed");
       }
       return;
     }
+    uint64_t call_id = header.call_id;
+    int64_t deadline = header.deadline;
     while (true) {
-      if (!SyncReceive()) {
-        if (controller) {
-          controller->SetFailed("receive failed");
-        }
-        return;
-      }
-      size_t method_id;
-      boost::tribool ret = input_buffer()->Parse(method_id, *response);
+      boost::tribool ret = input_buffer()->Parse(header, *response, &attachment_sizes_);
       if (!ret) {
         if (controller) {
           controller->SetFailed("parse failed");
         }
         return;
-      } else if (ret) {
-        break;
+      } else if (boost::indeterminate(ret)) {
+        // the response coming after the deadline is skipped by the next call
+        if (deadline && !Readable(deadline)) {
+          if (controller) {
+            controller->SetFailed(RPCStatusText(kRPCDeadlineExceeded));
+          }
+          return;
+        }
+        if (!SyncReceive()) {
+          if (controller) {
+            controller->SetFailed("receive failed");
+          }
+          return;
+        }
+        continue;
+      }
+      RPCAttachments response_attachments;
+      if (!attachment_sizes_.empty()) {
+        response_attachments = RPCTakeAttachments(*this, attachment_sizes_);
+      }
+      // a late response to an earlier call which gave up waiting
+      if (header.call_id != call_id) {
+        continue;
+      }
+      if (ClientRPCController* client_controller =
+          dynamic_cast<ClientRPCController*>(controller)) {
+        client_controller->response_attachments(std::move(response_attachments));
       }
+      if (header.status != kRPCOk && controller) {
+        controller->SetFailed(RPCStatusText(header.status));
+      }
+      break;
     }
   }
 
+  // larger responses fail the call and close the connection, no limit by default
+  void max_message_length(size_t max_message_length) {
+    input_buffer()->max_message_length(max_message_length);
+  }
+
  private:
+  // false once the deadline passes with nothing to read,
+  // true on a socket error too, which the read then reports
+  bool Readable(int64_t deadline) {
+    while (true) {
+      std::chrono::microseconds remaining(RPCDeadline::Remaining(deadline));
+      if (remaining <= std::chrono::microseconds::zero()) {
+        return false;
+      }
+      pollfd fd = { socket().native_handle(), POLLIN, 0 };
+      int ready = ::poll(&fd, 1, static_cast<int>((remaining.count() + 999) / 1000));
+      if (ready > 0 || (ready < 0 && errno != EINTR)) {
+        return true;
+      }
+    }
+  }
+
   Executor& executor_;
-  google::protobuf::Closure* done_ { nullptr };
+  uint64_t next_call_id_ { 0 };
+  BufferPtr output_buffer_ { std::make_shared<RPCBuffer>() };
+  std::vector<size_t> attachment_sizes_;
 };
 
 }
@@ -0,0 +1,291 @@
+// Copyright 2015, Xiaojie Chen (swly@live.com). All rights reserved.
+// https://github.com/vorfeed/json
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// protoc plugin writing foo.asio_pbrpc.h next to foo.pb.h for every foo.proto:
+//   protoc --plugin=protoc-gen-asio_pbrpc --asio_pbrpc_out=DIR foo.proto
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+namespace asio_pbrpc {
+
+typedef std::map<std::string, std::string> Variables;
+
+class Generator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  bool Generate(const google::protobuf::FileDescriptor* file, const std::string& parameter,
+      google::protobuf::compiler::GeneratorContext* context,
+      std::string* error) const override {
+    std::string base(StripProto(file->name()));
+    std::unique_ptr<google::protobuf::io::ZeroCopyOutputStream> output(
+        context->Open(base + ".asio_pbrpc.h"));
+    google::protobuf::io::Printer printer(output.get(), '$');
+    Variables variables;
+    variables["source"] = file->name();
+    variables["pb_header"] = base + ".pb.h";
+    printer.Print(variables,
+        "// Generated by the asio_pbrpc protoc plugin. DO NOT EDIT!\n"
+        "// source: $source$\n"
+        "\n"
+        "#pragma once\n"
+        "\n"
+        "#include <chrono>\n"
+        "#include <cstdint>\n"
+        "#include <memory>\n"
+        "#include <string>\n"
+        "#include <unordered_map>\n"
+        "\n"
+        "#include <asio_pbrpc/pbrpc/future_rpc_client.h>\n"
+        "#include <asio_pbrpc/pbrpc/rpc_server.h>\n"
+        "#include <asio_pbrpc/pbrpc/sync_rpc_client.h>\n"
+        "#include \"$pb_header$\"\n");
+    std::vector<std::string> namespaces(Split(file->package(), '.'));
+    if (!namespaces.empty()) {
+      printer.Print("\n");
+    }
+    for (auto& name : namespaces) {
+      printer.Print(Variables { { "name", name } }, "namespace $name$ {\n");
+    }
+    for (int i = 0; i < file->service_count(); ++i) {
+      GenerateIds(printer, file->service(i));
+      GenerateDispatch(printer, file->service(i));
+      GenerateFutureStub(printer, file->service(i));
+      GenerateSyncStub(printer, file->service(i));
+    }
+    if (!namespaces.empty()) {
+      printer.Print("\n");
+    }
+    for (size_t i = 0; i < namespaces.size(); ++i) {
+      printer.Print("}\n");
+    }
+    if (printer.failed()) {
+      *error = "writing " + base + ".asio_pbrpc.h failed";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  // method ids hashed here, the same RPCMethodId gives at run time,
+  // enumerators need no out of line definitions in a header
+  static void GenerateIds(google::protobuf::io::Printer& printer,
+      const google::protobuf::ServiceDescriptor* service) {
+    Variables variables;
+    variables["service"] = service->name();
+    printer.Print(variables,
+        "\n"
+        "struct $service$Ids {\n"
+        "  enum : uint64_t {\n");
+    for (int i = 0; i < service->method_count(); ++i) {
+      printer.Print(MethodVariables(service->method(i)),
+          "    k$method$Id = $method_id$,\n");
+    }
+    printer.Print(
+        "  };\n"
+        "};\n");
+  }
+
+  // a table of the service's methods with typed thunks calling the implementation directly
+  static void GenerateDispatch(google::protobuf::io::Printer& printer,
+      const google::protobuf::ServiceDescriptor* service) {
+    Variables variables;
+    variables["service"] = service->name();
+    printer.Print(variables,
+        "\n"
+        "// $service$ dispatched without reflection, Impl has a method per rpc, called directly\n"
+        "template <class Impl>\n"
+        "struct $service$Dispatch : public $service$Ids {\n");
+    printer.Indent();
+    for (int i = 0; i < service->method_count(); ++i) {
+      if (i) {
+        printer.Print("\n");
+      }
+      printer.Print(MethodVariables(service->method(i)),
+          "static void $method$(void* service, ::asio_pbrpc::ServerRPCController* controller,\n"
+          "    const ::google::protobuf::Message* request, ::google::protobuf::Message* response,\n"
+          "    ::google::protobuf::Closure* done) {\n"
+          "  static_cast<Impl*>(service)->$method$(controller,\n"
+          "      static_cast<const $request$*>(request),\n"
+          "      static_cast<$response$*>(response), done);\n"
+          "}\n");
+    }
+    printer.Print(variables,
+        "\n"
+        "static constexpr ::asio_pbrpc::RPCTypedMethod kMethods[] = {\n");
+    for (int i = 0; i < service->method_count(); ++i) {
+      printer.Print(MethodVariables(service->method(i)),
+          "  { \"$method$\", \"$full_name$\", k$method$Id,\n"
+          "    &::asio_pbrpc::RPCNewMessage<$request$>,\n"
+          "    &::asio_pbrpc::RPCNewMessage<$response$>, &$method$ },\n");
+    }
+    printer.Print("};\n");
+    printer.Outdent();
+    printer.Print(variables, "};\n");
+    printer.Print(variables,
+        "\n"
+        "template <class Impl>\n"
+        "constexpr ::asio_pbrpc::RPCTypedMethod $service$Dispatch<Impl>::kMethods[];\n"
+        "\n"
+        "// priorities by method name, unlisted methods are normal\n"
+        "template <class Impl>\n"
+        "void Register$service$(::asio_pbrpc::RPCServer& server, std::shared_ptr<Impl> service,\n"
+        "    const std::unordered_map<std::string, ::asio_pbrpc::RPCPriority>& priorities = {}) {\n"
+        "  server.RegisterService(service, $service$Dispatch<Impl>::kMethods,\n"
+        "      sizeof($service$Dispatch<Impl>::kMethods) /\n"
+        "      sizeof($service$Dispatch<Impl>::kMethods[0]), priorities);\n"
+        "}\n");
+  }
+
+  // calls returning a future owning its response, co_await-able with rpc_coroutine.h
+  static void GenerateFutureStub(google::protobuf::io::Printer& printer,
+      const google::protobuf::ServiceDescriptor* service) {
+    Variables variables;
+    variables["service"] = service->name();
+    printer.Print(variables,
+        "\n"
+        "// typed calls on a FutureRPCClient, without descriptors, controllers or callbacks to manage\n"
+        "class $service$FutureStub : public $service$Ids {\n"
+        " public:\n"
+        "  explicit $service$FutureStub(std::shared_ptr<::asio_pbrpc::FutureRPCClient> client) :\n"
+        "    client_(std::move(client)) {}\n");
+    printer.Indent();
+    for (int i = 0; i < service->method_count(); ++i) {
+      printer.Print(MethodVariables(service->method(i)),
+          "\n"
+          "::asio_pbrpc::RPCFuture<$response$> $method$(const $request$& request,\n"
+          "    const ::asio_pbrpc::ClientRPCController* options = nullptr) {\n"
+          "  return client_->Call<$response$>(k$method$Id, request, options);\n"
+          "}\n");
+    }
+    printer.Outdent();
+    printer.Print(
+        "\n"
+        " private:\n"
+        "  std::shared_ptr<::asio_pbrpc::FutureRPCClient> client_;\n"
+        "};\n");
+  }
+
+  // blocking calls on a SyncRPCClient, which reuses one buffer for the requests
+  static void GenerateSyncStub(google::protobuf::io::Printer& printer,
+      const google::protobuf::ServiceDescriptor* service) {
+    Variables variables;
+    variables["service"] = service->name();
+    printer.Print(variables,
+        "\n"
+        "class $service$SyncStub : public $service$Ids {\n"
+        " public:\n"
+        "  explicit $service$SyncStub(::asio_pbrpc::SyncRPCClient& client) : client_(client) {}\n");
+    printer.Indent();
+    for (int i = 0; i < service->method_count(); ++i) {
+      printer.Print(MethodVariables(service->method(i)),
+          "\n"
+          "// the server gives up after timeout, zero for no deadline but the inherited one,\n"
+          "// false with the reason in error on failure\n"
+          "bool $method$(const $request$& request, $response$* response,\n"
+          "    const std::chrono::microseconds& timeout = std::chrono::microseconds::zero(),\n"
+          "    std::string* error = nullptr) {\n"
+          "  ::asio_pbrpc::ClientRPCController controller;\n"
+          "  if (timeout.count()) {\n"
+          "    controller.timeout(timeout);\n"
+          "  }\n"
+          "  $method$(&controller, request, response);\n"
+          "  if (controller.Failed() && error) {\n"
+          "    *error = controller.ErrorText();\n"
+          "  }\n"
+          "  return !controller.Failed();\n"
+          "}\n"
+          "// priority and tenant from the controller too\n"
+          "void $method$(::asio_pbrpc::ClientRPCController* controller, const $request$& request,\n"
+          "    $response$* response) {\n"
+          "  client_.CallMethod(k$method$Id, controller, request, response);\n"
+          "}\n");
+    }
+    printer.Outdent();
+    printer.Print(
+        "\n"
+        " private:\n"
+        "  ::asio_pbrpc::SyncRPCClient& client_;\n"
+        "};\n");
+  }
+
+  static Variables MethodVariables(const google::protobuf::MethodDescriptor* method) {
+    Variables variables;
+    variables["service"] = method->service()->name();
+    variables["method"] = method->name();
+    variables["full_name"] = method->full_name();
+    variables["method_id"] = MethodId(method->full_name());
+    variables["request"] = ClassName(method->input_type());
+    variables["response"] = ClassName(method->output_type());
+    return variables;
+  }
+
+  // the same hash as RPCMethodId
+  static std::string MethodId(const std::string& full_name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : full_name) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "0x%016llxULL", static_cast<unsigned long long>(hash));
+    return text;
+  }
+
+  // fully qualified C++ name of a generated message class
+  static std::string ClassName(const google::protobuf::Descriptor* message) {
+    std::string name(message->name());
+    for (const google::protobuf::Descriptor* outer = message->containing_type(); outer;
+        outer = outer->containing_type()) {
+      name = outer->name() + "_" + name;
+    }
+    std::string qualified;
+    for (auto& part : Split(message->file()->package(), '.')) {
+      qualified += "::" + part;
+    }
+    return qualified + "::" + name;
+  }
+
+  static std::string StripProto(const std::string& file_name) {
+    for (const std::string suffix : { ".protodevel", ".proto" }) {
+      if (file_name.size() > suffix.size() &&
+          file_name.compare(file_name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        return file_name.substr(0, file_name.size() - suffix.size());
+      }
+    }
+    return file_name;
+  }
+
+  static std::vector<std::string> Split(const std::string& text, char delimiter) {
+    std::vector<std::string> parts;
+    for (size_t begin = 0; begin < text.size(); ) {
+      size_t end = text.find(delimiter, begin);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      if (end > begin) {
+        parts.emplace_back(text.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+    return parts;
+  }
+};
+
+}
+
+int main(int argc, char* argv[]) {
+  asio_pbrpc::Generator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
@@ -3,11 +3,12 @@
 
 using namespace asio_pbrpc;
 
-int main(int argc, char* argv[]) {
+int main() {
   boost::asio::io_service ios;
   Executor executor;
   std::shared_ptr<AsyncRPCClient> client(std::make_shared<AsyncRPCClient>(ios, executor));
-  if (!client->SyncConnect("127.0.0.1", 6666)) {
+  // by the server's Unix domain socket, it is on this host
+  if (!client->SyncConnect("/tmp/asio_pbrpc.sock")) {
     return -1;
   }
   std::thread t([&ios] {
@@ -42,7 +43,7 @@ int main(int argc, char* argv[]) {
   std::cout << "async rpc client send one discard message '" << discard_request.message() <<
       "' to server" << std::endl;
   one_stub.Discard(&rpc_controller, &discard_request, &discard_response,
-      google::protobuf::NewCallback<EchoResponse*>([](EchoResponse* echo_response) {
+      google::protobuf::NewCallback<EchoResponse*>([](EchoResponse*) {
     std::cout << "async rpc client receive one discard message from server" << std::endl;
   }, &echo_response));
   client->Wait();
@@ -0,0 +1,58 @@
+#include <asio_pbrpc/asio_pbrpc.h>
+#include "rpc.pb.h"
+
+using namespace asio_pbrpc;
+
+// two dependent echoes and a pause, no thread waits in between
+RPCFuture<std::string> EchoTwice(std::shared_ptr<FutureRPCClient> client,
+    boost::asio::io_service& ios, std::string message) {
+  const google::protobuf::MethodDescriptor* echo =
+      OneService::descriptor()->FindMethodByName("Echo");
+  EchoRequest echo_request;
+  echo_request.set_message(message);
+  RPCFuture<EchoResponse> first = co_await client->Call<EchoResponse>(echo, echo_request);
+  if (first.Failed()) {
+    throw std::runtime_error(first.ErrorText());
+  }
+  co_await RPCSleep(ios, std::chrono::milliseconds(1));
+  echo_request.set_message(first.value().response() + " again");
+  RPCFuture<EchoResponse> second = co_await client->Call<EchoResponse>(echo, echo_request);
+  if (second.Failed()) {
+    throw std::runtime_error(second.ErrorText());
+  }
+  co_return second.value().response();
+}
+
+int main() {
+  boost::asio::io_service ios;
+  Executor executor;
+  std::shared_ptr<FutureRPCClient> client(std::make_shared<FutureRPCClient>(ios, executor));
+  if (!client->SyncConnect("127.0.0.1", 6666)) {
+    return -1;
+  }
+  std::thread t([&ios] {
+    boost::asio::io_service::work work(ios);
+    ios.run();
+  });
+
+  const int kFlows = 16;
+  std::cout << "coroutine client start " << kFlows << " echo flows" << std::endl;
+  std::vector<RPCFuture<std::string>> flows;
+  for (int i = 0; i < kFlows; ++i) {
+    flows.emplace_back(EchoTwice(client, ios, "echo " + std::to_string(i) +
+        " from coroutine client"));
+  }
+  RPCFuture<void> all = WhenAll(flows);
+  all.Wait();
+  if (all.Failed()) {
+    std::cerr << "coroutine client echo flows failed: " << all.ErrorText() << std::endl;
+    return -1;
+  }
+  std::cout << "coroutine client receive " << flows.size() << " echo messages, the last '" <<
+      flows.back().value() << "' from server" << std::endl;
+
+  ios.stop();
+  t.join();
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <asio_pbrpc/asio_pbrpc.h>
+#include "rpc.pb.h"
+
+using namespace asio_pbrpc;
+
+int main() {
+  boost::asio::io_service ios;
+  Executor executor;
+  const int kTargets = 8;
+  std::vector<FanOut::Target> targets;
+  for (int i = 0; i < kTargets; ++i) {
+    targets.emplace_back(std::make_shared<AsyncRPCClient>(ios, executor));
+    if (!targets.back()->SyncConnect("127.0.0.1", 6666)) {
+      return -1;
+    }
+  }
+  std::thread t([&ios] {
+    boost::asio::io_service::work work(ios);
+    ios.run();
+  });
+
+  EchoRequest echo_request;
+  echo_request.set_message("one echo from fan out client");
+  std::cout << "fan out client send one echo message '" << echo_request.message() <<
+      "' to " << kTargets << " targets" << std::endl;
+  std::shared_ptr<FanOut> fan_out(std::make_shared<FanOut>());
+  fan_out->timeout(std::chrono::milliseconds(1000));
+  fan_out->on_response([](size_t index, const ClientRPCController& controller,
+      const google::protobuf::Message& response) {
+    if (!controller.Failed()) {
+      std::cout << "fan out client receive one echo message '" <<
+          static_cast<const EchoResponse&>(response).response() << "' from target " <<
+          index << std::endl;
+    }
+  });
+  fan_out->Start(targets, OneService::descriptor()->FindMethodByName("Echo"),
+      echo_request, EchoResponse::default_instance());
+  fan_out->Wait();
+  if (fan_out->successes() != kTargets) {
+    std::cerr << "fan out client got " << fan_out->successes() << " of " << kTargets <<
+        " echo messages" << std::endl;
+    return -1;
+  }
+
+  ios.stop();
+  t.join();
+
+  return 0;
+}
@@ -1,13 +1,14 @@
 #include <asio_pbrpc/asio_pbrpc.h>
 #include "rpc.pb.h"
+#include "rpc.asio_pbrpc.h"
 
 using namespace asio_pbrpc;
 
-int main(int argc, char* argv[]) {
+int main() {
   boost::asio::io_service ios;
   Executor executor;
-  FutureRPCClient client(ios, executor);
-  if (!client.SyncConnect("127.0.0.1", 6666)) {
+  std::shared_ptr<FutureRPCClient> client(std::make_shared<FutureRPCClient>(ios, executor));
+  if (!client->SyncConnect("127.0.0.1", 6666)) {
     return -1;
   }
   std::thread t([&ios] {
@@ -15,7 +16,7 @@ int main(int argc, char* argv[]) {
     ios.run();
   });
 
-  OneService::Stub one_stub(&client);
+  OneService::Stub one_stub(&*client);
 
   EchoRequest echo_request;
   echo_request.set_message("one echo from future client");
@@ -24,7 +25,7 @@ int main(int argc, char* argv[]) {
   std::cout << "future rpc client send one echo message '" << echo_request.message() <<
       "' to server" << std::endl;
   one_stub.Echo(&rpc_controller, &echo_request, &echo_response, nullptr);
-  client.Wait();
+  client->Wait();
   if (rpc_controller.Failed()) {
     std::cerr << "future rpc client call one echo message failed: " <<
         rpc_controller.ErrorText() << std::endl;
@@ -40,7 +41,7 @@ int main(int argc, char* argv[]) {
   std::cout << "future rpc client send one discard message '" << discard_request.message() <<
       "' to server" << std::endl;
   one_stub.Discard(&rpc_controller, &discard_request, &discard_response, nullptr);
-  client.Wait();
+  client->Wait();
   if (rpc_controller.Failed()) {
     std::cerr << "future rpc client call one discard message failed: " <<
         rpc_controller.ErrorText() << std::endl;
@@ -48,14 +49,14 @@ int main(int argc, char* argv[]) {
   }
   std::cout << "future rpc client receive one discard message from server" << std::endl;
 
-  AnotherService::Stub another_stub(&client);
+  AnotherService::Stub another_stub(&*client);
 
   echo_request.set_message("another echo from future client");
   rpc_controller.Reset();
   std::cout << "future rpc client send another echo message '" << echo_request.message() <<
       "' to server" << std::endl;
   another_stub.Echo(&rpc_controller, &echo_request, &echo_response, nullptr);
-  client.Wait();
+  client->Wait();
   if (rpc_controller.Failed()) {
     std::cerr << "future rpc client call another echo message failed: " <<
         rpc_controller.ErrorText() << std::endl;
@@ -64,6 +65,42 @@ int main(int argc, char* argv[]) {
   std::cout << "future rpc client receive another echo message '" << echo_response.response() <<
       "' from server" << std::endl;
 
+  // echo the answer of an echo, no thread blocks in between,
+  // through the generated stub whose futures own their responses
+  executor.Start();
+  OneServiceFutureStub typed_stub(client);
+  echo_request.set_message("chained echo from future client");
+  RPCFuture<EchoResponse> chained = typed_stub.Echo(echo_request).then(executor,
+      [typed_stub](RPCFuture<EchoResponse>& first) mutable {
+    if (first.Failed()) {
+      RPCPromise<EchoResponse> failed;
+      failed.SetFailed(first.ErrorText());
+      return failed.future();
+    }
+    EchoRequest echo_request;
+    echo_request.set_message(first.value().response() + " again");
+    return typed_stub.Echo(echo_request);
+  });
+  std::vector<RPCFuture<EchoResponse>> echoes;
+  for (int i = 0; i < 3; ++i) {
+    echo_request.set_message("echo " + std::to_string(i) + " from future client");
+    echoes.emplace_back(typed_stub.Echo(echo_request));
+  }
+  RPCFuture<void> all = WhenAll(chained, WhenAll(echoes));
+  all.Wait();
+  if (all.Failed()) {
+    std::cerr << "future rpc client call chained echo messages failed: " << all.ErrorText() <<
+        std::endl;
+    return -1;
+  }
+  std::cout << "future rpc client receive chained echo message '" <<
+      chained.value().response() << "' from server" << std::endl;
+  for (auto& echoed : echoes) {
+    std::cout << "future rpc client receive echo message '" << echoed.value().response() <<
+        "' from server" << std::endl;
+  }
+  executor.Stop();
+
   ios.stop();
   t.join();
 
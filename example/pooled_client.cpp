@@ -0,0 +1,55 @@
+#include <asio_pbrpc/asio_pbrpc.h>
+#include "rpc.pb.h"
+
+using namespace asio_pbrpc;
+
+int main() {
+  boost::asio::io_service ios;
+  Executor executor;
+  PooledRPCChannel channel(ios, executor, 4);
+  if (!channel.AddEndpoint("127.0.0.1", 6666)) {
+    return -1;
+  }
+  std::thread t([&ios] {
+    boost::asio::io_service::work work(ios);
+    ios.run();
+  });
+
+  OneService::Stub one_stub(&channel);
+
+  const int kCalls = 16;
+  std::vector<EchoRequest> echo_requests(kCalls);
+  std::vector<EchoResponse> echo_responses(kCalls);
+  std::vector<ClientRPCController> rpc_controllers(kCalls);
+  std::atomic_int finished { 0 };
+  std::promise<void> all_finished;
+  for (int i = 0; i < kCalls; ++i) {
+    echo_requests[i].set_message("one echo " + std::to_string(i) + " from pooled client");
+    rpc_controllers[i].timeout(std::chrono::milliseconds(1000));
+    std::cout << "pooled rpc client send one echo message '" << echo_requests[i].message() <<
+        "' to server" << std::endl;
+    one_stub.Echo(&rpc_controllers[i], &echo_requests[i], &echo_responses[i],
+        google::protobuf::NewCallback<std::atomic_int*, std::promise<void>*>(
+            [](std::atomic_int* finished, std::promise<void>* all_finished) {
+      if (finished->fetch_add(1) + 1 == kCalls) {
+        all_finished->set_value();
+      }
+    }, &finished, &all_finished));
+  }
+  all_finished.get_future().wait();
+  for (int i = 0; i < kCalls; ++i) {
+    if (rpc_controllers[i].Failed()) {
+      std::cerr << "pooled rpc client call one echo message failed: " <<
+          rpc_controllers[i].ErrorText() << std::endl;
+      return -1;
+    }
+    std::cout << "pooled rpc client receive one echo message '" << echo_responses[i].response() <<
+        "' from server" << std::endl;
+  }
+
+  channel.Stop();
+  ios.stop();
+  t.join();
+
+  return 0;
+}
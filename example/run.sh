@@ -13,5 +13,17 @@ echo -e "\n-------- start async client --------"
 sleep 1
 echo -e "\n-------- start future client --------"
 ./future_client
+sleep 1
+echo -e "\n-------- start pooled client --------"
+./pooled_client
+sleep 1
+echo -e "\n-------- start fan out client --------"
+./fan_out_client
+sleep 1
+echo -e "\n-------- start stream client --------"
+./stream_client
+sleep 1
+echo -e "\n-------- start coroutine client --------"
+./coroutine_client
 kill -s INT `ps -elf | grep './server' | grep -v grep | awk '{print $4}'`
 
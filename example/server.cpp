@@ -1,25 +1,31 @@
 #include <asio_pbrpc/asio_pbrpc.h>
 #include "rpc.pb.h"
+#include "rpc.asio_pbrpc.h"
 
 using namespace asio_pbrpc;
 
-class OneServiceImpl : public asio_pbrpc::OneService {
+// dispatched by the generated table, no generic service in between
+class OneServiceImpl {
  public:
   OneServiceImpl() {}
 
-  void Echo(::google::protobuf::RpcController* controller,
+  void Echo(ServerRPCController* controller,
       const ::asio_pbrpc::EchoRequest* request,
       ::asio_pbrpc::EchoResponse* response,
-      ::google::protobuf::Closure* done) override {
+      ::google::protobuf::Closure* done) {
     std::cout << "one service received echo message: " << request->message() << std::endl;
     response->set_response(request->message());
+    // attachments go back as they arrived, without a copy
+    for (auto& attachment : controller->request_attachments()) {
+      controller->AddResponseAttachment(attachment.data, attachment.size, attachment.owner);
+    }
     done->Run();
   }
 
-  void Discard(::google::protobuf::RpcController* controller,
+  void Discard(ServerRPCController*,
       const ::asio_pbrpc::DiscardRequest* request,
-      ::asio_pbrpc::DiscardResponse* response,
-      ::google::protobuf::Closure* done) override {
+      ::asio_pbrpc::DiscardResponse*,
+      ::google::protobuf::Closure* done) {
     std::cout << "one service received discard message: " << request->message() << std::endl;
     done->Run();
   }
@@ -29,7 +35,7 @@ class AnotherServiceImpl : public asio_pbrpc::AnotherService {
  public:
   AnotherServiceImpl() {}
 
-  void Echo(::google::protobuf::RpcController* controller,
+  void Echo(::google::protobuf::RpcController*,
       const ::asio_pbrpc::EchoRequest* request,
       ::asio_pbrpc::EchoResponse* response,
       ::google::protobuf::Closure* done) override {
@@ -39,15 +45,64 @@ class AnotherServiceImpl : public asio_pbrpc::AnotherService {
   }
 };
 
+// echoes every message of a stream of one service's echo until the client finishes,
+// each read and write goes on where it completes, no worker waits for the stream
+static void EchoStream(std::shared_ptr<RPCStream> stream) {
+  stream->Read().then([stream](RPCFuture<google::protobuf::Message>& read) {
+    if (read.Failed()) {
+      std::cerr << "echo stream " << stream->id() << " broke: " << read.ErrorText() << std::endl;
+      return;
+    }
+    if (!read.value_ptr()) {
+      stream->Finish();
+      return;
+    }
+    EchoResponse response;
+    response.set_response(static_cast<const EchoRequest&>(read.value()).message());
+    // the client's window holds the writes back, the next read waits for this write
+    stream->Write(response).then([stream](RPCFuture<void>& written) {
+      if (!written.Failed()) {
+        EchoStream(stream);
+      }
+    });
+  });
+}
+
 static std::promise<void> event;
 
 int main(int argc, char* argv[]) {
   RPCServer server(6666);
-  server.RegisterService(std::make_shared<OneServiceImpl>());
+  // clients on this host may skip the TCP stack
+  server.Listen("/tmp/asio_pbrpc.sock");
+  // or skip the kernel for every call
+  server.ListenShm("/tmp/asio_pbrpc.shm");
+  // large responses leave without a copy into the socket buffer
+  server.zero_copy(64 * 1024);
+  // and go in fragments, so the small ones queued behind them are not held up
+  server.fragment_bytes(256 * 1024);
+  // ./server --io_uring, epoll otherwise
+  server.io_uring(argc > 1 && std::string(argv[1]) == "--io_uring");
+  RegisterOneService(server, std::make_shared<OneServiceImpl>(), { { "Echo", kRPCPriorityHigh } });
   server.RegisterService(std::make_shared<AnotherServiceImpl>());
+  // echoes of another service arriving together are answered in one go
+  server.RegisterBatchHandler(AnotherService::descriptor()->FindMethodByName("Echo")->full_name(),
+      [](std::vector<RPCBatchItem>& items, google::protobuf::Closure* done) {
+    for (auto& item : items) {
+      const std::string& message = static_cast<const EchoRequest*>(item.request)->message();
+      std::cout << "another service received echo message in a batch of " << items.size() <<
+          ": " << message << std::endl;
+      static_cast<EchoResponse*>(item.response)->set_response(message);
+    }
+    done->Run();
+  });
+  // streams of one service's echo go to EchoStream, plain echoes still reach OneServiceImpl
+  server.RegisterStreamHandler(OneService::descriptor()->FindMethodByName("Echo")->full_name(),
+      [](std::shared_ptr<RPCStream> stream) {
+    EchoStream(std::move(stream));
+  });
   server.Start();
   signal(SIGPIPE, SIG_IGN);
-  signal(SIGINT, [](int signal) { event.set_value(); });
+  signal(SIGINT, [](int) { event.set_value(); });
   event.get_future().get();
   server.Stop();
   return 0;
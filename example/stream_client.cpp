@@ -0,0 +1,65 @@
+#include <asio_pbrpc/asio_pbrpc.h>
+#include "rpc.pb.h"
+
+using namespace asio_pbrpc;
+
+int main() {
+  boost::asio::io_service ios;
+  Executor executor;
+  std::shared_ptr<AsyncRPCClient> client(std::make_shared<AsyncRPCClient>(ios, executor));
+  if (!client->SyncConnect("127.0.0.1", 6666)) {
+    return -1;
+  }
+  std::thread t([&ios] {
+    boost::asio::io_service::work work(ios);
+    ios.run();
+  });
+
+  // far more echoes than the window, neither end holds more than a window of them
+  const size_t kMessages = 20000;
+  const size_t kWindow = 64 << 10;
+  std::shared_ptr<RPCStream> stream(client->OpenStream(
+      OneService::descriptor()->FindMethodByName("Echo"), nullptr, kWindow));
+  std::cout << "stream rpc client write " << kMessages << " echo messages to server" << std::endl;
+  std::thread writer([stream, kMessages] {
+    EchoRequest echo_request;
+    for (size_t i = 0; i < kMessages; ++i) {
+      echo_request.set_message("stream echo " + std::to_string(i) + std::string(100, '.'));
+      RPCFuture<void> written(stream->Write(echo_request));
+      written.Wait();
+      if (written.Failed()) {
+        return;
+      }
+    }
+    stream->Finish();
+  });
+
+  size_t received = 0;
+  bool failed = false;
+  while (true) {
+    RPCFuture<google::protobuf::Message> read(stream->Read());
+    read.Wait();
+    if (read.Failed()) {
+      std::cerr << "stream rpc client read failed: " << read.ErrorText() << std::endl;
+      failed = true;
+      break;
+    }
+    if (!read.value_ptr()) {
+      break;
+    }
+    const std::string& response = static_cast<const EchoResponse&>(read.value()).response();
+    if (response != "stream echo " + std::to_string(received) + std::string(100, '.')) {
+      std::cerr << "stream rpc client received echo out of order: " << response << std::endl;
+      failed = true;
+    }
+    ++received;
+  }
+  writer.join();
+  std::cout << "stream rpc client receive " << received << " echo messages from server, " <<
+      stream->peak_buffered_bytes() << " bytes buffered at most" << std::endl;
+
+  ios.stop();
+  t.join();
+
+  return failed || received != kMessages ? -1 : 0;
+}
@@ -1,9 +1,10 @@
 #include <asio_pbrpc/asio_pbrpc.h>
 #include "rpc.pb.h"
+#include "rpc.asio_pbrpc.h"
 
 using namespace asio_pbrpc;
 
-int main(int argc, char* argv[]) {
+int main() {
   boost::asio::io_service ios;
   Executor executor;
   SyncRPCClient client(ios, executor);
@@ -57,5 +58,42 @@ int main(int argc, char* argv[]) {
   std::cout << "sync rpc client receive another echo message '" << echo_response.response() <<
       "' from server" << std::endl;
 
+  // the generated stub, with a deadline of one second
+  OneServiceSyncStub typed_stub(client);
+
+  echo_request.set_message("typed echo from sync client");
+  std::string error;
+  std::cout << "sync rpc client send typed echo message '" << echo_request.message() <<
+      "' to server" << std::endl;
+  if (!typed_stub.Echo(echo_request, &echo_response, std::chrono::seconds(1), &error)) {
+    std::cerr << "sync rpc client call typed echo message failed: " << error << std::endl;
+    return -1;
+  }
+  std::cout << "sync rpc client receive typed echo message '" << echo_response.response() <<
+      "' from server" << std::endl;
+
+  // raw bytes follow the message without being serialized, the server echoes them
+  std::shared_ptr<std::string> blob(std::make_shared<std::string>(1 << 20, 'x'));
+  echo_request.set_message("one echo with an attachment from sync client");
+  rpc_controller.Reset();
+  rpc_controller.AddRequestAttachment(blob->data(), blob->size(), blob);
+  std::cout << "sync rpc client send one echo message '" << echo_request.message() <<
+      "' with " << blob->size() << " attached byte(s) to server" << std::endl;
+  one_stub.Echo(&rpc_controller, &echo_request, &echo_response, nullptr);
+  if (rpc_controller.Failed()) {
+    std::cerr << "sync rpc client call one echo message with an attachment failed: " <<
+        rpc_controller.ErrorText() << std::endl;
+    return -1;
+  }
+  const RPCAttachments& attachments = rpc_controller.response_attachments();
+  if (attachments.size() != 1 ||
+      std::string(attachments[0].data, attachments[0].size) != *blob) {
+    std::cerr << "sync rpc client call one echo message with an attachment failed: " <<
+        "attachment mismatch" << std::endl;
+    return -1;
+  }
+  std::cout << "sync rpc client receive one echo message '" << echo_response.response() <<
+      "' with " << attachments[0].size << " attached byte(s) from server" << std::endl;
+
   return 0;
 }